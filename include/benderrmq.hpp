@@ -28,16 +28,17 @@ bitmap_str(uint_t i) {
     return out;
 }
 
+template <typename Weight, typename Index>
 struct BinaryTreeNode {
     BinaryTreeNode *left, *right;
-    uint_t data;
-    uint_t index;
+    Weight data;
+    Index index;
 
-    BinaryTreeNode(BinaryTreeNode *_left, BinaryTreeNode *_right, uint_t _data, uint_t _index)
+    BinaryTreeNode(BinaryTreeNode *_left, BinaryTreeNode *_right, Weight _data, Index _index)
 	: left(_left), right(_right), data(_data), index(_index)
     { }
 
-    BinaryTreeNode(uint_t _data, uint_t _index)
+    BinaryTreeNode(Weight _data, Index _index)
 	: left(NULL), right(NULL), data(_data), index(_index)
     { }
 };
@@ -45,11 +46,11 @@ struct BinaryTreeNode {
 template <typename T>
 class SimpleFixedObjectAllocator {
     T *memory;
-    uint_t n;
-    uint_t start;
+    size_t n;
+    size_t start;
 
 public:
-    SimpleFixedObjectAllocator(uint_t _n)
+    SimpleFixedObjectAllocator(size_t _n)
         : memory(NULL), n(_n), start(0) {
         memory = (T*)operator new(sizeof(T) * n);
     }
@@ -75,23 +76,24 @@ public:
 /* This is a destructive function - one which deletes the tree rooted
  * at node n
  */
+template <typename Weight, typename Index>
 void
-euler_tour(BinaryTreeNode *n, 
-	   vui_t &output, /* Where the output is written. Should be empty */
-	   vui_t &levels, /* Where the level for each node is written. Should be empty */
-	   vui_t &mapping /* mapping stores representative
+euler_tour(BinaryTreeNode<Weight, Index> *n, 
+	   std::vector<Weight, IndexAllocator<Weight> > &output, /* Where the output is written. Should be empty */
+	   std::vector<Index> &levels, /* Where the level for each node is written. Should be empty */
+	   std::vector<Index, IndexAllocator<Index> > &mapping /* mapping stores representative
                              indexes which maps from the original index to the index
                              into the euler tour array, which is a +- RMQ */, 
-	   vui_t &rev_mapping /* Reverse mapping to go from +-RMQ
+	   std::vector<Index, IndexAllocator<Index> > &rev_mapping /* Reverse mapping to go from +-RMQ
 				 indexes to user provided indexes */, 
-	   int level = 1) {
-    DPRINTF("euler_tour(%d, %d)\n", n?n->data:-1, n?n->index:-1);
+	   Index level = 1) {
+    DPRINTF("euler_tour(%lld, %lld)\n", n?(long long)n->data:-1, n?(long long)n->index:-1);
     if (!n) {
 	return;
     }
     output.push_back(n->data);
     mapping[n->index] = output.size() - 1;
-    DPRINTF("mapping[%d] = %d\n", n->index, mapping[n->index]);
+    DPRINTF("mapping[%llu] = %llu\n", (unsigned long long)n->index, (unsigned long long)mapping[n->index]);
     rev_mapping.push_back(n->index);
     levels.push_back(level);
     if (n->left) {
@@ -113,66 +115,71 @@ euler_tour(BinaryTreeNode *n,
     // delete n;
 }
 
-BinaryTreeNode*
-make_cartesian_tree(vui_t const &input, SimpleFixedObjectAllocator<BinaryTreeNode> &alloc) {
-    BinaryTreeNode *curr = NULL;
-    std::stack<BinaryTreeNode*> stk;
+template <typename Weight, typename Index>
+BinaryTreeNode<Weight, Index>*
+make_cartesian_tree(std::vector<Weight> const &input,
+                    SimpleFixedObjectAllocator<BinaryTreeNode<Weight, Index> > &alloc) {
+    typedef BinaryTreeNode<Weight, Index> node_t;
+    node_t *curr = NULL;
+    std::stack<node_t*> stk;
 
     if (input.empty()) {
 	return NULL;
     }
 
-    for (uint_t i = 0; i < input.size(); ++i) {
+    for (size_t i = 0; i < input.size(); ++i) {
 	curr = alloc.get();
-        new (curr) BinaryTreeNode(input[i], i);
-	DPRINTF("ct(%d, %d)\n", curr->data, curr->index);
+        new (curr) node_t(input[i], i);
+	DPRINTF("ct(%llu, %llu)\n", (unsigned long long)curr->data, (unsigned long long)curr->index);
 
 	if (stk.empty()) {
 	    stk.push(curr);
-	    DPRINTF("[1] stack top (%d, %d)\n", curr->data, curr->index);
+	    DPRINTF("[1] stack top (%llu, %llu)\n", (unsigned long long)curr->data, (unsigned long long)curr->index);
 	} else {
 	    if (input[i] <= stk.top()->data) {
 		// Just add it
 		stk.push(curr);
-		DPRINTF("[2] stack top (%d, %d)\n", curr->data, curr->index);
+		DPRINTF("[2] stack top (%llu, %llu)\n", (unsigned long long)curr->data, (unsigned long long)curr->index);
 	    } else {
 		// Back up till we are the largest node on the stack
-		BinaryTreeNode *top = NULL;
-		BinaryTreeNode *prev = NULL;
+		node_t *top = NULL;
+		node_t *prev = NULL;
 		while (!stk.empty() && stk.top()->data < input[i]) {
 		    prev = top;
 		    top = stk.top();
-		    DPRINTF("[1] popping & setting (%d, %d)->right = (%d, %d)\n", top->data, top->index, 
-			    prev?prev->data:-1, prev?prev->index:-1);
+		    DPRINTF("[1] popping & setting (%lld, %lld)->right = (%lld, %lld)\n", (long long)top->data, (long long)top->index, 
+			    prev?(long long)prev->data:-1, prev?(long long)prev->index:-1);
 		    top->right = prev;
 		    stk.pop();
 		}
 		curr->left = top;
-		DPRINTF("(%d, %d)->left = (%d, %d)\n", curr->data, curr->index, top->data, top->index);
+		DPRINTF("(%llu, %llu)->left = (%llu, %llu)\n", (unsigned long long)curr->data, (unsigned long long)curr->index,
+			(unsigned long long)top->data, (unsigned long long)top->index);
 		stk.push(curr);
-		DPRINTF("stack top is now (%d, %d)\n", curr->data, curr->index);
+		DPRINTF("stack top is now (%llu, %llu)\n", (unsigned long long)curr->data, (unsigned long long)curr->index);
 	    }
 	}
     }
 
     assert(!stk.empty());
-    BinaryTreeNode *top = NULL;
-    BinaryTreeNode *prev = NULL;
+    node_t *top = NULL;
+    node_t *prev = NULL;
     while (!stk.empty()) {
 	prev = top;
 	top = stk.top();
-	DPRINTF("[2] popping & setting (%d, %d)->right = (%d, %d)\n", top->data, top->index, 
-		prev?prev->data:-1, prev?prev->index:-1);
+	DPRINTF("[2] popping & setting (%lld, %lld)->right = (%lld, %lld)\n", (long long)top->data, (long long)top->index, 
+		prev?(long long)prev->data:-1, prev?(long long)prev->index:-1);
 	top->right = prev;
 	stk.pop();
     }
-    DPRINTF("returning top = (%d, %d)\n", top->data, top->index);
+    DPRINTF("returning top = (%llu, %llu)\n", (unsigned long long)top->data, (unsigned long long)top->index);
 
     return top;
 }
 
+template <typename Weight, typename Index>
 std::string
-toGraphViz(BinaryTreeNode* par, BinaryTreeNode *n) {
+toGraphViz(BinaryTreeNode<Weight, Index>* par, BinaryTreeNode<Weight, Index> *n) {
     if (!n) {
 	return "";
     }
@@ -258,6 +265,19 @@ public:
 	return repr[index][l][u];
     }
 
+    // Approximate # of bytes used by this structure.
+    size_t
+    memory_usage() const {
+	size_t bytes = repr.capacity() * sizeof(char_array_2d_t);
+	for (size_t i = 0; i < repr.size(); ++i) {
+	    bytes += repr[i].capacity() * sizeof(char_array_1d_t);
+	    for (size_t j = 0; j < repr[i].size(); ++j) {
+		bytes += repr[i][j].capacity();
+	    }
+	}
+	return bytes;
+    }
+
     void
     show_tables() {
 	if (repr.empty()) {
@@ -291,7 +311,20 @@ public:
 
 };
 
+/* Weight is the type of the values & Index the type of the indexes
+ * into them. Since indexes into the Euler Tour (of up to 2n elements)
+ * are stored as Index too, a 32-bit Index can hold at most 2G
+ * elements.
+ */
+template <typename Weight = uint_t, typename Index = uint_t>
 class BenderRMQ {
+public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+    // first -> value, second -> index
+    typedef std::pair<Weight, Index> value_type;
+
+private:
     /* For inputs < MIN_SIZE_FOR_BENDER_RMQ in size, we use just the
      * sparse table.
      *
@@ -303,32 +336,32 @@ class BenderRMQ {
      * most 16.
      *
      */
-    SparseTable st;
+    SparseTable<Weight, Index> st;
     LookupTables lt;
 
     /* The data after euler tour computation (for +-RMQ) */
-    vui_t euler;
+    std::vector<Weight, IndexAllocator<Weight> > euler;
 
     /* mapping stores the mapping of original indexes to indexes
      * within our re-written (using euler tour) structure).
      */
-    vui_t mapping;
+    std::vector<Index, IndexAllocator<Index> > mapping;
 
     /* Stores the bitmask corresponding to a block of size (1/2)(lg n) */
-    vui_t table_map;
+    std::vector<uint_t, IndexAllocator<uint_t> > table_map;
 
     /* Stores the mapping from +-RMQ indexes to actual indexes */
-    vui_t rev_mapping;
+    std::vector<Index, IndexAllocator<Index> > rev_mapping;
 
     /* The real length of input that the user gave us */
-    uint_t len;
+    Index len;
 
     int lgn_by_2;
-    int _2n_lgn;
+    size_t _2n_lgn;
 
 public:
 
-    void initialize(vui_t const& elems) {
+    void initialize(std::vector<Weight> const& elems) {
 	len = elems.size();
 
 	if (len < MIN_SIZE_FOR_BENDER_RMQ) {
@@ -336,14 +369,14 @@ public:
 	    return;
 	}
 
-	vui_t levels;
-        SimpleFixedObjectAllocator<BinaryTreeNode> alloc(len);
+	std::vector<Index> levels;
+        SimpleFixedObjectAllocator<BinaryTreeNode<Weight, Index> > alloc(len);
 
 	euler.reserve(elems.size() * 2);
 	mapping.resize(elems.size());
-	BinaryTreeNode *root = make_cartesian_tree(elems, alloc);
+	BinaryTreeNode<Weight, Index> *root = make_cartesian_tree(elems, alloc);
 
-	DPRINTF("GraphViz (paste at: http://ashitani.jp/gv/):\n%s\n", toGraphViz(NULL, root).c_str());
+	DPRINTF("GraphViz (paste at: http://ashitani.jp/gv/):\n%s\n", toGraphViz<Weight, Index>(NULL, root).c_str());
 
 	euler_tour(root, euler, levels, mapping, rev_mapping);
 
@@ -353,23 +386,23 @@ public:
 	assert_eq(levels.size(), euler.size());
 	assert_eq(levels.size(), rev_mapping.size());
 
-	uint_t n = euler.size();
-	lgn_by_2 = log2(n) / 2;
+	const size_t n = euler.size();
+	lgn_by_2 = log2((uint64_t)n) / 2;
 	_2n_lgn  = n / lgn_by_2 + 1;
 
-	DPRINTF("n = %u, lgn/2 = %d, 2n/lgn = %d\n", n, lgn_by_2, _2n_lgn);
+	DPRINTF("n = %llu, lgn/2 = %d, 2n/lgn = %llu\n", (unsigned long long)n, lgn_by_2, (unsigned long long)_2n_lgn);
 	lt.initialize(lgn_by_2);
 
 	table_map.resize(_2n_lgn);
-	vui_t reduced;
+	std::vector<Weight> reduced;
 
-	for (uint_t i = 0; i < n; i += lgn_by_2) {
-	    uint_t max_in_block = euler[i];
-	    int bitmap = 1L;
-	    DPRINTF("Sequence: (%u, ", euler[i]);
+	for (size_t i = 0; i < n; i += lgn_by_2) {
+	    Weight max_in_block = euler[i];
+	    uint_t bitmap = 1L;
+	    DPRINTF("Sequence: (%llu, ", (unsigned long long)euler[i]);
 	    for (int j = 1; j < lgn_by_2; ++j) {
-		int curr_level, prev_level;
-		uint_t value;
+		Index curr_level, prev_level;
+		Weight value;
 		if (i+j < n) {
 		    curr_level = levels[i+j];
 		    prev_level = levels[i+j-1];
@@ -383,49 +416,49 @@ public:
 		const uint_t bit = (curr_level < prev_level);
 		bitmap |= (bit << j);
 		max_in_block = std::max(max_in_block, value);
-		DPRINTF("%u, ", value);
+		DPRINTF("%llu, ", (unsigned long long)value);
 	    }
 	    DPRINTF("), Bitmap: %s\n", bitmap_str(bitmap).c_str());
 	    table_map[i / lgn_by_2] = bitmap;
 	    reduced.push_back(max_in_block);
 	}
 
-        DPRINTF("reduced.size(): %u\n", reduced.size());
+        DPRINTF("reduced.size(): %llu\n", (unsigned long long)reduced.size());
 	st.initialize(reduced);
 	DCERR("initialize() completed"<<endl);
     }
 
     // qf & ql are indexes; both inclusive.
     // Return: first -> value, second -> index
-    pui_t
-    query_max(uint_t qf, uint_t ql) {
+    value_type
+    query_max(Index qf, Index ql) {
         if (qf >= this->len || ql >= this->len || ql < qf) {
-            return make_pair(minus_one, minus_one);
+            return value_type((Weight)-1, (Index)-1);
         }
 
 	if (len < MIN_SIZE_FOR_BENDER_RMQ) {
             return st.query_max(qf, ql);
         }
 
-	DPRINTF("[1] (qf, ql) = (%d, %d)\n", qf, ql);
+	DPRINTF("[1] (qf, ql) = (%llu, %llu)\n", (unsigned long long)qf, (unsigned long long)ql);
 	// Map to +-RMQ co-ordinates
 	qf = mapping[qf];
 	ql = mapping[ql];
-	DPRINTF("[2] (qf, ql) = (%d, %d)\n", qf, ql);
+	DPRINTF("[2] (qf, ql) = (%llu, %llu)\n", (unsigned long long)qf, (unsigned long long)ql);
 
 	if (qf > ql) {
 	    std::swap(qf, ql);
-	    DPRINTF("[3] (qf, ql) = (%d, %d)\n", qf, ql);
+	    DPRINTF("[3] (qf, ql) = (%llu, %llu)\n", (unsigned long long)qf, (unsigned long long)ql);
 	}
 
 	// Determine whether we need to query 'st'.
-	const uint_t first_block_index = qf / lgn_by_2;
-	const uint_t last_block_index = ql / lgn_by_2;
+	const size_t first_block_index = qf / lgn_by_2;
+	const size_t last_block_index = ql / lgn_by_2;
 
-	DPRINTF("first_block_index: %u, last_block_index: %u\n", 
-		first_block_index, last_block_index);
+	DPRINTF("first_block_index: %llu, last_block_index: %llu\n", 
+		(unsigned long long)first_block_index, (unsigned long long)last_block_index);
 
-	pui_t ret(0, 0);
+	value_type ret(0, 0);
 
         /* Main logic:
          *
@@ -451,7 +484,7 @@ public:
 	    // Now perform an in-block query to get the index of the
 	    // max value as it appears in 'euler'.
 	    const uint_t bitmapx = table_map[ret.second];
-	    const uint_t imax = lt.query_max(bitmapx, 0, lgn_by_2-1) + ret.second*lgn_by_2;
+	    const size_t imax = lt.query_max(bitmapx, 0, lgn_by_2-1) + (size_t)ret.second*lgn_by_2;
 	    ret.second = imax;
 	} else if (first_block_index == last_block_index) {
 	    // The query is completely within a block.
@@ -459,8 +492,8 @@ public:
 	    DPRINTF("bitmapx: %s\n", bitmap_str(bitmapx).c_str());
 	    qf %= lgn_by_2;
 	    ql %= lgn_by_2;
-	    const uint_t imax = lt.query_max(bitmapx, qf, ql) + first_block_index*lgn_by_2;
-	    ret = make_pair(euler[imax], rev_mapping[imax]);
+	    const size_t imax = lt.query_max(bitmapx, qf, ql) + first_block_index*lgn_by_2;
+	    ret = value_type(euler[imax], rev_mapping[imax]);
 	    return ret;
 	}
 
@@ -478,36 +511,53 @@ public:
 	DPRINTF("bitmap1: %s, bitmap2: %s\n", bitmap_str(bitmap1).c_str(),
 		bitmap_str(bitmap2).c_str());
 
-	uint_t max1i = lt.query_max(bitmap1, f1, f2);
-	uint_t max2i = lt.query_max(bitmap2, l1, l2);
+	size_t max1i = lt.query_max(bitmap1, f1, f2);
+	size_t max2i = lt.query_max(bitmap2, l1, l2);
 
-	DPRINTF("max1i: %u, max2i: %u\n", max1i, max2i);
+	DPRINTF("max1i: %llu, max2i: %llu\n", (unsigned long long)max1i, (unsigned long long)max2i);
 
 	max1i += first_block_index * lgn_by_2;
 	max2i += last_block_index * lgn_by_2;
 
 	if (last_block_index - first_block_index > 1) {
 	    // 3-way max
-	    DPRINTF("ret: %u, max1: %u, max2: %u\n", ret.first, euler[max1i], euler[max2i]);
+	    DPRINTF("ret: %llu, max1: %llu, max2: %llu\n", (unsigned long long)ret.first,
+		    (unsigned long long)euler[max1i], (unsigned long long)euler[max2i]);
 	    if (ret.first > euler[max1i] && ret.first > euler[max2i]) {
 		ret.second = rev_mapping[ret.second];
 	    } else if (euler[max1i] >= ret.first && euler[max1i] >= euler[max2i]) {
-		ret = make_pair(euler[max1i], rev_mapping[max1i]);
+		ret = value_type(euler[max1i], rev_mapping[max1i]);
 	    } else if (euler[max2i] >= ret.first && euler[max2i] >= euler[max1i]) {
-		ret = make_pair(euler[max2i], rev_mapping[max2i]);
+		ret = value_type(euler[max2i], rev_mapping[max2i]);
 	    }
 	} else {
 	    // 2-way max
 	    if (euler[max1i] > euler[max2i]) {
-		ret = make_pair(euler[max1i], rev_mapping[max1i]);
+		ret = value_type(euler[max1i], rev_mapping[max1i]);
 	    } else {
-		ret = make_pair(euler[max2i], rev_mapping[max2i]);
+		ret = value_type(euler[max2i], rev_mapping[max2i]);
 	    }
 	}
 
 	return ret;
     }
 
+    // Approximate # of bytes used by this structure.
+    size_t
+    memory_usage() const {
+	return st.memory_usage() + lt.memory_usage() +
+	    euler.capacity() * sizeof(Weight) + table_map.capacity() * sizeof(uint_t) +
+	    (mapping.capacity() + rev_mapping.capacity()) * sizeof(Index);
+    }
+
+    // Fault in every page of the tables (but the small lookup
+    // tables). See touch_memory().
+    size_t
+    touch() const {
+	return st.touch() + touch_memory(euler) + touch_memory(table_map) +
+	    touch_memory(mapping) + touch_memory(rev_mapping);
+    }
+
 };
 
 
@@ -557,7 +607,7 @@ namespace benderrmq {
         v.push_back(95);
         v.push_back(88);
 
-	BenderRMQ brmq;
+	BenderRMQ<> brmq;
         brmq.initialize(v);
 
         for (size_t i = 0; i < v.size(); ++i) {
@@ -569,6 +619,18 @@ namespace benderrmq {
             }
         }
 
+        // Values & indexes that do not fit in 32 bits.
+        std::vector<uint64_t> w(v.begin(), v.end());
+        w[3] = 5000000000ULL;
+        BenderRMQ<uint64_t, uint64_t> wbrmq;
+        wbrmq.initialize(w);
+        for (size_t i = 0; i < w.size(); ++i) {
+            for (size_t j = i; j < w.size(); ++j) {
+                const uint64_t mv = *std::max_element(w.begin() + i, w.begin() + j + 1);
+                assert(wbrmq.query_max(i, j).first == mv);
+            }
+        }
+
 	printf("\n");
         return 0;
     }
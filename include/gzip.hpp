@@ -0,0 +1,139 @@
+#if !defined LIBFACE_GZIP_HPP
+#define LIBFACE_GZIP_HPP
+
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <ctype.h>
+#include <zlib.h>
+
+using namespace std;
+
+
+// Whether an Accept-Encoding header value allows a gzip'd response,
+// i.e. it lists "gzip", "x-gzip" or "*" without a q-value of 0.
+inline bool
+accepts_gzip(const char *str, size_t len) {
+    const char *end = str + len;
+    while (str < end) {
+        const char *comma = (const char*)memchr(str, ',', end - str);
+        const char *item_end = comma ? comma : end;
+        const char *semi = (const char*)memchr(str, ';', item_end - str);
+        const char *name_end = semi ? semi : item_end;
+
+        while (str < name_end && isspace(*str)) {
+            ++str;
+        }
+        while (name_end > str && isspace(name_end[-1])) {
+            --name_end;
+        }
+        const size_t nlen = name_end - str;
+        const bool is_gzip = (nlen == 4 && !strncasecmp(str, "gzip", 4)) ||
+            (nlen == 6 && !strncasecmp(str, "x-gzip", 6)) ||
+            (nlen == 1 && *str == '*');
+
+        if (is_gzip) {
+            // Look for a "q=0", "q=0.0", etc... parameter.
+            bool refused = false;
+            for (const char *p = semi ? semi + 1 : item_end; p + 1 < item_end; ++p) {
+                if ((p[-1] == ';' || isspace(p[-1])) &&
+                    (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    refused = strtod(std::string(p + 2, item_end).c_str(), NULL) <= 0;
+                    break;
+                }
+            }
+            if (!refused) {
+                return true;
+            }
+        }
+        str = comma ? comma + 1 : end;
+    }
+    return false;
+}
+
+// Compress 'len' bytes at 'data' into 'out' in the gzip format (RFC
+// 1952) at compression level 'level'. Returns false on failure.
+inline bool
+gzip_compress(const char *data, size_t len, std::string &out, int level = 6) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS asks zlib for a gzip header & trailer.
+    if (deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    // deflateBound() doesn't account for the gzip header & trailer.
+    out.resize(deflateBound(&zs, len) + 18);
+    zs.next_in   = (Bytef*)data;
+    zs.avail_in  = len;
+    zs.next_out  = (Bytef*)&out[0];
+    zs.avail_out = out.size();
+    const int r = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return r == Z_STREAM_END;
+}
+
+
+namespace gzip {
+    inline std::string
+    gunzip(std::string const &in) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        int r = inflateInit2(&zs, 16 + MAX_WBITS);
+        assert(r == Z_OK);
+        std::string out(1 << 16, '\0');
+        zs.next_in   = (Bytef*)in.data();
+        zs.avail_in  = in.size();
+        zs.next_out  = (Bytef*)&out[0];
+        zs.avail_out = out.size();
+        r = inflate(&zs, Z_FINISH);
+        assert(r == Z_STREAM_END);
+        out.resize(zs.total_out);
+        inflateEnd(&zs);
+        return out;
+    }
+
+    inline bool
+    accepts(const char *value) {
+        return accepts_gzip(value, strlen(value));
+    }
+
+    inline int
+    test() {
+        printf("Testing gzip compression\n");
+        printf("------------------------\n");
+
+        assert(accepts("gzip"));
+        assert(accepts("deflate, gzip;q=1.0, *;q=0.5"));
+        assert(accepts(" GZIP "));
+        assert(accepts("x-gzip"));
+        assert(accepts("*"));
+        assert(accepts("gzip;q=0.001"));
+        assert(!accepts(""));
+        assert(!accepts("identity"));
+        assert(!accepts("deflate, br"));
+        assert(!accepts("gzip;q=0"));
+        assert(!accepts("gzip; q=0.000, deflate"));
+        assert(!accepts("gzipped"));
+
+        std::string in;
+        for (int i = 0; i < 100; ++i) {
+            in += "{ \"phrase\": \"duckduckgo\", \"score\": 10 },\n";
+        }
+        std::string z;
+        assert(gzip_compress(in.data(), in.size(), z));
+        assert(z.size() < in.size() / 10);
+        assert(gunzip(z) == in);
+
+        assert(gzip_compress("", 0, z));
+        assert(gunzip(z) == "");
+        printf("gzip OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_GZIP_HPP
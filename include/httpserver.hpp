@@ -9,11 +9,15 @@
 #include <map>
 #include <string>
 #include <sstream>
+#include <string.h>
 #include "libuv/include/uv.h"
 #include "http-parser/http_parser.h"
 
+#include <include/metrics.hpp>
+#include <include/mempool.hpp>
+#include <include/types.hpp>
+
 typedef std::map<std::string, std::string> headers_t;
-typedef std::map<std::string, std::string> query_strings_t;
 
 struct partial_buf_t : uv_buf_t {
     size_t size;
@@ -23,25 +27,332 @@ struct partial_buf_t : uv_buf_t {
         : uv_buf_t(buf), size(s), offset(o) { }
 };
 
+/* The responses to one or more (pipelined) requests, assembled from
+ * fragments which are handed to uv_write() as one iovec array. Large
+ * fragments that live at least as long as the write (static strings,
+ * the data store) are referenced in place. Small fragments are copied
+ * into 'owned' since a memcpy() of a few bytes is cheaper than an
+ * extra iovec entry for the kernel. A response_t is reused across
+ * requests on a connection, so once its buffers have grown to fit a
+ * typical batch of responses, building one doesn't allocate any
+ * memory.
+ *
+ * Each response starts with begin_message(), which leaves room for
+ * the headers. The body is then appended, and set_message_header()
+ * fills in the headers once the Content-Length is known.
+ */
+struct response_t {
+    // Fragments shorter than this are copied instead of referenced.
+    enum { MIN_REFERENCED_SIZE = 128 };
+
+    // If 'base' is NULL, the fragment is at offset 'offset' in 'owned'.
+    struct fragment_t {
+        const char *base;
+        size_t offset;
+        size_t len;
+    };
+
+    typedef void (*release_cb)(void*);
+
+    std::string             owned;
+    std::vector<fragment_t> fragments;
+    size_t                  size;
+    size_t                  nmessages;
+
+    // The fragment reserved for the headers of the last message & the
+    // size of the response when its body started.
+    size_t                  header_fragment;
+    size_t                  body_start;
+
+    // Callbacks to invoke once the response has been written (or the
+    // connection closed). Used to release whatever keeps referenced
+    // memory alive.
+    std::vector<std::pair<release_cb, void*> > holds;
+
+    response_t()
+        : size(0), nmessages(0), header_fragment(0), body_start(0) { }
+
+    void
+    append_copy(const char *data, size_t len) {
+        if (len) {
+            memcpy(extend(len), data, len);
+        }
+    }
+
+    // 'data' must stay valid till the response has been written.
+    void
+    append_ref(const char *data, size_t len) {
+        if (len < MIN_REFERENCED_SIZE) {
+            append_copy(data, len);
+            return;
+        }
+        fragment_t f = { data, 0, len };
+        fragments.push_back(f);
+        size += len;
+    }
+
+    void
+    append(std::string const &str) {
+        append_copy(str.data(), str.size());
+    }
+
+    void
+    append(const char *str) {
+        append_copy(str, strlen(str));
+    }
+
+    // Make room for 'len' bytes at the end of the response & return
+    // where to write them. The pointer is only valid till the next
+    // append.
+    char*
+    extend(size_t len) {
+        // Grow the last fragment if it is the one at the end of 'owned'.
+        if (fragments.empty() || fragments.back().base ||
+            fragments.back().offset + fragments.back().len != owned.size()) {
+            fragment_t f = { NULL, owned.size(), 0 };
+            fragments.push_back(f);
+        }
+        const size_t off = owned.size();
+        owned.resize(off + len);
+        fragments.back().len += len;
+        size += len;
+        return &owned[off];
+    }
+
+    void
+    begin_message() {
+        // A zero-length fragment that nothing will be appended to.
+        fragment_t f = { "", 0, 0 };
+        header_fragment = fragments.size();
+        fragments.push_back(f);
+        body_start = size;
+        ++nmessages;
+    }
+
+    // Size of the body of the last message so far.
+    size_t
+    body_size() const {
+        return size - body_start;
+    }
+
+    // Append the body of the last message so far to 'out'.
+    void
+    copy_body(std::string &out) const {
+        for (size_t i = header_fragment + 1; i < fragments.size(); ++i) {
+            fragment_t const &f = fragments[i];
+            out.append(f.base ? f.base : owned.data() + f.offset, f.len);
+        }
+    }
+
+    // Drop the body of the last message so that another one can be
+    // appended in its place. Holds are kept.
+    void
+    discard_body() {
+        fragments.resize(header_fragment + 1);
+        size = body_start;
+    }
+
+    // Set the headers of the last message to 'h1' followed by 'h2'.
+    void
+    set_message_header(const char *h1, size_t l1, const char *h2, size_t l2) {
+        fragment_t &f = fragments[header_fragment];
+        assert(f.base && !f.len);
+        f.base = NULL;
+        f.offset = owned.size();
+        f.len = l1 + l2;
+        owned.append(h1, l1);
+        owned.append(h2, l2);
+        size += l1 + l2;
+    }
+
+    void
+    hold(release_cb cb, void *data) {
+        holds.push_back(std::make_pair(cb, data));
+    }
+
+    // Release all holds & forget all the fragments (but keep the
+    // buffers allocated).
+    void
+    clear() {
+        for (size_t i = 0; i < holds.size(); ++i) {
+            holds[i].first(holds[i].second);
+        }
+        holds.clear();
+        owned.clear();
+        fragments.clear();
+        size = nmessages = header_fragment = body_start = 0;
+    }
+
+    void
+    swap(response_t &rhs) {
+        owned.swap(rhs.owned);
+        fragments.swap(rhs.fragments);
+        holds.swap(rhs.holds);
+        std::swap(size, rhs.size);
+        std::swap(nmessages, rhs.nmessages);
+        std::swap(header_fragment, rhs.header_fragment);
+        std::swap(body_start, rhs.body_start);
+    }
+};
+
+/* The pre-rendered status line & headers of a response (with a
+ * "Content-Length: " header at the very end, sans value), for each
+ * combination of HTTP/1.0 & HTTP/1.1 and keep-alive or not. Build
+ * these once for responses that are sent often.
+ */
+class header_template_t {
+    std::string repr[2][2]; // [http_minor][keep_alive]
+
+public:
+    header_template_t(int status_code, const char *status_str, headers_t headers);
+
+    std::string const&
+    get(int http_minor, bool keep_alive) const {
+        return repr[http_minor ? 1 : 0][keep_alive ? 1 : 0];
+    }
+};
+
+struct server_loop_t;
+struct client_t;
+
+typedef void (*work_cb_t)(void *data);
+typedef void (*work_done_cb_t)(client_t *client, void *data);
+
 struct client_t {
     uv_tcp_t                       handle;
+    server_loop_t*                 loop;              // The loop that this connection was accepted on
     http_parser                    parser;
     uv_write_t                     write_req;
-    std::vector<std::string>       resstrs;
+    response_t                     response;          // Responses not yet handed to uv_write()
+    response_t                     in_flight;         // Responses being written
+    std::vector<uv_buf_t>          resbufs;           // iovecs passed to uv_write()
+    bool                           parsing;           // In http_parser_execute(). Responses are written once it returns
+    bool                           close_after_write; // A request asked for the connection to be closed
     std::vector<partial_buf_t>     unparsed_data;
     std::list<client_t*>::iterator cciter;
     std::string                    url;
+    std::string                    body;              // The body of the current request (if any)
+    std::string                    accept;            // The Accept header of the current request (if any)
+    std::string                    accept_encoding;   // The Accept-Encoding header of the current request (if any)
+    std::string                    header_field;      // The name of the header being parsed
+    std::string*                   header_value;      // Where its value is being stored (NULL till it starts)
+    std::string                    scratch;           // Holds the decoded query string & body parameters of the current request
+    uint64_t                       write_started_at;  // Ticks at uv_write()
+    uint64_t                       last_active_at;    // uv_now() when connected or a request was last completed
+    uint64_t                       request_started_at; // uv_now() at the start of the current request (0 if none)
+    uint64_t                       headers_done_at;   // uv_now() at the end of its headers (0 if not yet)
+    bool                           deferred;          // The response to a request is being built by defer_response()
+    uv_work_t                      work_req;
+    work_cb_t                      work_cb;
+    work_done_cb_t                 work_done_cb;
+    void*                          work_data;
+
+    client_t()
+        : parsing(false), close_after_write(false), header_value(NULL),
+          last_active_at(0), request_started_at(0), headers_done_at(0),
+          deferred(false), work_cb(NULL), work_done_cb(NULL), work_data(NULL) { }
+
+    ~client_t() {
+        this->response.clear();
+        this->in_flight.clear();
+    }
+};
+
+/* Everything that belongs to one event loop. When serving from more
+ * than one loop, each loop runs on its own thread with its own
+ * SO_REUSEPORT listening socket (so that the kernel spreads new
+ * connections across the loops), and loops share nothing except the
+ * request callback.
+ */
+struct server_loop_t {
+    uv_loop_t*                     loop;
+    uv_tcp_t                       server;
+    uv_thread_t                    thread;
+    uv_timer_t                     sweep_timer;        // Closes connections that have timed out
+    std::list<client_t*>           connected_clients;  // The LRU list of connected clients. Front of the list is the least recently active client connection
+    size_t                         nconnected_clients; // The # of currently connected clients
+    ObjectPool<client_t>           client_pool;        // Where client_t objects are allocated from
+    FixedSizePool                  read_buffer_pool;   // Where buffers for uv_read_start() are allocated from
+    int                            id;                 // 0 for the loop run by the thread calling httpserver_start()
+
+    server_loop_t(size_t read_buffer_size)
+        : loop(NULL), nconnected_clients(0),
+          read_buffer_pool(read_buffer_size), id(0) { }
+};
+
+/* Bounds on what a client may make the server hold on to. Timeouts
+ * are in milliseconds & are checked about once a second; 0 disables
+ * a timeout.
+ */
+struct httpserver_limits_t {
+    size_t   max_body_size;     // Requests with larger bodies get a 413 & the connection is closed
+    uint64_t idle_timeout;      // Max. time on a connection without a request in progress
+    uint64_t header_timeout;    // Max. time from the start of a request till the end of its headers
+    uint64_t body_timeout;      // Max. time from the end of the headers till the end of the body
+    size_t   max_connections;   // Across all event loops. 0 for as many as RLIMIT_NOFILE allows
 
-    client_t() { }
+    httpserver_limits_t()
+        : max_body_size(65536), idle_timeout(60000), header_timeout(10000),
+          body_timeout(30000), max_connections(0) { }
 };
 
+struct query_param_t {
+    StringProxy key;
+    StringProxy value;
+};
+
+/* The parts of a request URL, and the parameters in the query string
+ * followed by those in the (application/x-www-form-urlencoded) body.
+ * These are views into client_t::url & client_t::scratch (which holds
+ * the percent-decoded parameters), so they are valid only till the
+ * next request on the connection. Parsing a request doesn't allocate
+ * any memory.
+ */
 struct parsed_url_t {
-    std::string path;
-    query_strings_t query;
+    // Parameters beyond these many are ignored (and 'truncated' is set).
+    enum { MAX_QUERY_PARAMS = 32 };
+
+    StringProxy path;
+    query_param_t params[MAX_QUERY_PARAMS];
+    int nparams;
+    bool truncated;
+
+    parsed_url_t()
+        : nparams(0), truncated(false) { }
+
+    // The value of the query string parameter 'key' (the last one if
+    // repeated), or an empty string if there is no such parameter.
+    StringProxy
+    query(const char *key) const {
+        for (int i = this->nparams - 1; i >= 0; --i) {
+            if (this->params[i].key.equals(key)) {
+                return this->params[i].value;
+            }
+        }
+        return StringProxy("", 0);
+    }
 };
 
 typedef void (*request_callback_t)(client_t*);
 
+// Called on the thread of each event loop before it starts (e.g. to
+// set the CPU affinity of the thread), with the id of the loop.
+typedef void (*loop_start_callback_t)(int id);
+
+// Called on the thread of each event loop about once a second (e.g.
+// to drop references to data that has been replaced), with the id of
+// the loop.
+typedef void (*loop_sweep_callback_t)(int id);
+
+// Time from handing a response to uv_write() till it has been written.
+extern LatencyHistogram write_latency;
+
+// # of connections closed for exceeding a timeout in httpserver_limits_t.
+extern unsigned long connections_timed_out;
+
+// # of requests answered with an error because they exceeded a limit.
+extern unsigned long requests_rejected;
+
 void build_HTTP_response_header(std::string &response_header,
                                 int http_major, int http_minor,
                                 int status_code, const char *status_str,
@@ -52,15 +363,34 @@ void write_response(client_t *client,
                     const char *status_str,
                     headers_t &headers,
                     std::string &body);
+void write_response(client_t *client,
+                    header_template_t const &header_template);
+
+// Answer the request being served (from the request callback) later:
+// work(data) is called on libuv's thread pool, so it may block, and
+// then work_done(client, data) on the client's loop, which must write
+// the response. No more requests are parsed on the connection (nor
+// responses written) till then, so responses stay in order.
+void defer_response(client_t *client, work_cb_t work, work_done_cb_t work_done, void *data);
 void on_close(uv_handle_t* handle);
-uv_buf_t on_alloc(uv_handle_t* client, size_t suggested_size);
-void on_read(uv_stream_t* tcp, ssize_t nread, uv_buf_t buf);
+void on_alloc(uv_handle_t* client, size_t suggested_size, uv_buf_t *buf);
+void on_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t *buf);
 void on_connect(uv_stream_t* server_handle, int status);
 void after_write(uv_write_t* req, int status);
-void parse_query_string(std::string &qstr, query_strings_t &query);
-void parse_URL(std::string const &url_str, parsed_url_t &uout);
+char* parse_query_string(const char *qstr, size_t len, parsed_url_t &uout, char *out);
+void parse_URL(std::string const &url_str, std::string const &body,
+               parsed_url_t &uout, std::string &scratch);
+int on_message_begin(http_parser *parser);
 int on_url(http_parser *parser, const char *data, size_t len);
+int on_header_field(http_parser *parser, const char *data, size_t len);
+int on_header_value(http_parser *parser, const char *data, size_t len);
+int on_headers_complete(http_parser *parser);
+int on_body(http_parser *parser, const char *data, size_t len);
 int on_message_complete(http_parser* parser);
-int httpserver_start(request_callback_t rcb, const char *ip, int port);
+int httpserver_start(request_callback_t rcb, const char *ip, int port,
+                     int nloops = 1, int backlog = 128,
+                     httpserver_limits_t const &limits = httpserver_limits_t(),
+                     loop_start_callback_t lscb = NULL,
+                     loop_sweep_callback_t swcb = NULL);
 
 #endif // HTTPSERVER_HPP
@@ -0,0 +1,219 @@
+#if !defined LIBFACE_JSON_ESCAPE_HPP
+#define LIBFACE_JSON_ESCAPE_HPP
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <include/types.hpp>
+#include <include/phrase_map.hpp>
+#include <include/snippet_dict.hpp>
+
+using namespace std;
+
+
+// The escape sequence for a character within a JSON string, or NULL
+// if the character is emitted as-is.
+inline const char*
+json_escape_sequence(char ch) {
+    switch (ch) {
+    case '"':  return "\\\"";
+    case '\\': return "\\\\";
+    case '\n': return "\\n";
+    case '\t': return "\\t";
+    default:   return NULL;
+    }
+}
+
+// # of bytes that 'str' occupies once escaped.
+inline size_t
+json_escaped_size(const char *str, size_t len) {
+    size_t sz = len;
+    for (size_t i = 0; i < len; ++i) {
+        if (json_escape_sequence(str[i])) {
+            ++sz;
+        }
+    }
+    return sz;
+}
+
+// Write 'str' escaped to 'out', which must have room for
+// json_escaped_size(str, len) bytes. Returns the end of the output.
+inline char*
+escape_json(const char *str, size_t len, char *out) {
+    for (size_t i = 0; i < len; ++i) {
+        const char *esc = json_escape_sequence(str[i]);
+        if (esc) {
+            *out++ = esc[0];
+            *out++ = esc[1];
+        }
+        else {
+            *out++ = str[i];
+        }
+    }
+    return out;
+}
+
+
+/* The phrases & snippets of a PhraseMap, escaped for use within a
+ * JSON string and packed back to back into a single arena. Responses
+ * are then built by referencing these bytes instead of scanning
+ * every phrase for characters to escape at query time.
+ *
+ * The escaped phrase of repr[i] is arena[offsets[i], offsets[i+1]).
+ * The escaped snippets follow the phrases, with snippet j at
+ * arena[offsets[n+j], offsets[n+j+1]). Snippet i is the snippet of
+ * repr[i], unless the snippets were interned into a dictionary, in
+ * which case each distinct snippet is escaped once & snippet_ids[i]
+ * is that of repr[i].
+ */
+class EscapedPhrases {
+    std::vector<char, IndexAllocator<char> > arena;
+    std::vector<size_t, IndexAllocator<size_t> > offsets;
+    std::vector<size_t, IndexAllocator<size_t> > snippet_ids; // Empty unless there is a dictionary
+    size_t nphrases;
+
+public:
+    EscapedPhrases()
+        : nphrases(0)
+    { }
+
+    // Must be called after pm.finalize(), since the escaped strings
+    // are stored in the order of pm.repr. 'dict' is the dictionary
+    // that the snippets of 'pm' were interned into, if any.
+    void
+    initialize(PhraseMap const &pm, SnippetDictionary const *dict = NULL) {
+        const size_t n = pm.repr.size();
+        const size_t nsnippets = dict ? dict->size() : n;
+        this->nphrases = n;
+
+        // Size everything exactly up-front so that building the arena
+        // does not need any reallocation.
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            phrase_t const &p = pm.repr[i];
+            total += json_escaped_size(p.phrase.data(), p.phrase.size());
+        }
+        for (size_t j = 0; j < nsnippets; ++j) {
+            StringProxy s = dict ? dict->get(j) : pm.repr[j].snippet;
+            total += json_escaped_size(s.mem_base, s.size());
+        }
+
+        std::vector<char, IndexAllocator<char> >(total).swap(this->arena);
+        std::vector<size_t, IndexAllocator<size_t> >(n + nsnippets + 1).swap(this->offsets);
+        std::vector<size_t, IndexAllocator<size_t> >().swap(this->snippet_ids);
+
+        char *base = this->arena.empty() ? NULL : &this->arena[0];
+        char *out = base;
+        for (size_t i = 0; i < n; ++i) {
+            phrase_t const &p = pm.repr[i];
+            this->offsets[i] = out - base;
+            out = escape_json(p.phrase.data(), p.phrase.size(), out);
+        }
+        for (size_t j = 0; j < nsnippets; ++j) {
+            StringProxy s = dict ? dict->get(j) : pm.repr[j].snippet;
+            this->offsets[n + j] = out - base;
+            out = escape_json(s.mem_base, s.size(), out);
+        }
+        this->offsets[n + nsnippets] = out - base;
+        assert((size_t)(out - base) == total);
+
+        if (dict) {
+            this->snippet_ids.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                this->snippet_ids[i] = dict->id_of(pm.repr[i].snippet);
+            }
+        }
+    }
+
+    StringProxy
+    phrase(size_t i) const {
+        return this->get(i);
+    }
+
+    StringProxy
+    snippet(size_t i) const {
+        if (this->snippet_ids.empty()) {
+            return this->get(this->nphrases + i);
+        }
+        const size_t j = this->snippet_ids[i];
+        return j == no_snippet ? StringProxy() : this->get(this->nphrases + j);
+    }
+
+    size_t
+    memory_usage() const {
+        return this->arena.capacity() +
+            (this->offsets.capacity() + this->snippet_ids.capacity()) * sizeof(size_t);
+    }
+
+    // Fault in every page. See touch_memory().
+    size_t
+    touch() const {
+        return touch_memory(this->arena) + touch_memory(this->offsets) +
+            touch_memory(this->snippet_ids);
+    }
+
+private:
+    StringProxy
+    get(size_t j) const {
+        const size_t off = this->offsets[j];
+        const char *base = this->arena.empty() ? NULL : &this->arena[0];
+        return StringProxy(base + off, this->offsets[j + 1] - off);
+    }
+};
+
+
+namespace json_escape {
+    inline int
+    test() {
+        printf("Testing JSON escaping\n");
+        printf("---------------------\n");
+
+        const char *plain = "duckduckgo";
+        assert(json_escaped_size(plain, strlen(plain)) == strlen(plain));
+
+        const char *special = "a\"b\\c\nd\te";
+        char buff[32];
+        char *end = escape_json(special, strlen(special), buff);
+        assert(json_escaped_size(special, strlen(special)) == (size_t)(end - buff));
+        assert(std::string(buff, end) == "a\\\"b\\\\c\\nd\\te");
+
+        PhraseMap pm;
+        pm.insert(1, "duck \"duck\" go", StringProxy(special, strlen(special)));
+        pm.insert(2, "duckduckgo", StringProxy());
+        pm.insert(3, "", StringProxy(plain, strlen(plain)));
+        pm.finalize();
+
+        EscapedPhrases ep;
+        ep.initialize(pm);
+        assert((std::string)ep.phrase(0) == "");
+        assert((std::string)ep.snippet(0) == "duckduckgo");
+        assert((std::string)ep.phrase(1) == "duck \\\"duck\\\" go");
+        assert((std::string)ep.snippet(1) == "a\\\"b\\\\c\\nd\\te");
+        assert((std::string)ep.phrase(2) == "duckduckgo");
+        assert(ep.snippet(2).size() == 0);
+
+        // Snippets shared through a dictionary are escaped once.
+        SnippetDictionary dict;
+        pm.insert(4, "duck duck", StringProxy(special, strlen(special)));
+        pm.finalize();
+        dict.intern(pm);
+        ep.initialize(pm, &dict);
+        assert(dict.size() == 2);
+        assert((std::string)ep.phrase(1) == "duck \\\"duck\\\" go");
+        assert((std::string)ep.snippet(1) == "a\\\"b\\\\c\\nd\\te");
+        assert(ep.snippet(1).mem_base == ep.snippet(2).mem_base);
+        assert((std::string)ep.snippet(0) == "duckduckgo");
+        assert(ep.snippet(3).size() == 0);
+
+        EscapedPhrases empty;
+        empty.initialize(PhraseMap(0));
+        printf("JSON escaping OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_JSON_ESCAPE_HPP
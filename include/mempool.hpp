@@ -0,0 +1,209 @@
+#if !defined LIBFACE_MEMPOOL_HPP
+#define LIBFACE_MEMPOOL_HPP
+
+#include <vector>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <include/types.hpp>
+
+using namespace std;
+
+
+/* A pool of fixed size blocks. Memory is obtained from the system in
+ * slabs of 'blocks_per_slab' blocks, and freed blocks are threaded on
+ * an intrusive free list for reuse, so get() & put() are O(1) and
+ * never touch malloc() once the pool has grown to its working set.
+ *
+ * Slabs are only returned to the system when the pool is destroyed,
+ * so the memory used is that of the peak # of blocks in use. In
+ * exchange, objects don't fragment the heap they'd otherwise share
+ * with the long-lived data store.
+ */
+class FixedSizePool {
+    union block_t {
+        block_t *next;
+        char data[1];
+    };
+
+    size_t block_size;
+    size_t blocks_per_slab;
+    std::vector<char*> slabs;
+    block_t *free_list;
+    size_t nused;
+
+public:
+    FixedSizePool(size_t _block_size, size_t _blocks_per_slab = 64)
+        : block_size(_block_size), blocks_per_slab(_blocks_per_slab),
+          free_list(NULL), nused(0) {
+        // Keep every block suitably aligned for any object.
+        const size_t align = sizeof(void*) * 2;
+        if (this->block_size < sizeof(block_t)) {
+            this->block_size = sizeof(block_t);
+        }
+        this->block_size = (this->block_size + align - 1) / align * align;
+        assert(this->blocks_per_slab > 0);
+    }
+
+    ~FixedSizePool() {
+        for (size_t i = 0; i < this->slabs.size(); ++i) {
+            free(this->slabs[i]);
+        }
+    }
+
+    void*
+    get() {
+        if (!this->free_list) {
+            this->grow();
+        }
+        block_t *b = this->free_list;
+        this->free_list = b->next;
+        ++this->nused;
+        return b;
+    }
+
+    void
+    put(void *mem) {
+        assert(this->nused > 0);
+        block_t *b = (block_t*)mem;
+        b->next = this->free_list;
+        this->free_list = b;
+        --this->nused;
+    }
+
+    size_t
+    size() const {
+        return this->block_size;
+    }
+
+    // # of blocks handed out & not yet put back.
+    size_t
+    used() const {
+        return this->nused;
+    }
+
+    // # of bytes obtained from the system.
+    size_t
+    memory_usage() const {
+        return this->slabs.size() * this->blocks_per_slab * this->block_size;
+    }
+
+private:
+    void
+    grow() {
+        char *slab = (char*)malloc(this->blocks_per_slab * this->block_size);
+        assert(slab);
+        this->slabs.push_back(slab);
+        // Thread the blocks so that they are handed out in address
+        // order.
+        for (size_t i = this->blocks_per_slab; i > 0; --i) {
+            block_t *b = (block_t*)(slab + (i - 1) * this->block_size);
+            b->next = this->free_list;
+            this->free_list = b;
+        }
+    }
+};
+
+
+/* A pool of objects of type T built on a FixedSizePool. create()
+ * & destroy() replace new & delete.
+ */
+template <typename T>
+class ObjectPool {
+    FixedSizePool pool;
+
+public:
+    ObjectPool(size_t objects_per_slab = 64)
+        : pool(sizeof(T), objects_per_slab) { }
+
+    T*
+    create() {
+        return new (this->pool.get()) T;
+    }
+
+    void
+    destroy(T *obj) {
+        obj->~T();
+        this->pool.put(obj);
+    }
+
+    size_t
+    used() const {
+        return this->pool.used();
+    }
+
+    size_t
+    memory_usage() const {
+        return this->pool.memory_usage();
+    }
+};
+
+
+namespace mempool {
+    inline int&
+    nlive() {
+        static int n = 0;
+        return n;
+    }
+
+    struct counted_t {
+        std::vector<int> v;
+        counted_t() : v(10, 1) { ++nlive(); }
+        ~counted_t() { --nlive(); }
+    };
+
+    inline int
+    test() {
+        printf("Testing mempool implementation\n");
+        printf("------------------------------\n");
+
+        FixedSizePool fp(100, 4);
+        assert(fp.size() >= 100);
+        assert(fp.size() % sizeof(void*) == 0);
+
+        std::vector<void*> blocks;
+        for (int i = 0; i < 10; ++i) {
+            blocks.push_back(fp.get());
+            memset(blocks.back(), i, 100);
+            for (int j = 0; j < i; ++j) {
+                assert(blocks[j] != blocks[i]);
+            }
+        }
+        assert(fp.used() == 10);
+        assert(fp.memory_usage() == 3 * 4 * fp.size());
+
+        // Freed blocks are reused before the pool grows.
+        void *last = blocks.back();
+        fp.put(last);
+        assert(fp.get() == last);
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            fp.put(blocks[i]);
+        }
+        assert(fp.used() == 0);
+        for (int i = 0; i < 12; ++i) {
+            fp.get();
+        }
+        assert(fp.memory_usage() == 3 * 4 * fp.size());
+
+        ObjectPool<counted_t> op(2);
+        std::vector<counted_t*> objs;
+        for (int i = 0; i < 5; ++i) {
+            objs.push_back(op.create());
+            assert(objs.back()->v.size() == 10);
+        }
+        assert(nlive() == 5);
+        for (size_t i = 0; i < objs.size(); ++i) {
+            op.destroy(objs[i]);
+        }
+        assert(nlive() == 0);
+        assert(op.used() == 0);
+        printf("mempool OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_MEMPOOL_HPP
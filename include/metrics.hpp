@@ -0,0 +1,399 @@
+// -*- mode:c++; c-basic-offset:4 -*-
+#if !defined LIBFACE_METRICS_HPP
+#define LIBFACE_METRICS_HPP
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <assert.h>
+
+#include <include/types.hpp>
+
+using namespace std;
+
+
+/* Monotonic wall-clock time in micro-seconds. Only differences of
+ * values returned by this function are meaningful.
+ */
+inline uint64_t
+monotonic_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Process memory usage as reported by the kernel. All sizes are in
+ * bytes.
+ */
+struct memory_stats_t {
+    uint64_t vsize;    // Total virtual memory
+    uint64_t rss;      // Resident set size
+    uint64_t shared;   // Resident pages backed by a file (incl. the mmapped input)
+    uint64_t pss;      // Proportional set size (0 if unavailable)
+
+    memory_stats_t()
+        : vsize(0), rss(0), shared(0), pss(0)
+    { }
+};
+
+/* Read /proc/self/statm. This is a single read(2) of a tiny pseudo
+ * file and does not walk the page tables, so it is cheap enough to
+ * call on every /face/stats/ request.
+ */
+inline bool
+read_memory_stats(memory_stats_t &ms) {
+    FILE *pf = fopen("/proc/self/statm", "r");
+    if (!pf) {
+        return false;
+    }
+    unsigned long long size = 0, resident = 0, shared = 0;
+    const int r = fscanf(pf, "%llu %llu %llu", &size, &resident, &shared);
+    fclose(pf);
+    if (r != 3) {
+        return false;
+    }
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    ms.vsize  = size * page_size;
+    ms.rss    = resident * page_size;
+    ms.shared = shared * page_size;
+    return true;
+}
+
+/* Read the 'Pss:' line from /proc/self/smaps_rollup (Linux >= 4.14).
+ * The kernel walks all mappings to produce this, so only call it
+ * where a slightly more expensive read is acceptable (the metrics
+ * endpoint). Returns 0 if the file is not available.
+ */
+inline uint64_t
+read_pss_bytes() {
+    FILE *pf = fopen("/proc/self/smaps_rollup", "r");
+    if (!pf) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long pss_kb = 0;
+    while (fgets(line, sizeof(line), pf)) {
+        if (sscanf(line, "Pss: %llu kB", &pss_kb) == 1) {
+            break;
+        }
+    }
+    fclose(pf);
+    return (uint64_t)pss_kb * 1024;
+}
+
+
+/* Monotonic wall-clock time in nano-seconds. */
+inline uint64_t
+monotonic_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The time source used by the latency histograms. On x86 this is the
+ * TSC, which takes a few nano-seconds to read. Elsewhere, it falls
+ * back to CLOCK_MONOTONIC in nano-seconds. Ticks are converted to
+ * nano-seconds only when a histogram is read, never when a sample is
+ * recorded.
+ */
+inline uint64_t
+read_ticks() {
+#if defined __x86_64__ || defined __i386__
+    return __builtin_ia32_rdtsc();
+#else
+    return monotonic_nsec();
+#endif
+}
+
+struct tick_epoch_t {
+    uint64_t ticks;
+    uint64_t ns;
+};
+
+/* The point in time against which ticks are calibrated. The first
+ * call records it, so call it early (the LatencyHistogram
+ * constructor does).
+ */
+inline tick_epoch_t const&
+tick_epoch() {
+    static const tick_epoch_t epoch = { read_ticks(), monotonic_nsec() };
+    return epoch;
+}
+
+/* The # of nano-seconds per tick. This is calibrated against
+ * CLOCK_MONOTONIC over the whole lifetime of the process, so it gets
+ * more precise the longer the server runs.
+ */
+inline double
+ns_per_tick() {
+#if defined __x86_64__ || defined __i386__
+    tick_epoch_t const &epoch = tick_epoch();
+    uint64_t ns = monotonic_nsec();
+    while (ns - epoch.ns < 10000000) {
+        // Called too soon after the epoch to be accurate. Wait for at
+        // least 10ms to have elapsed.
+        ns = monotonic_nsec();
+    }
+    return (double)(ns - epoch.ns) / (double)(read_ticks() - epoch.ticks);
+#else
+    return 1.0;
+#endif
+}
+
+
+/* An HDR-style (log-linear) latency histogram. Every power-of-2
+ * range of tick values is split into 2^SUB_BITS equal sub-buckets,
+ * so any recorded value is known to within 1/2^SUB_BITS (~6%) of its
+ * actual value while the whole range up to 2^MAX_BITS ticks fits in
+ * a few KiB.
+ *
+ * record() is lock-free and wait-free (2 atomic adds), so a single
+ * histogram may be shared by any number of threads.
+ */
+class LatencyHistogram {
+public:
+    enum {
+        SUB_BITS    = 4,
+        SUB_BUCKETS = 1 << SUB_BITS,
+        MAX_BITS    = 40,  // ~6 minutes at 3GHz
+        NBUCKETS    = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS + SUB_BUCKETS
+    };
+
+private:
+    uint64_t buckets[NBUCKETS];
+    uint64_t sum_ticks;
+
+public:
+    LatencyHistogram() {
+        this->clear();
+        tick_epoch();
+    }
+
+    void
+    clear() {
+        memset(this->buckets, 0, sizeof(this->buckets));
+        this->sum_ticks = 0;
+    }
+
+    static uint_t
+    bucket_for(uint64_t ticks) {
+        if (ticks < SUB_BUCKETS) {
+            return ticks;
+        }
+        const uint_t msb = 63 - __builtin_clzll(ticks);
+        if (msb >= MAX_BITS) {
+            return NBUCKETS - 1;
+        }
+        const uint_t shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (uint_t)(ticks >> shift) - SUB_BUCKETS;
+    }
+
+    // The smallest value (in ticks) that maps to bucket 'b'.
+    static uint64_t
+    bucket_lower_bound(uint_t b) {
+        if (b < SUB_BUCKETS) {
+            return b;
+        }
+        const uint_t shift = b / SUB_BUCKETS - 1;
+        return (uint64_t)(SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+    }
+
+    // The (exclusive) upper bound of bucket 'b' in ticks.
+    static uint64_t
+    bucket_upper_bound(uint_t b) {
+        if (b < SUB_BUCKETS) {
+            return b + 1;
+        }
+        return bucket_lower_bound(b) + ((uint64_t)1 << (b / SUB_BUCKETS - 1));
+    }
+
+    void
+    record(uint64_t ticks) {
+        __sync_fetch_and_add(&this->buckets[bucket_for(ticks)], 1);
+        __sync_fetch_and_add(&this->sum_ticks, ticks);
+    }
+
+    uint64_t
+    total() const {
+        uint64_t count = 0;
+        for (uint_t b = 0; b < NBUCKETS; ++b) {
+            count += this->buckets[b];
+        }
+        return count;
+    }
+
+    uint64_t
+    bucket(uint_t b) const {
+        return this->buckets[b];
+    }
+
+    double
+    mean_ns() const {
+        const uint64_t count = this->total();
+        return count ? this->sum_ticks * ns_per_tick() / count : 0;
+    }
+
+    /* The value (in nano-seconds) below which a fraction 'q' of all
+     * the samples lie. Reported as the highest value of the bucket
+     * which contains the q'th sample.
+     */
+    double
+    percentile_ns(double q) const {
+        const uint64_t count = this->total();
+        if (!count) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q * count);
+        if (rank >= count) {
+            rank = count - 1;
+        }
+        uint64_t cumulative = 0;
+        uint_t b = 0;
+        for (; b < NBUCKETS; ++b) {
+            cumulative += this->buckets[b];
+            if (cumulative > rank) {
+                break;
+            }
+        }
+        return (bucket_upper_bound(b) - 1) * ns_per_tick();
+    }
+
+    /* Render in the Prometheus text exposition format. The values
+     * are exported in seconds as is customary for Prometheus, using
+     * fixed 1-2-5 bucket boundaries from 1usec to 10sec so that the
+     * series stay stable across scrapes. 'labels' (if non-empty) is
+     * a comma-separated list of label="value" pairs.
+     */
+    void
+    write_prometheus(std::ostream &out, const char *name, std::string const &labels) const {
+        const double tick_ns = ns_per_tick();
+        const std::string sep = labels.empty() ? "" : ",";
+        uint64_t cumulative = 0;
+        uint_t b = 0;
+        for (double le_ns = 1000; le_ns <= 1e10; ) {
+            while (b < NBUCKETS && bucket_upper_bound(b) * tick_ns <= le_ns) {
+                cumulative += this->buckets[b++];
+            }
+            out << name << "_bucket{" << labels << sep << "le=\"" << le_ns / 1e9 << "\"} "
+                << cumulative << "\n";
+            // 1, 2, 5, 10, 20, 50, ...
+            const double mantissa = le_ns / pow(10, floor(log10(le_ns) + 1e-9));
+            le_ns *= (mantissa < 1.5 || mantissa > 4) ? 2 : 2.5;
+        }
+        const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << this->total() << "\n";
+        out << name << "_sum" << braces << " " << this->sum_ticks * tick_ns / 1e9 << "\n";
+        out << name << "_count" << braces << " " << this->total() << "\n";
+    }
+};
+
+
+/* Measures consecutive stages of a single request. Each call to
+ * lap() records the time since the previous lap (or since
+ * construction) in the given histogram. Reading the clock once per
+ * stage boundary keeps the overhead to a few tens of nano-seconds
+ * per stage.
+ */
+class StageTimer {
+    uint64_t start;
+    uint64_t last;
+
+public:
+    StageTimer()
+        : start(read_ticks()) {
+        this->last = this->start;
+    }
+
+    void
+    lap(LatencyHistogram &h) {
+        const uint64_t now = read_ticks();
+        h.record(now - this->last);
+        this->last = now;
+    }
+
+    // Record the time since construction.
+    void
+    total(LatencyHistogram &h) {
+        h.record(read_ticks() - this->start);
+    }
+};
+
+
+inline void
+write_prometheus_header(std::ostream &out, const char *name, const char *type,
+                        const char *help) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+}
+
+template <typename T>
+void
+write_prometheus_metric(std::ostream &out, const char *name, const char *type,
+                        const char *help, T value) {
+    write_prometheus_header(out, name, type, help);
+    out << name << " " << value << "\n";
+}
+
+
+namespace metrics {
+    inline int
+    test() {
+        printf("Testing metrics implementation\n");
+        printf("------------------------------\n");
+
+        for (uint64_t v = 0; v < ((uint64_t)1 << 20); v = v * 9 / 8 + 1) {
+            const uint_t b = LatencyHistogram::bucket_for(v);
+            assert(LatencyHistogram::bucket_lower_bound(b) <= v);
+            assert(v < LatencyHistogram::bucket_upper_bound(b));
+            assert(b + 1 == LatencyHistogram::bucket_for(LatencyHistogram::bucket_upper_bound(b)));
+        }
+        assert(LatencyHistogram::bucket_for(15) == 15);
+        assert(LatencyHistogram::bucket_for(16) == 16);
+        assert(LatencyHistogram::bucket_for(33) == 32);
+        assert(LatencyHistogram::bucket_for((uint64_t)1 << 50) == LatencyHistogram::NBUCKETS - 1);
+
+        LatencyHistogram h;
+        for (uint64_t v = 1; v <= 1000; ++v) {
+            h.record(v);
+        }
+        assert(h.total() == 1000);
+        const double p50 = h.percentile_ns(0.5) / ns_per_tick();
+        const double p99 = h.percentile_ns(0.99) / ns_per_tick();
+        printf("p50: %.1f ticks, p99: %.1f ticks\n", p50, p99);
+        assert(p50 >= 499 && p50 <= 500 * 1.07);
+        assert(p99 >= 989 && p99 <= 990 * 1.07);
+
+        std::ostringstream os;
+        h.write_prometheus(os, "test_latency_seconds", "stage=\"test\"");
+        assert(os.str().find("test_latency_seconds_count{stage=\"test\"} 1000\n") != std::string::npos);
+        assert(os.str().find("test_latency_seconds_bucket{stage=\"test\",le=\"+Inf\"} 1000\n") != std::string::npos);
+        assert(os.str().find("le=\"2e-06\"") != std::string::npos);
+        assert(os.str().find("le=\"5e-06\"") != std::string::npos);
+        assert(os.str().find("le=\"10\"") != std::string::npos);
+
+        StageTimer timer;
+        LatencyHistogram stage;
+        timer.lap(stage);
+        timer.lap(stage);
+        assert(stage.total() == 2);
+
+        memory_stats_t ms;
+        if (read_memory_stats(ms)) {
+            printf("vsize: %llu bytes, rss: %llu bytes\n",
+                   (unsigned long long)ms.vsize, (unsigned long long)ms.rss);
+            assert(ms.rss > 0);
+            assert(ms.vsize >= ms.rss);
+        }
+
+        printf("\n");
+        return 0;
+    }
+}
+
+#endif // LIBFACE_METRICS_HPP
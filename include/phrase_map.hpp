@@ -7,6 +7,8 @@
 #include <algorithm>
 #include <string>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <assert.h>
 
 #include <include/types.hpp>
@@ -14,6 +16,37 @@
 using namespace std;
 
 
+// finalize() merges the sorted runs that the phrases were inserted in
+// if they are this long on average, & sorts them from scratch if not.
+#define MIN_AVG_SORTED_RUN 16
+
+/* What finalize() does with copies of a phrase (e.g. from concatenated
+ * daily logs). The copies are merged into the latest one: the one with
+ * the newest timestamp, or the last one inserted among those as new.
+ * It is in all of their categories, & its weight is the sum or the max
+ * of their weights, or its own.
+ */
+enum duplicate_policy_t {
+    DUPLICATES_KEEP,    // Keep every copy
+    DUPLICATES_SUM,
+    DUPLICATES_MAX,
+    DUPLICATES_LATEST,
+    NUM_DUPLICATE_POLICIES
+};
+
+const char *const duplicate_policy_names[NUM_DUPLICATE_POLICIES] = {
+    "keep", "sum", "max", "latest"
+};
+
+// Returns NUM_DUPLICATE_POLICIES for an unknown name.
+inline duplicate_policy_t
+duplicate_policy_from_name(const char *name) {
+    int i = 0;
+    while (i < NUM_DUPLICATE_POLICIES && strcmp(name, duplicate_policy_names[i])) {
+        ++i;
+    }
+    return (duplicate_policy_t)i;
+}
 
 struct PrefixFinder {
     bool
@@ -43,27 +76,106 @@ struct PrefixFinder {
         return target.phrase < prefix;
 #endif
     }
+
+    // Same as above, for a prefix that isn't a std::string.
+    bool
+    operator()(StringProxy const& prefix, phrase_t const &target) {
+        return target.phrase.compare(0, prefix.size(), prefix.mem_base, prefix.size()) > 0;
+    }
+
+    bool
+    operator()(phrase_t const& target, StringProxy const &prefix) {
+        return target.phrase.compare(0, prefix.size(), prefix.mem_base, prefix.size()) < 0;
+    }
 };
 
 class PhraseMap {
 public:
     vp_t repr;
 
+    // # of bytes allocated on the heap by the strings in repr. Computed
+    // in finalize() so that memory_usage() is O(1).
+    size_t phrase_bytes;
+
+    // # of sorted runs that the phrases were inserted in (e.g. 1 if
+    // they were inserted in order, or 1 per pre-sorted input file).
+    // Computed in finalize().
+    size_t sorted_runs;
+
+    // # of copies of phrases merged away by finalize().
+    size_t duplicates_merged;
+
 public:
-    PhraseMap(uint_t _len = 15000000) {
+    PhraseMap(uint_t _len = 15000000)
+        : phrase_bytes(0), sorted_runs(0), duplicates_merged(0) {
         this->repr.reserve(_len);
     }
 
     void
-    insert(uint_t weight, std::string const& p, StringProxy const& s) {
-        this->repr.push_back(phrase_t(weight, p, s));
+    insert(weight_t weight, std::string const& p, StringProxy const& s,
+           features_t const& f = features_t()) {
+        this->repr.push_back(phrase_t(weight, p, s, f));
     }
 
+    // Sort the phrases, unless the caller knows that they are
+    // 'sorted'. Input that is sorted (or made up of a few sorted
+    // parts) costs just the comparisons needed to find that out.
+    // Copies of a phrase are then merged per 'duplicates'.
     void
-    finalize(int sorted = 0) {
+    finalize(int sorted = 0, duplicate_policy_t duplicates = DUPLICATES_KEEP) {
+        vsz_t runs;
         if (!sorted) {
-            std::sort(this->repr.begin(), this->repr.end());
+            this->find_sorted_runs(runs);
+        }
+        this->sorted_runs = sorted ? !this->repr.empty() : runs.size() - 1;
+        if (this->sorted_runs > 1) {
+            if (this->repr.size() / this->sorted_runs >= MIN_AVG_SORTED_RUN) {
+                this->merge_sorted_runs(runs);
+            }
+            else if (duplicates != DUPLICATES_KEEP) {
+                // Keep the copies of a phrase in the order they were
+                // inserted in (as merging does).
+                std::stable_sort(this->repr.begin(), this->repr.end());
+            }
+            else {
+                std::sort(this->repr.begin(), this->repr.end());
+            }
+        }
+        this->duplicates_merged = duplicates == DUPLICATES_KEEP ? 0 :
+            this->merge_duplicates(duplicates);
+
+        this->phrase_bytes = 0;
+        for (size_t i = 0; i < this->repr.size(); ++i) {
+            std::string const &p = this->repr[i].phrase;
+            const char *obj = (const char*)&p;
+            // Short strings are stored inline in the std::string
+            // object and do not use any extra memory.
+            if (p.data() < obj || p.data() >= obj + sizeof(p)) {
+                this->phrase_bytes += p.capacity() + 1;
+            }
+        }
+    }
+
+    // The fraction of the comparisons of sorting the phrases from
+    // scratch that finalize() saved: merging k sorted runs of n
+    // phrases takes about n*log(k) comparisons instead of n*log(n).
+    double
+    sort_work_saved() const {
+        const size_t n = this->repr.size();
+        if (this->sorted_runs <= 1) {
+            return 1.0;
+        }
+        if (n / this->sorted_runs < MIN_AVG_SORTED_RUN) {
+            return 0.0;
         }
+        return 1.0 - log2((double)this->sorted_runs) / log2((double)n);
+    }
+
+    // Approximate # of bytes used by this structure. The snippets
+    // are not counted since they live in the mmapped input file.
+    size_t
+    memory_usage() const {
+        return this->repr.capacity() * sizeof(phrase_t) + this->phrase_bytes;
     }
 
     pvpi_t
@@ -72,6 +184,145 @@ public:
                                 prefix, PrefixFinder());
     }
 
+    pvpi_t
+    query(const char *prefix, size_t len) {
+        return std::equal_range(this->repr.begin(), this->repr.end(), 
+                                StringProxy(prefix, len), PrefixFinder());
+    }
+
+    // Same as calling query() for each of the 'n' prefixes, with the
+    // result for prefixes[i] written to out[i]. The binary searches
+    // run in lock-step and the elements that all of them probe next
+    // are prefetched before any of them is compared, so that their
+    // cache misses overlap instead of being taken one after another.
+    void
+    query_batch(StringProxy const *prefixes, size_t n, pvpi_t *out) {
+        if (n == 0) {
+            return;
+        }
+        std::vector<size_t> first(n), last(n);
+        this->search_batch(prefixes, n, &first[0], true);
+        this->search_batch(prefixes, n, &last[0], false);
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = std::make_pair(this->repr.begin() + first[i],
+                                    this->repr.begin() + last[i]);
+        }
+    }
+
+private:
+    // The starts of the maximal sorted runs of repr, followed by its
+    // size.
+    void
+    find_sorted_runs(vsz_t &runs) const {
+        const size_t n = this->repr.size();
+        runs.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (!i || this->repr[i] < this->repr[i - 1]) {
+                runs.push_back(i);
+            }
+        }
+        runs.push_back(n);
+    }
+
+    // Merge adjacent pairs of 'runs' (as found by find_sorted_runs())
+    // till there is just one.
+    void
+    merge_sorted_runs(vsz_t runs) {
+        vpi_t base = this->repr.begin();
+        while (runs.size() > 2) {
+            vsz_t merged;
+            size_t i = 0;
+            for (; i + 2 < runs.size(); i += 2) {
+                std::inplace_merge(base + runs[i], base + runs[i + 1], base + runs[i + 2]);
+                merged.push_back(runs[i]);
+            }
+            if (i + 1 < runs.size()) {
+                // An odd run out; merged in the next round.
+                merged.push_back(runs[i]);
+            }
+            merged.push_back(runs.back());
+            runs.swap(merged);
+        }
+    }
+
+    // Merge the copies of each phrase (which must be sorted, with the
+    // copies in the order they were inserted in). Returns the # of
+    // copies merged away.
+    size_t
+    merge_duplicates(duplicate_policy_t policy) {
+        const size_t n = this->repr.size();
+        size_t ndistinct = 0;
+        for (size_t i = 0; i < n; ++i) {
+            ndistinct += !i || this->repr[i].phrase != this->repr[i - 1].phrase;
+        }
+        if (ndistinct == n) {
+            return 0;
+        }
+
+        // Into a new array, so that the memory of the copies is freed.
+        vp_t merged;
+        merged.reserve(ndistinct);
+        for (size_t i = 0; i < n; ++i) {
+            phrase_t &p = this->repr[i];
+            if (merged.empty() || merged.back().phrase != p.phrase) {
+                merged.push_back(phrase_t(p.weight, std::string(), p.snippet, p.features));
+                merged.back().phrase.swap(p.phrase);
+                continue;
+            }
+            phrase_t &m = merged.back();
+            const bool later = p.features.timestamp >= m.features.timestamp;
+            weight_t weight = m.weight;
+            if (policy == DUPLICATES_SUM) {
+                weight += p.weight;
+            }
+            else if (policy == DUPLICATES_MAX) {
+                weight = std::max(weight, p.weight);
+            }
+            else if (later) {
+                weight = p.weight;
+            }
+            const uint32_t categories = m.features.categories | p.features.categories;
+            if (later) {
+                m.snippet = p.snippet;
+                m.features = p.features;
+            }
+            m.weight = weight;
+            m.features.categories = categories;
+        }
+        this->repr.swap(merged);
+        return n - ndistinct;
+    }
+
+    // Branch-free lower bounds (if 'lower') or upper bounds of the
+    // ranges of phrases that start with each of 'prefixes'.
+    void
+    search_batch(StringProxy const *prefixes, size_t n, size_t *pos, bool lower) {
+        PrefixFinder pf;
+        size_t len = this->repr.size();
+        std::fill(pos, pos + n, 0);
+        if (!len || !n) {
+            return;
+        }
+        while (len > 1) {
+            const size_t half = len / 2;
+            for (size_t i = 0; i < n; ++i) {
+                __builtin_prefetch(&this->repr[pos[i] + half]);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                phrase_t const &probe = this->repr[pos[i] + half];
+                const bool before = lower ? pf(probe, prefixes[i]) : !pf(prefixes[i], probe);
+                pos[i] += before ? half : 0;
+            }
+            len -= half;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            phrase_t const &probe = this->repr[pos[i]];
+            pos[i] += lower ? pf(probe, prefixes[i]) : !pf(prefixes[i], probe);
+        }
+    }
+
+public:
+
 };
 
 
@@ -133,6 +384,104 @@ namespace phrase_map {
         show_indexes(pm, "ka");
         assert(naive_query(pm, "ka") == pm.query("ka"));
 
+        const char *prefixes[] = { "", "d", "duckduckgo", "duckduckgoosey", "z" };
+        for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+            assert(pm.query(prefixes[i], strlen(prefixes[i])) == pm.query(prefixes[i]));
+        }
+
+        const char *batch[] = { "a", "b", "c", "d", "duck", "duckduckgo", "duckduckgoosey",
+                                "ka", "l", "z", "", "dilli - no one killed jessica" };
+        const size_t nbatch = sizeof(batch) / sizeof(batch[0]);
+        std::vector<StringProxy> views;
+        for (size_t i = 0; i < nbatch; ++i) {
+            views.push_back(StringProxy(batch[i], strlen(batch[i])));
+        }
+        std::vector<pvpi_t> ranges(nbatch);
+        pm.query_batch(&views[0], nbatch, &ranges[0]);
+        for (size_t i = 0; i < nbatch; ++i) {
+            assert(ranges[i] == pm.query(batch[i]));
+        }
+        // An empty batch touches nothing.
+        pm.query_batch(NULL, 0, NULL);
+
+        assert(pm.sorted_runs == 5);
+        assert(pm.sort_work_saved() == 0.0);
+
+        // Runs too short on average (6 < MIN_AVG_SORTED_RUN) to be
+        // worth merging are sorted with std::sort instead.
+        PhraseMap runs(0);
+        const char *shards[] = { "b", "c", "d", "e", "g", "h",
+                                 "a", "c", "f", "x", "y", "z",
+                                 "ba", "bb", "bc", "bd", "be", "bf" };
+        for (int round = 0; round < 2; ++round) {
+            for (size_t i = 0; i < sizeof(shards) / sizeof(shards[0]); ++i) {
+                runs.insert(i, shards[i], "");
+            }
+        }
+        runs.finalize();
+        assert(runs.sorted_runs == 6);
+        assert(runs.sort_work_saved() == 0.0);
+        for (size_t i = 1; i < runs.repr.size(); ++i) {
+            assert(!(runs.repr[i] < runs.repr[i - 1]));
+        }
+
+        PhraseMap shuffled(0);
+        std::vector<std::string> all;
+        for (int i = 0; i < 1000; ++i) {
+            char buff[16];
+            sprintf(buff, "%05d", (i * 7919) % 1000);
+            all.push_back(buff);
+        }
+        // 3 sorted runs of ~333 phrases each (e.g. pre-sorted shards)
+        // are merged by merge_sorted_runs().
+        std::sort(all.begin(), all.begin() + 333);
+        std::sort(all.begin() + 333, all.begin() + 666);
+        std::sort(all.begin() + 666, all.end());
+        for (size_t i = 0; i < all.size(); ++i) {
+            shuffled.insert(i, all[i], "");
+        }
+        shuffled.finalize();
+        printf("3 sorted runs: %.0f%% of the sorting work saved\n", shuffled.sort_work_saved() * 100);
+        assert(shuffled.sorted_runs == 3);
+        assert(shuffled.sort_work_saved() > 0.8);
+        std::sort(all.begin(), all.end());
+        for (size_t i = 0; i < all.size(); ++i) {
+            assert(shuffled.repr[i].phrase == all[i]);
+        }
+        shuffled.finalize();
+        assert(shuffled.sorted_runs == 1 && shuffled.sort_work_saved() == 1.0);
+
+        // Copies of a phrase, merged per each policy.
+        const weight_t expected[NUM_DUPLICATE_POLICIES] = { 0, 12, 7, 3 };
+        for (int policy = DUPLICATES_SUM; policy < NUM_DUPLICATE_POLICIES; ++policy) {
+            PhraseMap dups(0);
+            dups.insert(7, "duck", StringProxy("old", 3), features_t(100, 0, 1));
+            dups.insert(1, "goose", "");
+            dups.insert(2, "duck", StringProxy("new", 3), features_t(200, 0, 2));
+            dups.insert(3, "duck", StringProxy("newest", 6), features_t(200, 0, 0));
+            dups.insert(4, "cat", "");
+            dups.finalize(0, (duplicate_policy_t)policy);
+            printf("%s: ", duplicate_policy_names[policy]);
+            for (size_t i = 0; i < dups.repr.size(); ++i) {
+                printf("(%s, %llu) ", dups.repr[i].phrase.c_str(), (unsigned long long)dups.repr[i].weight);
+            }
+            printf("\n");
+            assert(dups.repr.size() == 3 && dups.duplicates_merged == 2);
+            phrase_t const &duck = dups.repr[1];
+            assert(duck.phrase == "duck" && duck.weight == expected[policy]);
+            assert((std::string)duck.snippet == "newest");
+            assert(duck.features.timestamp == 200 && duck.features.categories == 3);
+            assert(dups.repr[0].phrase == "cat" && dups.repr[2].phrase == "goose");
+        }
+        assert(duplicate_policy_from_name("max") == DUPLICATES_MAX);
+        assert(duplicate_policy_from_name("min") == NUM_DUPLICATE_POLICIES);
+
+        PhraseMap empty(0);
+        empty.finalize(0, DUPLICATES_SUM);
+        assert(empty.sorted_runs == 0 && empty.duplicates_merged == 0);
+        empty.query_batch(&views[0], 1, &ranges[0]);
+        assert(ranges[0].first == empty.repr.end() && ranges[0].second == empty.repr.end());
+
         return 0;
     }
 }
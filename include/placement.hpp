@@ -0,0 +1,441 @@
+#if !defined LIBFACE_PLACEMENT_HPP
+#define LIBFACE_PLACEMENT_HPP
+
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <assert.h>
+
+using namespace std;
+
+
+#if !defined MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#if !defined MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#if !defined MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+#if !defined MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+#if !defined MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define MAX_NUMA_NODES 1024
+
+/* How the input file is brought into memory. Snippets are read
+ * straight out of it, so with PREFAULT_NONE the first queries after
+ * an import take page faults (or even disk reads) for their snippets.
+ */
+enum prefault_policy_t {
+    PREFAULT_NONE,      // Fault pages in as they are first read
+    PREFAULT_RANDOM,    // ... without readahead (MADV_RANDOM)
+    PREFAULT_WILLNEED,  // Start reading all of it in (MADV_WILLNEED)
+    PREFAULT_POPULATE,  // Read all of it in & map it (MAP_POPULATE)
+    PREFAULT_LOCK,      // ... & lock it (& the index) in memory
+    NUM_PREFAULT_POLICIES
+};
+
+const char *const prefault_policy_names[NUM_PREFAULT_POLICIES] = {
+    "none", "random", "willneed", "populate", "lock"
+};
+
+// Returns NUM_PREFAULT_POLICIES for an unknown name.
+inline prefault_policy_t
+prefault_policy_from_name(const char *name) {
+    int i = 0;
+    while (i < NUM_PREFAULT_POLICIES && strcmp(name, prefault_policy_names[i])) {
+        ++i;
+    }
+    return (prefault_policy_t)i;
+}
+
+/* Where the large arrays of an index (the phrases, RMQ tables,
+ * escaped JSON & snippets) are placed in memory. Queries probe them
+ * at random, so with 4 KiB pages nearly every probe of a large index
+ * is a TLB miss, & on a multi-socket machine most probes go to
+ * whichever node happened to build the index.
+ */
+struct memory_placement_t {
+    bool huge_pages;    // Back them with 2 MiB pages
+    bool interleave;    // Spread their pages over all the NUMA nodes
+    prefault_policy_t prefault; // For the input file (& locking the arrays)
+
+    memory_placement_t()
+        : huge_pages(false), interleave(false), prefault(PREFAULT_NONE)
+    { }
+};
+
+// The placement used by IndexAllocator, shared by the whole process.
+inline memory_placement_t&
+memory_placement() {
+    static memory_placement_t mp;
+    return mp;
+}
+
+// Parse a list of CPUs or NUMA nodes in the format of the kernel
+// (e.g. "0-3,8,10-11") into 'out'. Returns false if it is malformed.
+inline bool
+parse_cpulist(const char *str, std::vector<int> &out) {
+    out.clear();
+    while (*str && *str != '\n') {
+        char *end = NULL;
+        const long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return false;
+            }
+        }
+        for (long i = first; i <= last; ++i) {
+            out.push_back(i);
+        }
+        str = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',' && *end != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool
+read_cpulist(const char *path, std::vector<int> &out) {
+    char buff[4096];
+    FILE *pf = fopen(path, "r");
+    if (!pf) {
+        return false;
+    }
+    const bool ok = fgets(buff, sizeof(buff), pf) && parse_cpulist(buff, out);
+    fclose(pf);
+    return ok;
+}
+
+// The online NUMA nodes; just node 0 without NUMA.
+inline std::vector<int>
+numa_nodes() {
+    std::vector<int> nodes;
+    if (!read_cpulist("/sys/devices/system/node/online", nodes) || nodes.empty()) {
+        nodes.assign(1, 0);
+    }
+    return nodes;
+}
+
+// Run the calling thread only on the CPUs of NUMA node 'node'.
+// Returns false if that is not possible.
+inline bool
+pin_to_numa_node(int node) {
+    char path[64];
+    std::vector<int> cpus;
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    if (!read_cpulist(path, cpus) || cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Apply memory_placement() to the pages in [addr, addr + len). Only
+// takes effect on pages that have not been touched yet, except for
+// interleaving, which also moves pages already in memory. Both are
+// hints: kernels without THP or NUMA support just ignore them.
+inline void
+place_memory(void *addr, size_t len) {
+    memory_placement_t const &mp = memory_placement();
+    const uintptr_t begin = (uintptr_t)addr;
+    const uintptr_t end = begin + len;
+
+    // Huge pages can only back the 2 MiB aligned part.
+    const uintptr_t hbegin = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    const uintptr_t hend = end & ~(HUGE_PAGE_SIZE - 1);
+    if (mp.huge_pages && hbegin < hend) {
+        madvise((void*)hbegin, hend - hbegin, MADV_HUGEPAGE);
+    }
+
+    if (mp.interleave) {
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        const uintptr_t pbegin = begin & ~(page - 1);
+        std::vector<int> nodes = numa_nodes();
+        unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+        int maxnode = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i] < MAX_NUMA_NODES) {
+                mask[nodes[i] / (8 * sizeof(unsigned long))] |= 1UL << (nodes[i] % (8 * sizeof(unsigned long)));
+                maxnode = std::max(maxnode, nodes[i] + 1);
+            }
+        }
+        if (nodes.size() > 1) {
+            syscall(SYS_mbind, pbegin, end - pbegin, MPOL_INTERLEAVE, mask, maxnode + 1, MPOL_MF_MOVE);
+        }
+    }
+}
+
+// mlock(2) [addr, addr + len), complaining (once) if we may not.
+inline void
+lock_memory(void *addr, size_t len) {
+    static bool warned = false;
+    if (mlock(addr, len) && !warned) {
+        warned = true;
+        perror("mlock (see ulimit -l)");
+    }
+}
+
+// Read a byte of every page of [addr, addr + len), so that they are
+// all in memory & mapped. Returns the sum of those bytes, so that the
+// reads aren't optimized away.
+inline size_t
+touch_memory(const void *addr, size_t len) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const volatile unsigned char *p = (const volatile unsigned char*)addr;
+    size_t sum = 0;
+    for (size_t i = 0; i < len; i += page) {
+        sum += p[i];
+    }
+    return len ? sum + p[len - 1] : sum;
+}
+
+template <typename T, typename A>
+inline size_t
+touch_memory(std::vector<T, A> const &v) {
+    return v.empty() ? 0 : touch_memory(&v[0], v.size() * sizeof(T));
+}
+
+// mmap(2) the first 'len' bytes of the (read only) file 'fd' in,
+// per memory_placement(). Returns MAP_FAILED on failure.
+inline void*
+map_input_file(int fd, size_t len) {
+    const prefault_policy_t prefault = memory_placement().prefault;
+    const int flags = MAP_SHARED | (prefault >= PREFAULT_POPULATE ? MAP_POPULATE : 0);
+    void *p = mmap(NULL, len, PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED) {
+        return p;
+    }
+    place_memory(p, len);
+    if (prefault == PREFAULT_RANDOM) {
+        madvise(p, len, MADV_RANDOM);
+    }
+    else if (prefault == PREFAULT_WILLNEED) {
+        madvise(p, len, MADV_WILLNEED);
+    }
+    else if (prefault == PREFAULT_LOCK) {
+        lock_memory(p, len);
+    }
+    return p;
+}
+
+// Map 'len' (a multiple of HUGE_PAGE_SIZE) bytes of memory aligned to
+// HUGE_PAGE_SIZE, placed per memory_placement(). Returns NULL if out
+// of memory.
+inline void*
+map_placed_memory(size_t len) {
+    if (memory_placement().huge_pages) {
+        // Pages reserved in hugetlbfs (vm.nr_hugepages), if any.
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            place_memory(p, len);
+            if (memory_placement().prefault == PREFAULT_LOCK) {
+                lock_memory(p, len);
+            }
+            return p;
+        }
+    }
+
+    // Else transparent huge pages, which need a 2 MiB aligned
+    // mapping. Map an extra huge page & trim it off.
+    char *p = (char*)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char*)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > p) {
+        munmap(p, aligned - p);
+    }
+    munmap(aligned + len, p + HUGE_PAGE_SIZE - aligned);
+    place_memory(aligned, len);
+    if (memory_placement().prefault == PREFAULT_LOCK) {
+        lock_memory(aligned, len);
+    }
+    return aligned;
+}
+
+/* The allocator of the large arrays of an index. Arrays of at least
+ * HUGE_PAGE_SIZE bytes get mappings of their own, placed (& locked,
+ * with PREFAULT_LOCK) per memory_placement() before they are first
+ * touched. Smaller ones come from operator new.
+ */
+template <typename T>
+class IndexAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef IndexAllocator<U> other;
+    };
+
+    IndexAllocator() { }
+
+    template <typename U>
+    IndexAllocator(IndexAllocator<U> const&) { }
+
+    pointer
+    address(reference r) const {
+        return &r;
+    }
+
+    const_pointer
+    address(const_reference r) const {
+        return &r;
+    }
+
+    size_type
+    max_size() const {
+        return (size_t)-1 / sizeof(T);
+    }
+
+    void
+    construct(pointer p, T const &v) {
+        new ((void*)p) T(v);
+    }
+
+    void
+    destroy(pointer p) {
+        p->~T();
+    }
+
+    pointer
+    allocate(size_type n, const void* = 0) {
+        const size_t bytes = n * sizeof(T);
+        if (bytes < HUGE_PAGE_SIZE) {
+            return (pointer)::operator new(bytes);
+        }
+        void *p = map_placed_memory(mapped_size(bytes));
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        return (pointer)p;
+    }
+
+    void
+    deallocate(pointer p, size_type n) {
+        const size_t bytes = n * sizeof(T);
+        if (bytes < HUGE_PAGE_SIZE) {
+            ::operator delete(p);
+        }
+        else {
+            munmap(p, mapped_size(bytes));
+        }
+    }
+
+private:
+    static size_t
+    mapped_size(size_t bytes) {
+        return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+};
+
+template <typename T, typename U>
+inline bool
+operator==(IndexAllocator<T> const&, IndexAllocator<U> const&) {
+    return true;
+}
+
+template <typename T, typename U>
+inline bool
+operator!=(IndexAllocator<T> const&, IndexAllocator<U> const&) {
+    return false;
+}
+
+
+namespace placement {
+    inline int
+    test() {
+        printf("Testing memory placement\n");
+        printf("------------------------\n");
+
+        std::vector<int> l;
+        assert(parse_cpulist("0-3,8,10-11\n", l));
+        assert(l.size() == 7 && l[0] == 0 && l[3] == 3 && l[4] == 8 && l[6] == 11);
+        assert(parse_cpulist("0", l) && l.size() == 1 && l[0] == 0);
+        assert(parse_cpulist("", l) && l.empty());
+        assert(!parse_cpulist("3-1", l));
+        assert(!parse_cpulist("a", l));
+        assert(!numa_nodes().empty());
+
+        // Small & large arrays, with & without huge pages.
+        for (int hp = 0; hp < 2; ++hp) {
+            memory_placement().huge_pages = hp;
+            std::vector<uint64_t, IndexAllocator<uint64_t> > v;
+            for (size_t i = 0; i < 1000000; ++i) {
+                v.push_back(i);
+            }
+            assert(((uintptr_t)&v[0] & (HUGE_PAGE_SIZE - 1)) == 0);
+            std::vector<uint64_t, IndexAllocator<uint64_t> > w(v);
+            assert(w[999999] == 999999);
+            std::vector<uint64_t, IndexAllocator<uint64_t> >(10, 1).swap(w);
+            assert(w.size() == 10 && w[9] == 1);
+        }
+        memory_placement() = memory_placement_t();
+
+        assert(prefault_policy_from_name("willneed") == PREFAULT_WILLNEED);
+        assert(prefault_policy_from_name("lock") == PREFAULT_LOCK);
+        assert(prefault_policy_from_name("all") == NUM_PREFAULT_POLICIES);
+
+        // Every policy maps the same bytes in.
+        char path[] = "/tmp/libface-placement-XXXXXX";
+        const int fd = mkstemp(path);
+        assert(fd != -1);
+        std::vector<char> data(3 * 4096 + 10, 'a');
+        assert(write(fd, &data[0], data.size()) == (ssize_t)data.size());
+        for (int i = 0; i < NUM_PREFAULT_POLICIES; ++i) {
+            memory_placement().prefault = (prefault_policy_t)i;
+            void *p = map_input_file(fd, data.size());
+            assert(p != MAP_FAILED);
+            const size_t npages = (data.size() + sysconf(_SC_PAGESIZE) - 1) / sysconf(_SC_PAGESIZE);
+            assert(touch_memory(p, data.size()) == (npages + 1) * 'a');
+            munmap(p, data.size());
+        }
+        close(fd);
+        unlink(path);
+        assert(touch_memory(std::vector<int, IndexAllocator<int> >()) == 0);
+        memory_placement() = memory_placement_t();
+        printf("memory placement OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_PLACEMENT_HPP
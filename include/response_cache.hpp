@@ -0,0 +1,177 @@
+#if !defined LIBFACE_RESPONSE_CACHE_HPP
+#define LIBFACE_RESPONSE_CACHE_HPP
+
+#include <list>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace std;
+
+
+/* An LRU cache of rendered (and possibly compressed) response bodies,
+ * bounded by the total size of the keys & bodies it holds.
+ *
+ * Entries are reference counted so that a response that references an
+ * entry's body can be written out even if the entry is evicted (or the
+ * cache destroyed) meanwhile. The cache is not thread-safe: every event
+ * loop has its own.
+ */
+class ResponseCache {
+public:
+    struct entry_t {
+        std::string key;
+        std::string body;
+        int tag;        // Whatever the caller needs to know about the body
+        int refs;
+    };
+
+private:
+    typedef std::list<entry_t*> lru_t;
+    typedef std::map<std::string, lru_t::iterator> map_t;
+
+    size_t max_bytes;
+    size_t nbytes;
+    lru_t lru;          // Most recently used first
+    map_t entries;
+
+public:
+    ResponseCache(size_t _max_bytes)
+        : max_bytes(_max_bytes), nbytes(0) { }
+
+    ~ResponseCache() {
+        for (lru_t::iterator i = this->lru.begin(); i != this->lru.end(); ++i) {
+            release(*i);
+        }
+    }
+
+    // Returns a new reference to the entry for 'key', or NULL.
+    entry_t*
+    get(std::string const &key) {
+        map_t::iterator i = this->entries.find(key);
+        if (i == this->entries.end()) {
+            return NULL;
+        }
+        this->lru.splice(this->lru.begin(), this->lru, i->second);
+        ++(*i->second)->refs;
+        return *i->second;
+    }
+
+    // Add an entry for 'key', taking the contents of 'body', & return
+    // a new reference to it. Returns NULL (leaving 'body' alone) if
+    // the entry would be larger than the whole cache.
+    entry_t*
+    put(std::string const &key, std::string &body, int tag) {
+        const size_t sz = entry_size(key, body);
+        if (sz > this->max_bytes) {
+            return NULL;
+        }
+        this->erase(key);
+        while (this->nbytes + sz > this->max_bytes) {
+            this->erase(this->lru.back()->key);
+        }
+
+        entry_t *e = new entry_t;
+        e->key = key;
+        e->body.swap(body);
+        e->tag = tag;
+        e->refs = 2; // The cache's & the caller's
+        this->lru.push_front(e);
+        this->entries[key] = this->lru.begin();
+        this->nbytes += sz;
+        return e;
+    }
+
+    // Drop a reference to an entry returned by get() or put().
+    static void
+    release(void *data) {
+        entry_t *e = (entry_t*)data;
+        if (--e->refs == 0) {
+            delete e;
+        }
+    }
+
+    size_t
+    size() const {
+        return this->entries.size();
+    }
+
+    size_t
+    memory_usage() const {
+        return this->nbytes;
+    }
+
+private:
+    static size_t
+    entry_size(std::string const &key, std::string const &body) {
+        return sizeof(entry_t) + key.size() + body.size();
+    }
+
+    void
+    erase(std::string const &key) {
+        map_t::iterator i = this->entries.find(key);
+        if (i == this->entries.end()) {
+            return;
+        }
+        entry_t *e = *i->second;
+        this->nbytes -= entry_size(e->key, e->body);
+        this->lru.erase(i->second);
+        this->entries.erase(i);
+        release(e);
+    }
+};
+
+
+namespace response_cache {
+    inline int
+    test() {
+        printf("Testing the response cache\n");
+        printf("--------------------------\n");
+
+        std::string body;
+        const size_t entry = sizeof(ResponseCache::entry_t) + 1 + 100;
+        ResponseCache rc(3 * entry);
+        assert(rc.get("a") == NULL);
+
+        body.assign(100, 'a');
+        ResponseCache::entry_t *a = rc.put("a", body, 1);
+        assert(a && a->body == std::string(100, 'a') && a->tag == 1);
+        assert(body.empty());
+        body.assign(100, 'b');
+        ResponseCache::release(rc.put("b", body, 2));
+        body.assign(100, 'c');
+        ResponseCache::release(rc.put("c", body, 3));
+        assert(rc.size() == 3);
+        assert(rc.memory_usage() == 3 * entry);
+
+        // "a" is still referenced after being evicted.
+        ResponseCache::entry_t *b = rc.get("b");
+        ResponseCache::release(rc.get("a"));
+        body.assign(100, 'd');
+        ResponseCache::release(rc.put("d", body, 4));
+        assert(rc.size() == 3);
+        assert(rc.get("c") == NULL);
+        assert(a->refs == 2);
+        body.assign(100, 'e');
+        ResponseCache::release(rc.put("e", body, 5));
+        body.assign(100, 'f');
+        ResponseCache::release(rc.put("f", body, 6));
+        assert(rc.get("a") == NULL);
+        assert(a->refs == 1 && a->body == std::string(100, 'a'));
+        ResponseCache::release(a);
+        assert(b->body == std::string(100, 'b'));
+        ResponseCache::release(b);
+
+        // Too large to cache.
+        body.assign(3 * entry, 'g');
+        assert(rc.put("g", body, 7) == NULL);
+        assert(body.size() == 3 * entry);
+        assert(rc.size() == 3);
+        printf("response cache OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_RESPONSE_CACHE_HPP
@@ -0,0 +1,432 @@
+#if !defined LIBFACE_RMQ_HPP
+#define LIBFACE_RMQ_HPP
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <include/types.hpp>
+#include <include/utils.hpp>
+#include <include/segtree.hpp>
+#include <include/sparsetable.hpp>
+#include <include/benderrmq.hpp>
+#include <include/phrase_map.hpp>
+#include <include/suggest.hpp>
+
+using namespace std;
+
+
+enum rmq_backend_t {
+    RMQ_AUTO,           // Pick one based on the # of phrases
+    RMQ_SPARSE_TABLE,   // O(1) queries, O(n lg n) space
+    RMQ_SEGMENT_TREE,   // O(lg n) queries, O(n) space (the least)
+    RMQ_BENDER,         // O(1) queries, O(n) space
+    NUM_RMQ_BACKENDS
+};
+
+const char *const rmq_backend_names[NUM_RMQ_BACKENDS] = {
+    "auto", "sparsetable", "segtree", "bender"
+};
+
+// Returns NUM_RMQ_BACKENDS if 'name' is not a known backend.
+inline rmq_backend_t
+rmq_backend_from_name(const char *name) {
+    int i = 0;
+    while (i < NUM_RMQ_BACKENDS && strcmp(name, rmq_backend_names[i])) {
+        ++i;
+    }
+    return (rmq_backend_t)i;
+}
+
+// RMQ_AUTO uses a SparseTable (the fastest) for up to this many
+// phrases, i.e. while it needs less than ~90 MiB. Larger inputs get a
+// BenderRMQ, which needs less than half the memory per phrase & is
+// still about twice as fast as a SegmentTree (see 'make
+// bench-suggest').
+#define MAX_SIZE_FOR_AUTO_SPARSE_TABLE (1 << 20)
+
+inline rmq_backend_t
+auto_rmq_backend(size_t nphrases) {
+    return nphrases <= MAX_SIZE_FOR_AUTO_SPARSE_TABLE ? RMQ_SPARSE_TABLE : RMQ_BENDER;
+}
+
+
+/* An RMQ over the weights of the phrases in a PhraseMap, whichever
+ * the backend & the width of its weights & indexes. The backend is
+ * picked once per index, so the (virtual) call is made once per
+ * query; suggest() itself is instantiated for each backend & makes
+ * direct calls to its query_max().
+ */
+class PhraseRMQ {
+public:
+    virtual ~PhraseRMQ() { }
+
+    // See suggest() in suggest.hpp. The phrases are ranked by the
+    // scoring_t that the RMQ was built with, at time 'now'. Only
+    // phrases in any of the 'categories' are returned, if given.
+    virtual void
+    suggest(PhraseMap &pm, pvpi_t phrases, size_t n, time_t now,
+            uint32_t categories, vsz_t &ret) = 0;
+
+    virtual size_t
+    memory_usage() const = 0;
+
+    // Fault in every page of the RMQs. See touch_memory().
+    virtual size_t
+    touch() const = 0;
+
+    virtual rmq_backend_t
+    backend() const = 0;
+
+    // Whether the weights & indexes are 64-bit.
+    virtual bool
+    wide() const = 0;
+
+    // The # of categories with an RMQ of their own.
+    virtual int
+    category_rmqs() const = 0;
+};
+
+// Categories with at most 1 in this many of the phrases get an RMQ
+// of their own. Filtering the phrases of a denser category as they
+// come out of the main RMQ only skips a few phrases per suggestion,
+// but skipping over the phrases of a sparse one could take as long
+// as scanning every phrase with the prefix.
+#define MIN_SPARSITY_FOR_CATEGORY_RMQ 8
+
+template <typename RMQ_T, rmq_backend_t Backend>
+class PhraseRMQImpl : public PhraseRMQ {
+    // An RMQ over the weights of the phrases in a category.
+    struct CategoryRMQ {
+        vsz_t positions;    // Of its phrases in the PhraseMap, in order
+        RMQ_T st;
+    };
+
+    RMQ_T st;
+    scoring_t scoring;
+    CategoryRMQ *categories[MAX_CATEGORIES];
+    uint32_t nonempty_categories;   // Bit i is set if category i has any phrases
+
+public:
+    PhraseRMQImpl(PhraseMap const &pm, scoring_t const &_scoring)
+        : scoring(_scoring) {
+        build_rmq(pm, this->st, this->scoring);
+        this->build_category_rmqs(pm);
+    }
+
+    ~PhraseRMQImpl() {
+        for (int c = 0; c < MAX_CATEGORIES; ++c) {
+            delete this->categories[c];
+        }
+    }
+
+    void
+    suggest(PhraseMap &pm, pvpi_t phrases, size_t n, time_t now,
+            uint32_t cats, vsz_t &ret) {
+        size_t first = phrases.first  - pm.repr.begin();
+        size_t last  = phrases.second - pm.repr.begin();
+
+        // No phrase is in a category without phrases.
+        if (cats) {
+            cats &= this->nonempty_categories;
+            if (!cats) {
+                return;
+            }
+        }
+
+        // Categories that all have an RMQ of their own are searched
+        // together, instead of filtering the main RMQ.
+        bool own_rmqs = cats != 0;
+        for (uint32_t c = cats; c && own_rmqs; c &= c - 1) {
+            own_rmqs = this->categories[__builtin_ctz(c)] != NULL;
+        }
+        if (own_rmqs) {
+            rmq_source_t<RMQ_T> sources[MAX_CATEGORIES];
+            size_t nsources = 0;
+            for (uint32_t c = cats; c; c &= c - 1) {
+                CategoryRMQ *crmq = this->categories[__builtin_ctz(c)];
+                vsz_t const &pos = crmq->positions;
+                sources[nsources++] = rmq_source_t<RMQ_T>(
+                    &crmq->st,
+                    std::lower_bound(pos.begin(), pos.end(), first) - pos.begin(),
+                    std::lower_bound(pos.begin(), pos.end(), last) - pos.begin(),
+                    phrase_filter_t(0, &pos[0]));
+            }
+            suggest_any(pm, sources, nsources, n, this->scoring, now, ret);
+            return;
+        }
+        ::suggest(pm, this->st, first, last, n, this->scoring, now,
+                  phrase_filter_t(cats), ret);
+    }
+
+    size_t
+    memory_usage() const {
+        size_t sz = this->st.memory_usage();
+        for (int c = 0; c < MAX_CATEGORIES; ++c) {
+            if (this->categories[c]) {
+                sz += this->categories[c]->st.memory_usage() +
+                    this->categories[c]->positions.capacity() * sizeof(size_t);
+            }
+        }
+        return sz;
+    }
+
+    size_t
+    touch() const {
+        size_t sum = this->st.touch();
+        for (int c = 0; c < MAX_CATEGORIES; ++c) {
+            if (this->categories[c]) {
+                sum += this->categories[c]->st.touch() +
+                    touch_memory(this->categories[c]->positions);
+            }
+        }
+        return sum;
+    }
+
+    rmq_backend_t
+    backend() const {
+        return Backend;
+    }
+
+    bool
+    wide() const {
+        return sizeof(typename RMQ_T::index_type) > sizeof(uint_t);
+    }
+
+    int
+    category_rmqs() const {
+        int n = 0;
+        for (int c = 0; c < MAX_CATEGORIES; ++c) {
+            n += this->categories[c] != NULL;
+        }
+        return n;
+    }
+
+private:
+    void
+    build_category_rmqs(PhraseMap const &pm) {
+        size_t counts[MAX_CATEGORIES] = { 0 };
+        for (size_t i = 0; i < pm.repr.size(); ++i) {
+            for (uint32_t cats = pm.repr[i].features.categories; cats; cats &= cats - 1) {
+                ++counts[__builtin_ctz(cats)];
+            }
+        }
+
+        this->nonempty_categories = 0;
+        for (int c = 0; c < MAX_CATEGORIES; ++c) {
+            this->categories[c] = NULL;
+            if (counts[c]) {
+                this->nonempty_categories |= 1U << c;
+            }
+            if (!counts[c] || counts[c] > pm.repr.size() / MIN_SPARSITY_FOR_CATEGORY_RMQ) {
+                continue;
+            }
+            CategoryRMQ *crmq = new CategoryRMQ;
+            std::vector<typename RMQ_T::weight_type> weights;
+            crmq->positions.reserve(counts[c]);
+            weights.reserve(counts[c]);
+            for (size_t i = 0; i < pm.repr.size(); ++i) {
+                if (pm.repr[i].features.categories & (1U << c)) {
+                    crmq->positions.push_back(i);
+                    weights.push_back(rmq_weight(pm.repr[i], this->scoring));
+                }
+            }
+            crmq->st.initialize(weights);
+            this->categories[c] = crmq;
+        }
+    }
+};
+
+template <typename Weight, typename Index>
+PhraseRMQ*
+make_typed_phrase_rmq(PhraseMap const &pm, rmq_backend_t backend, scoring_t const &scoring) {
+    switch (backend) {
+    case RMQ_SPARSE_TABLE:
+        return new PhraseRMQImpl<SparseTable<Weight, Index>, RMQ_SPARSE_TABLE>(pm, scoring);
+
+    case RMQ_BENDER:
+        return new PhraseRMQImpl<BenderRMQ<Weight, Index>, RMQ_BENDER>(pm, scoring);
+
+    default:
+        return new PhraseRMQImpl<SegmentTree<Weight, Index>, RMQ_SEGMENT_TREE>(pm, scoring);
+    }
+}
+
+// Build an RMQ over the weights of 'pm' (after pm.finalize()) using
+// 'backend', with 32-bit weights & indexes unless needs_wide_rmq().
+inline PhraseRMQ*
+make_phrase_rmq(PhraseMap const &pm, rmq_backend_t backend,
+                scoring_t const &scoring = scoring_t()) {
+    if (backend == RMQ_AUTO) {
+        backend = auto_rmq_backend(pm.repr.size());
+    }
+    if (needs_wide_rmq(pm, scoring)) {
+        return make_typed_phrase_rmq<uint64_t, uint64_t>(pm, backend, scoring);
+    }
+    return make_typed_phrase_rmq<uint_t, uint_t>(pm, backend, scoring);
+}
+
+
+namespace rmq {
+    // A SparseTable that counts its queries.
+    struct CountingRMQ : public SparseTable<> {
+        static size_t&
+        nqueries() {
+            static size_t n = 0;
+            return n;
+        }
+
+        value_type
+        query_max(index_type qf, index_type ql) {
+            ++nqueries();
+            return SparseTable<>::query_max(qf, ql);
+        }
+    };
+
+    inline int
+    test() {
+        printf("Testing the RMQ backends\n");
+        printf("------------------------\n");
+
+        assert(rmq_backend_from_name("auto") == RMQ_AUTO);
+        assert(rmq_backend_from_name("bender") == RMQ_BENDER);
+        assert(rmq_backend_from_name("segtree") == RMQ_SEGMENT_TREE);
+        assert(rmq_backend_from_name("sparsetable") == RMQ_SPARSE_TABLE);
+        assert(rmq_backend_from_name("fenwick") == NUM_RMQ_BACKENDS);
+        assert(auto_rmq_backend(100) == RMQ_SPARSE_TABLE);
+        assert(auto_rmq_backend(10000000) == RMQ_BENDER);
+
+        // Enough phrases for BenderRMQ to not fall back to its
+        // SparseTable.
+        PhraseMap pm(500);
+        char buff[16];
+        for (int i = 0; i < 500; ++i) {
+            sprintf(buff, "p%d", i * 7919 % 1000);
+            pm.insert((i * 104729) % 997, buff, "");
+        }
+        pm.finalize();
+
+        PhraseMap wpm(pm);
+        wpm.repr[123].weight = 5000000000ULL;
+
+        const char *prefixes[] = { "", "p", "p1", "p12", "p5", "p99", "q" };
+        for (int backend = RMQ_AUTO; backend < NUM_RMQ_BACKENDS; ++backend) {
+            for (int w = 0; w < 2; ++w) {
+                PhraseMap &m = w ? wpm : pm;
+                PhraseRMQ *st = make_phrase_rmq(m, (rmq_backend_t)backend);
+                printf("%s (%s): %u bytes\n", rmq_backend_names[st->backend()],
+                       st->wide() ? "64-bit" : "32-bit", (uint_t)st->memory_usage());
+                assert(st->wide() == !!w);
+                assert(backend == RMQ_AUTO ? st->backend() == RMQ_SPARSE_TABLE : st->backend() == backend);
+
+                for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+                    vsz_t got;
+                    st->suggest(m, m.query(prefixes[i]), 10, 0, 0, got);
+                    vp_t expected = naive_suggest(m, *st, prefixes[i], 10);
+                    assert(got.size() == expected.size());
+                    for (size_t j = 0; j < got.size(); ++j) {
+                        assert(m.repr[got[j]].weight == expected[j].weight);
+                    }
+                }
+                delete st;
+            }
+        }
+        // Ranking by more than the weight, with every backend.
+        scoring_t scoring;
+        scoring.ctr_boost = 300;
+        scoring.freshness_boost = 500;
+        scoring.half_life = 60;
+        for (size_t i = 0; i < pm.repr.size(); i += 3) {
+            pm.repr[i].features = features_t(1000 + i, (i % 7) / 7.0);
+        }
+        for (int backend = RMQ_SPARSE_TABLE; backend < NUM_RMQ_BACKENDS; ++backend) {
+            PhraseRMQ *st = make_phrase_rmq(pm, (rmq_backend_t)backend, scoring);
+            for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+                vsz_t got;
+                st->suggest(pm, pm.query(prefixes[i]), 10, 1400, 0, got);
+                vp_t expected = naive_suggest(pm, prefixes[i], 10, scoring, 1400);
+                assert(got.size() == expected.size());
+                for (size_t j = 0; j < got.size(); ++j) {
+                    assert(scoring.score(pm.repr[got[j]], 1400) == scoring.score(expected[j], 1400));
+                }
+            }
+            delete st;
+        }
+
+        // Filtering by category: category 0 is sparse enough to get an
+        // RMQ of its own, category 1 isn't & category 2 is empty.
+        for (size_t i = 0; i < pm.repr.size(); ++i) {
+            pm.repr[i].features.categories = (i % 20 == 3 ? 1 : 0) | (i % 2 ? 2 : 0);
+        }
+        const uint32_t masks[] = { 1, 2, 3, 4 };
+        for (int backend = RMQ_SPARSE_TABLE; backend < NUM_RMQ_BACKENDS; ++backend) {
+            for (int s = 0; s < 2; ++s) {
+                scoring_t sc = s ? scoring : scoring_t();
+                PhraseRMQ *st = make_phrase_rmq(pm, (rmq_backend_t)backend, sc);
+                assert(st->category_rmqs() == 1);
+                for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); ++m) {
+                    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+                        vsz_t got;
+                        st->suggest(pm, pm.query(prefixes[i]), 10, 1400, masks[m], got);
+                        vp_t expected = naive_suggest(pm, prefixes[i], 10, sc, 1400, masks[m]);
+                        assert(got.size() == expected.size());
+                        for (size_t j = 0; j < got.size(); ++j) {
+                            assert(pm.repr[got[j]].features.categories & masks[m]);
+                            assert(sc.score(pm.repr[got[j]], 1400) == sc.score(expected[j], 1400));
+                        }
+                    }
+                }
+                delete st;
+            }
+        }
+
+        // Category 0 is dense, 3 & 4 are sparse (& overlap) & 7 is
+        // empty. Only phrases in the categories asked for are looked
+        // at, so the work is bounded by the # of results.
+        PhraseMap cpm(1000);
+        for (int i = 0; i < 1000; ++i) {
+            sprintf(buff, "c%04d", i);
+            cpm.insert((i * 7919) % 1000, buff, "",
+                       features_t(1000 + i, (i % 5) / 5.0,
+                                  1 | (i % 50 == 1 ? 8 : 0) | (i % 40 == 1 ? 16 : 0)));
+        }
+        cpm.finalize();
+        const size_t n = 10;
+        for (int s = 0; s < 2; ++s) {
+            scoring_t sc = s ? scoring : scoring_t();
+            PhraseRMQImpl<CountingRMQ, RMQ_SPARSE_TABLE> crmq(cpm, sc);
+            assert(crmq.category_rmqs() == 2);
+
+            vsz_t got;
+            CountingRMQ::nqueries() = 0;
+            crmq.suggest(cpm, cpm.query(""), n, 1400, 1U << 7, got);
+            assert(got.empty() && CountingRMQ::nqueries() == 0);
+
+            const uint32_t masks[] = { 8 | 16, 8 | 16 | 128, 8 | 128 };
+            for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); ++m) {
+                got.clear();
+                CountingRMQ::nqueries() = 0;
+                crmq.suggest(cpm, cpm.query(""), n, 1400, masks[m], got);
+                printf("categories=0x%x: %u queries\n", masks[m], (uint_t)CountingRMQ::nqueries());
+                // 1 per category RMQ, & 2 per range taken off the
+                // heap. Ranked by weight, that is at most 2 ranges per
+                // result (once per RMQ it's in).
+                assert(CountingRMQ::nqueries() <= 2 + 2 * 2 * n);
+                vp_t expected = naive_suggest(cpm, "", n, sc, 1400, masks[m]);
+                assert(got.size() == expected.size() && got.size() == n);
+                for (size_t j = 0; j < got.size(); ++j) {
+                    assert(!returned(got, j + 1, got[j]));
+                    assert(sc.score(cpm.repr[got[j]], 1400) == sc.score(expected[j], 1400));
+                }
+            }
+        }
+
+        printf("RMQ backends OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_RMQ_HPP
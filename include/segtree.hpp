@@ -15,57 +15,69 @@
 using namespace std;
 
 
+/* Weight is the type of the values & Index the type of the indexes
+ * into them. 32-bit types (the default) halve the memory used, but
+ * can not be used for more than 4G elements or values.
+ */
+template <typename Weight = uint_t, typename Index = uint_t>
 class SegmentTree {
-    vpui_t repr;
-    uint_t len;
+public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+    // first -> value, second -> index
+    typedef std::pair<Weight, Index> value_type;
+
+private:
+    std::vector<value_type, IndexAllocator<value_type> > repr;
+    Index len;
     // For each element, first is the max. value under (and including
     // this node) and second is the index where this max. value occurs.
 
 public:
-    SegmentTree(uint_t _len = 0) {
+    SegmentTree(Index _len = 0) {
         this->initialize(_len);
     }
 
     void
-    initialize(uint_t _len) {
+    initialize(Index _len) {
         len = _len;
         this->repr.clear();
-        this->repr.resize(1 << (log2(_len) + 2));
+        this->repr.resize((size_t)1 << (log2((uint64_t)_len) + 2));
     }
 
-    void initialize(vui_t const& elems) {
+    void initialize(std::vector<Weight> const& elems) {
         if (elems.empty()) {
-            this->initialize(0);
+            this->initialize((Index)0);
         }
         else {
-            this->initialize(elems.size());
+            this->initialize((Index)elems.size());
             this->_init(0, 0, elems.size() - 1, elems);
         }
     }
 
-    pui_t
-    _init(uint_t ni, uint_t b, uint_t e, vui_t const& elems) {
+    value_type
+    _init(size_t ni, Index b, Index e, std::vector<Weight> const& elems) {
         // printf("ni: %u, b: %u, e: %u, size: %u\n", ni, b, e, elems.size());
 
-        uint_t m = b + (e-b) / 2;
+        Index m = b + (e-b) / 2;
         if (b == e) {
-            this->repr[ni] = pui_t(elems[b], b);
+            this->repr[ni] = value_type(elems[b], b);
             // printf("Returning: [%u, %u]\n", this->repr[ni].first, this->repr[ni].second);
             return this->repr[ni];
         }
         else {
-            pui_t lhs = this->_init(ni*2 + 1, b, m, elems);
-            pui_t rhs = this->_init(ni*2 + 2, m+1, e, elems);
+            value_type lhs = this->_init(ni*2 + 1, b, m, elems);
+            value_type rhs = this->_init(ni*2 + 2, m+1, e, elems);
             return this->repr[ni] = (lhs.first > rhs.first ? lhs : rhs);
         }
     }
 
-    pui_t
-    _query_max(uint_t ni, uint_t b, uint_t e, uint_t qf, uint_t ql) {
+    value_type
+    _query_max(size_t ni, Index b, Index e, Index qf, Index ql) {
         // printf("_query_max(%u, %u, %u, %u, %u)\n", ni, b, e, qf, ql);
         if (b > e || qf > e || ql < b) {
             // printf("[1] Returning: (-1, -1)\n");
-            return pui_t(minus_one, minus_one);
+            return value_type((Weight)-1, (Index)-1);
         }
 
         if (b >= qf && e <= ql) {
@@ -73,22 +85,22 @@ public:
             return this->repr[ni];
         }
 
-        uint_t m = b + (e-b) / 2;
-        pui_t lhs = this->_query_max(ni*2 + 1, b, m, qf, ql);
-        pui_t rhs = this->_query_max(ni*2 + 2, m+1, e, qf, ql);
+        Index m = b + (e-b) / 2;
+        value_type lhs = this->_query_max(ni*2 + 1, b, m, qf, ql);
+        value_type rhs = this->_query_max(ni*2 + 2, m+1, e, qf, ql);
 
         // printf("lhs.second is minus_one: %d, rhs.second is minus_one: %d\n", lhs.second == minus_one, rhs.second == minus_one);
 
-        if (lhs.second == minus_one) {
+        if (lhs.second == (Index)-1) {
             // printf("[3] Returning: (%d, %d)\n", rhs.first, rhs.second);
             return rhs;
         }
-        else if (rhs.second == minus_one) {
+        else if (rhs.second == (Index)-1) {
             // printf("[4] Returning: (%d, %d)\n", lhs.first, lhs.second);
             return lhs;
         }
         else {
-            pui_t &tmp = lhs.first > rhs.first ? lhs : rhs;
+            value_type &tmp = lhs.first > rhs.first ? lhs : rhs;
             // printf("[5] Returning: (%d, %d)\n", tmp.first, tmp.second);
             return tmp;
         }
@@ -97,11 +109,23 @@ public:
 
     // qf & ql are indexes; both inclusive.
     // first -> value, second -> index
-    pui_t
-    query_max(uint_t qf, uint_t ql) {
+    value_type
+    query_max(Index qf, Index ql) {
         return this->_query_max(0, 0, this->len - 1, qf, ql);
     }
 
+    // Approximate # of bytes used by this structure.
+    size_t
+    memory_usage() const {
+        return this->repr.capacity() * sizeof(value_type);
+    }
+
+    // Fault in every page of the tree. See touch_memory().
+    size_t
+    touch() const {
+        return touch_memory(this->repr);
+    }
+
 };
 
 
@@ -145,7 +169,7 @@ namespace segtree {
             // printf("%d: %d\n", i, log2(i));
         }
 
-        SegmentTree st;
+        SegmentTree<> st;
         st.initialize(v);
 
 	printf("Testing SegmentTree implementation\n");
@@ -160,6 +184,15 @@ namespace segtree {
             }
         }
 
+        // Values & indexes that do not fit in 32 bits.
+        std::vector<uint64_t> w(v.begin(), v.end());
+        w[3] = 5000000000ULL;
+        SegmentTree<uint64_t, uint64_t> wst;
+        wst.initialize(w);
+        assert(wst.query_max(0, w.size() - 1) == std::make_pair(w[3], (uint64_t)3));
+        assert(wst.query_max(4, w.size() - 1) == std::make_pair((uint64_t)99, (uint64_t)4));
+        assert(wst.query_max(3, 2).second == (uint64_t)-1);
+
 	printf("\n");
         return 0;
     }
@@ -0,0 +1,182 @@
+#if !defined LIBFACE_SNIPPET_DICT_HPP
+#define LIBFACE_SNIPPET_DICT_HPP
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <include/types.hpp>
+#include <include/phrase_map.hpp>
+
+using namespace std;
+
+
+// The id of no snippet (i.e. of an empty one).
+const size_t no_snippet = (size_t)-1;
+
+/* Every distinct snippet of a PhraseMap, stored once & packed back
+ * to back into a single arena. Interning the snippets of a PhraseMap
+ * points them into the dictionary instead of the mmapped input file,
+ * so that the input file can be unmapped once it has been imported,
+ * & phrases that share a snippet (e.g. the name of a site) share its
+ * bytes.
+ *
+ * Snippet i is arena[offsets[i], offsets[i + 1]).
+ */
+class SnippetDictionary {
+    std::vector<char, IndexAllocator<char> > arena;
+    std::vector<size_t, IndexAllocator<size_t> > offsets;
+
+public:
+    // Copy the snippets of 'pm' into the dictionary & point them at
+    // their copies. The snippets may be anywhere (e.g. in a file that
+    // is unmapped afterwards) till this returns.
+    void
+    intern(PhraseMap &pm) {
+        const size_t n = pm.repr.size();
+        std::vector<size_t> ids(n, no_snippet);
+        std::vector<char> arena;
+        std::vector<size_t> offsets(1, 0);
+
+        // An open addressing hash table of (id + 1) of the snippets
+        // interned so far, at most half full.
+        size_t nslots = 16;
+        while (nslots < 2 * n) {
+            nslots *= 2;
+        }
+        std::vector<size_t> slots(nslots, 0);
+
+        for (size_t i = 0; i < n; ++i) {
+            StringProxy const &s = pm.repr[i].snippet;
+            if (!s.size()) {
+                continue;
+            }
+            size_t h = hash(s.mem_base, s.size()) & (nslots - 1);
+            while (slots[h]) {
+                const size_t id = slots[h] - 1;
+                if (offsets[id + 1] - offsets[id] == s.size() &&
+                    !memcmp(&arena[offsets[id]], s.mem_base, s.size())) {
+                    break;
+                }
+                h = (h + 1) & (nslots - 1);
+            }
+            if (!slots[h]) {
+                arena.insert(arena.end(), s.mem_base, s.mem_base + s.size());
+                offsets.push_back(arena.size());
+                slots[h] = offsets.size() - 1;
+            }
+            ids[i] = slots[h] - 1;
+        }
+
+        // Trim the arena to size before pointing into it.
+        std::vector<char, IndexAllocator<char> >(arena.begin(), arena.end()).swap(this->arena);
+        std::vector<size_t, IndexAllocator<size_t> >(offsets.begin(), offsets.end()).swap(this->offsets);
+        for (size_t i = 0; i < n; ++i) {
+            if (ids[i] != no_snippet) {
+                pm.repr[i].snippet = this->get(ids[i]);
+            }
+        }
+    }
+
+    // # of distinct snippets.
+    size_t
+    size() const {
+        return this->offsets.empty() ? 0 : this->offsets.size() - 1;
+    }
+
+    StringProxy
+    get(size_t id) const {
+        const size_t off = this->offsets[id];
+        return StringProxy(&this->arena[0] + off, this->offsets[id + 1] - off);
+    }
+
+    // The id of 's', which must have been interned into this
+    // dictionary, or no_snippet if it is empty (or not interned).
+    size_t
+    id_of(StringProxy const &s) const {
+        if (!s.size() || this->arena.empty() || s.mem_base < &this->arena[0] ||
+            s.mem_base >= &this->arena[0] + this->arena.size()) {
+            return no_snippet;
+        }
+        const size_t off = s.mem_base - &this->arena[0];
+        return std::lower_bound(this->offsets.begin(), this->offsets.end(), off) -
+            this->offsets.begin();
+    }
+
+    size_t
+    memory_usage() const {
+        return this->arena.capacity() + this->offsets.capacity() * sizeof(size_t);
+    }
+
+    // Fault in every page. See touch_memory().
+    size_t
+    touch() const {
+        return touch_memory(this->arena) + touch_memory(this->offsets);
+    }
+
+private:
+    // FNV-1a
+    static size_t
+    hash(const char *str, size_t len) {
+        size_t h = 2166136261U;
+        for (size_t i = 0; i < len; ++i) {
+            h = (h ^ (unsigned char)str[i]) * 16777619U;
+        }
+        return h;
+    }
+};
+
+
+namespace snippet_dict {
+    inline int
+    test() {
+        printf("Testing the snippet dictionary\n");
+        printf("------------------------------\n");
+
+        // Snippets in a buffer that goes away after interning.
+        char *input = strdup("A bird|A bird|A search engine|A bird");
+        PhraseMap pm;
+        pm.insert(1, "duck", StringProxy(input, 6));
+        pm.insert(2, "goose", StringProxy(input + 7, 6));
+        pm.insert(3, "duckduckgo", StringProxy(input + 14, 15));
+        pm.insert(4, "swan", StringProxy(input + 30, 6));
+        pm.insert(5, "duckling", StringProxy());
+        pm.finalize();
+
+        SnippetDictionary dict;
+        dict.intern(pm);
+        memset(input, 'x', strlen(input));
+        free(input);
+
+        assert(dict.size() == 2);
+        for (size_t i = 0; i < pm.repr.size(); ++i) {
+            phrase_t const &p = pm.repr[i];
+            printf("%s: %s\n", p.phrase.c_str(), std::string(p.snippet).c_str());
+            if (p.phrase == "duckduckgo") {
+                assert((std::string)p.snippet == "A search engine");
+            }
+            else if (p.phrase == "duckling") {
+                assert(p.snippet.size() == 0 && dict.id_of(p.snippet) == no_snippet);
+            }
+            else {
+                assert((std::string)p.snippet == "A bird");
+                assert(dict.id_of(p.snippet) == dict.id_of(pm.repr[0].snippet));
+            }
+        }
+        assert(dict.id_of(dict.get(1)) == 1);
+
+        SnippetDictionary empty;
+        PhraseMap epm(0);
+        empty.intern(epm);
+        assert(empty.size() == 0);
+        printf("snippet dictionary OK\n\n");
+
+        return 0;
+    }
+}
+
+#endif // LIBFACE_SNIPPET_DICT_HPP
@@ -15,7 +15,20 @@
 using namespace std;
 
 
+/* Weight is the type of the values & Index the type of the indexes
+ * into them. See SegmentTree.
+ */
+template <typename Weight = uint_t, typename Index = uint_t>
 class SparseTable {
+public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+    // first -> value, second -> index
+    typedef std::pair<Weight, Index> value_type;
+
+private:
+    typedef std::vector<Index, IndexAllocator<Index> > vindex_t;
+
     /* For each element in repr, we store just the index of the MAX
      * element in data.
      *
@@ -25,21 +38,21 @@ class SparseTable {
      * repr[X] stores MAX indexes for blocks of length (1<<X == 2^X).
      *
      */
-    vui_t data;
-    vvui_t repr;
-    uint_t len;
+    std::vector<Weight, IndexAllocator<Weight> > data;
+    std::vector<vindex_t> repr;
+    Index len;
 
 public:
 
-    void initialize(vui_t const& elems) {
+    void initialize(std::vector<Weight> const& elems) {
 
-	this->data = elems;
+	this->data.assign(elems.begin(), elems.end());
         this->len = elems.size();
         this->repr.clear();
 
         DCERR("len: "<<this->len<<endl);
 
-        const size_t ntables = log2(this->len) + 1;
+        const size_t ntables = log2((uint64_t)this->len) + 1;
         this->repr.resize(ntables);
 
         DCERR("ntables: "<<ntables<<endl);
@@ -53,13 +66,13 @@ public:
 
         for (size_t i = 1; i < ntables; ++i) {
 	    /* The previous 'block size' */
-            const uint_t pbs = 1<<(i-1);
+            const size_t pbs = (size_t)1<<(i-1);
 
             /* bs is the 'block size'. i.e. The number of elements
 	     * from the data that are used to computed the max value
 	     * and store it at repr[i][...].
 	     */
-            const uint_t bs = 1<<i;
+            const size_t bs = (size_t)1<<i;
 
 	    /* The size of the vector at repr[i]. We need to resize it
 	     * to this size.
@@ -72,13 +85,13 @@ public:
 
             // cerr<<"i: "<<i<<", vsz: "<<vsz<<endl;
 
-            vui_t& curr = this->repr[i];
-            vui_t& prev = this->repr[i - 1];
+            vindex_t& curr = this->repr[i];
+            vindex_t& prev = this->repr[i - 1];
 
             for (size_t j = 0; j < vsz; ++j) {
                 // 'j' is the starting index of a block of size 'bs'
-		const uint_t prev_elem1 = data[prev[j]];
-		const uint_t prev_elem2 = data[prev[j+pbs]];
+		const Weight prev_elem1 = data[prev[j]];
+		const Weight prev_elem2 = data[prev[j+pbs]];
                 if (prev_elem1 > prev_elem2) {
                     curr[j] = prev[j];
                 }
@@ -94,26 +107,47 @@ public:
 
     // qf & ql are indexes; both inclusive.
     // first -> value, second -> index
-    pui_t
-    query_max(uint_t qf, uint_t ql) {
+    value_type
+    query_max(Index qf, Index ql) {
         if (qf >= this->len || ql >= this->len || ql < qf) {
-            return make_pair(minus_one, minus_one);
+            return value_type((Weight)-1, (Index)-1);
         }
 
-        const int rlen = ql - qf + 1;
+        const uint64_t rlen = ql - qf + 1;
         const size_t ti = log2(rlen);
-        const size_t f = qf, l = ql + 1 - (1 << ti);
+        const size_t f = qf, l = ql + 1 - ((size_t)1 << ti);
 
         // cerr<<"query_max("<<qf<<", "<<ql<<"), ti: "<<ti<<", f: "<<f<<", l: "<<l<<endl;
-	const uint_t data1 = data[this->repr[ti][f]];
-	const uint_t data2 = data[this->repr[ti][l]];
+	const Weight data1 = data[this->repr[ti][f]];
+	const Weight data2 = data[this->repr[ti][l]];
 
         if (data1 > data2) {
-            return std::make_pair(data1, this->repr[ti][f]);
+            return value_type(data1, this->repr[ti][f]);
         }
         else {
-            return std::make_pair(data2, this->repr[ti][l]);
+            return value_type(data2, this->repr[ti][l]);
+        }
+    }
+
+    // Approximate # of bytes used by this structure.
+    size_t
+    memory_usage() const {
+        size_t bytes = this->data.capacity() * sizeof(Weight) +
+            this->repr.capacity() * sizeof(vindex_t);
+        for (size_t i = 0; i < this->repr.size(); ++i) {
+            bytes += this->repr[i].capacity() * sizeof(Index);
+        }
+        return bytes;
+    }
+
+    // Fault in every page of the tables. See touch_memory().
+    size_t
+    touch() const {
+        size_t sum = touch_memory(this->data);
+        for (size_t i = 0; i < this->repr.size(); ++i) {
+            sum += touch_memory(this->repr[i]);
         }
+        return sum;
     }
 
 };
@@ -160,7 +194,7 @@ namespace sparsetable {
             // printf("%d: %d\n", i, log2(i));
         }
 
-        SparseTable st;
+        SparseTable<> st;
         st.initialize(v);
 
         for (size_t i = 0; i < v.size(); ++i) {
@@ -172,6 +206,15 @@ namespace sparsetable {
             }
         }
 
+        // Values & indexes that do not fit in 32 bits.
+        std::vector<uint64_t> w(v.begin(), v.end());
+        w[3] = 5000000000ULL;
+        SparseTable<uint64_t, uint64_t> wst;
+        wst.initialize(w);
+        assert(wst.query_max(0, w.size() - 1) == std::make_pair(w[3], (uint64_t)3));
+        assert(wst.query_max(4, w.size() - 1) == std::make_pair((uint64_t)99, (uint64_t)4));
+        assert(wst.query_max(3, 2).second == (uint64_t)-1);
+
 	printf("\n");
         return 0;
     }
@@ -8,10 +8,13 @@
 #include <string>
 #include <queue>
 #include <stdio.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
 
 #include <include/utils.hpp>
 #include <include/types.hpp>
+#include <include/segtree.hpp>
 
 using namespace std;
 
@@ -19,15 +22,19 @@ using namespace std;
 struct PhraseRange {
     // first & last are both inclusive of the range. i.e. The range is
     // [first, last] and NOT [first, last)
-    uint_t first, last;
+    size_t first, last;
 
     // weight is the value of the best solution in the range [first,
     // last] and index is the index of this best solution in the
     // original array of strings.
-    uint_t weight, index;
+    weight_t weight;
+    size_t index;
 
-    PhraseRange(uint_t f, uint_t l, uint_t w, uint_t i)
-        : first(f), last(l), weight(w), index(i)
+    // The rmq_source_t that the range is in (see suggest_any()).
+    size_t source;
+
+    PhraseRange(size_t f, size_t l, weight_t w, size_t i, size_t s = 0)
+        : first(f), last(l), weight(w), index(i), source(s)
     { }
 
     bool
@@ -39,25 +46,161 @@ struct PhraseRange {
 typedef std::priority_queue<PhraseRange> pqpr_t;
 
 
+/* Which phrases suggest() may return, & which phrase each index of
+ * the RMQ stands for. An RMQ over just the phrases in a category (see
+ * PhraseRMQImpl) has the position of each of them in 'positions'.
+ */
+struct phrase_filter_t {
+    uint32_t categories;        // Only phrases in any of these (0 for all)
+    const size_t *positions;    // NULL if the RMQ indexes every phrase
 
-vp_t
-suggest(PhraseMap &pm, RMQ &st, std::string prefix, uint_t n = 16) {
-    pvpi_t phrases = pm.query(prefix);
-    // cerr<<"Got "<<phrases.second - phrases.first<<" candidate phrases from PhraseMap"<<endl;
+    phrase_filter_t(uint32_t _cats = 0, const size_t *_pos = NULL)
+        : categories(_cats), positions(_pos)
+    { }
 
-    uint_t first = phrases.first  - pm.repr.begin();
-    uint_t last  = phrases.second - pm.repr.begin();
+    size_t
+    at(size_t i) const {
+        return this->positions ? this->positions[i] : i;
+    }
 
-    if (first == last) {
-        return vp_t();
+    bool
+    accepts(phrase_t const &p) const {
+        return !this->categories || (p.features.categories & this->categories);
     }
+};
 
-    vp_t ret;
-    --last;
+/* An RMQ to take phrases from: the indexes [first, last) of 'st',
+ * which stand for the phrases given by 'filter'.
+ */
+template <typename RMQ_T>
+struct rmq_source_t {
+    RMQ_T *st;
+    size_t first, last;
+    phrase_filter_t filter;
+
+    rmq_source_t(RMQ_T *_st = NULL, size_t f = 0, size_t l = 0,
+                 phrase_filter_t const &_filter = phrase_filter_t())
+        : st(_st), first(f), last(l), filter(_filter)
+    { }
+};
+
+// Whether 'i' is in ret[from...].
+inline bool
+returned(vsz_t const &ret, size_t from, size_t i) {
+    return std::find(ret.begin() + from, ret.end(), i) != ret.end();
+}
+
+
+/* How phrases are ranked. The score of a phrase is its weight plus
+ * boosts for its click-through rate & for how recently it was
+ * updated:
+ *
+ *   weight + ctr_boost * ctr + freshness_boost * 2^(-age / half_life)
+ *
+ * With both boosts 0 (the default) phrases are ranked by weight.
+ */
+struct scoring_t {
+    double ctr_boost;       // Added per unit of click-through rate
+    double freshness_boost; // Added to a phrase updated just now
+    double half_life;       // Seconds for the freshness boost to halve
+
+    scoring_t()
+        : ctr_boost(0), freshness_boost(0), half_life(86400)
+    { }
+
+    bool
+    is_static() const {
+        return this->ctr_boost == 0 && this->freshness_boost == 0;
+    }
+
+    double
+    score(phrase_t const &p, time_t now) const {
+        double s = (double)p.weight + this->ctr_boost * p.features.ctr;
+        if (this->freshness_boost && p.features.timestamp) {
+            const double age = (double)now - p.features.timestamp;
+            s += this->freshness_boost * (age > 0 ? exp2(-age / this->half_life) : 1.0);
+        }
+        return s;
+    }
+
+    // The score of 'p' at any time, rounded up to a weight_t. Either
+    // boost may be negative, so each is bounded on its own: a
+    // negative one adds at most 0.
+    weight_t
+    upper_bound(phrase_t const &p) const {
+        double boost = std::max(0.0, this->ctr_boost * p.features.ctr);
+        if (p.features.timestamp) {
+            boost += std::max(0.0, this->freshness_boost);
+        }
+        const weight_t b = (weight_t)ceil(boost);
+        return p.weight > (weight_t)-1 - b ? (weight_t)-1 : p.weight + b;
+    }
+};
+
+
+// Whether the phrases in 'pm' need an RMQ with 64-bit weights &
+// indexes, i.e. some weight (or upper bound of a score, see
+// build_rmq()) does not fit in 32 bits, or there are too many phrases
+// to index with 32 bits (BenderRMQ indexes an Euler Tour of up to
+// twice as many elements, & minus_one is reserved).
+inline bool
+needs_wide_rmq(PhraseMap const &pm, scoring_t const &scoring = scoring_t()) {
+    if (pm.repr.size() >= minus_one / 2) {
+        return true;
+    }
+    for (size_t i = 0; i < pm.repr.size(); ++i) {
+        if (scoring.upper_bound(pm.repr[i]) > minus_one) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The weight of 'p' in an RMQ: the upper bound of its score if
+// phrases are not ranked by weight.
+inline weight_t
+rmq_weight(phrase_t const &p, scoring_t const &scoring) {
+    return scoring.is_static() ? p.weight : scoring.upper_bound(p);
+}
+
+// Initialize 'st' with the weights of the phrases in 'pm', or with
+// the upper bounds of their scores if they are not ranked by weight.
+template <typename RMQ_T>
+void
+build_rmq(PhraseMap const &pm, RMQ_T &st, scoring_t const &scoring = scoring_t()) {
+    std::vector<typename RMQ_T::weight_type> weights(pm.repr.size());
+    for (size_t i = 0; i < pm.repr.size(); ++i) {
+        weights[i] = rmq_weight(pm.repr[i], scoring);
+    }
+    st.initialize(weights);
+}
+
+// Append to 'ret' the indexes (into pm.repr) of the (at most) 'n'
+// best phrases that the filters accept among those in any of the
+// 'nsources' sources, best first. A phrase in several of the sources
+// (e.g. in the RMQs of two of its categories) is returned once.
+//
+// Phrases that a filter rejects are skipped over, but still split
+// their range, so this takes O((k + r) lg (k + r)) time where r is
+// the # of rejected (or repeated) phrases that outrank the k-th
+// accepted one.
+template <typename RMQ_T>
+void
+suggest_any(PhraseMap &pm, rmq_source_t<RMQ_T> const *sources, size_t nsources,
+            size_t n, vsz_t &ret) {
+    typedef typename RMQ_T::value_type value_type;
+
+    const size_t start = ret.size();
+    n += ret.size();
 
     pqpr_t heap;
-    pui_t best = st.query_max(first, last);
-    heap.push(PhraseRange(first, last, best.first, best.second));
+    value_type best;
+    for (size_t s = 0; s < nsources; ++s) {
+        if (sources[s].first < sources[s].last) {
+            best = sources[s].st->query_max(sources[s].first, sources[s].last - 1);
+            heap.push(PhraseRange(sources[s].first, sources[s].last - 1, best.first, best.second, s));
+        }
+    }
 
     while (ret.size() < n && !heap.empty()) {
         PhraseRange pr = heap.top();
@@ -65,17 +208,21 @@ suggest(PhraseMap &pm, RMQ &st, std::string prefix, uint_t n = 16) {
         // cerr<<"Top phrase is at index: "<<pr.index<<endl;
         // cerr<<"And is: "<<pm.repr[pr.index].first<<endl;
 
-        ret.push_back(pm.repr[pr.index]);
+        rmq_source_t<RMQ_T> const &src = sources[pr.source];
+        const size_t i = src.filter.at(pr.index);
+        if (src.filter.accepts(pm.repr[i]) && (nsources == 1 || !returned(ret, start, i))) {
+            ret.push_back(i);
+        }
 
-        uint_t lower = pr.first;
-        uint_t upper = pr.index - 1;
+        size_t lower = pr.first;
+        size_t upper = pr.index - 1;
 
         // Prevent underflow
         if (pr.index - 1 < pr.index && lower <= upper) {
             // cerr<<"[1] adding to heap: "<<lower<<", "<<upper<<", "<<best.first<<", "<<best.second<<endl;
 
-            best = st.query_max(lower, upper);
-            heap.push(PhraseRange(lower, upper, best.first, best.second));
+            best = src.st->query_max(lower, upper);
+            heap.push(PhraseRange(lower, upper, best.first, best.second, pr.source));
         }
 
         lower = pr.index + 1;
@@ -85,18 +232,161 @@ suggest(PhraseMap &pm, RMQ &st, std::string prefix, uint_t n = 16) {
         if (pr.index + 1 > pr.index && lower <= upper) {
             // cerr<<"[2] adding to heap: "<<lower<<", "<<upper<<", "<<best.first<<", "<<best.second<<endl;
 
-            best = st.query_max(lower, upper);
-            heap.push(PhraseRange(lower, upper, best.first, best.second));
+            best = src.st->query_max(lower, upper);
+            heap.push(PhraseRange(lower, upper, best.first, best.second, pr.source));
         }
     }
+}
+
+// Append to 'ret' the indexes (into pm.repr) of the (at most) 'n'
+// best phrases that 'filter' accepts among those at the indexes
+// [first, last) of 'st', best first.
+template <typename RMQ_T>
+void
+suggest(PhraseMap &pm, RMQ_T &st, size_t first, size_t last, size_t n,
+        phrase_filter_t const &filter, vsz_t &ret) {
+    rmq_source_t<RMQ_T> source(&st, first, last, filter);
+    suggest_any(pm, &source, 1, n, ret);
+}
+
+// Append to 'ret' the indexes (into pm.repr) of the (at most) 'n'
+// best phrases in the range 'phrases' (typically the result of
+// PhraseMap::query()), best first. Only phrases in any of the
+// 'categories' are returned, if given.
+template <typename RMQ_T>
+void
+suggest(PhraseMap &pm, RMQ_T &st, pvpi_t phrases, size_t n, vsz_t &ret,
+        uint32_t categories = 0) {
+    // cerr<<"Got "<<phrases.second - phrases.first<<" candidate phrases from PhraseMap"<<endl;
+    suggest(pm, st, phrases.first - pm.repr.begin(), phrases.second - pm.repr.begin(),
+            n, phrase_filter_t(categories), ret);
+}
+
+/* Either a range of phrases keyed by the largest upper bound of the
+ * scores in it (as given by the RMQ), or a single phrase (first ==
+ * last == index) keyed by its actual score. A phrase at the top of
+ * the heap scores at least as much as any phrase not yet scored.
+ */
+struct ScoredRange {
+    size_t first, last, index;
+    double score;
+    bool scored;
+    size_t source;  // See PhraseRange
+
+    ScoredRange(size_t f, size_t l, size_t i, double s, bool _scored, size_t _source = 0)
+        : first(f), last(l), index(i), score(s), scored(_scored), source(_source)
+    { }
 
+    bool
+    operator<(ScoredRange const &rhs) const {
+        if (this->score != rhs.score) {
+            return this->score < rhs.score;
+        }
+        return !this->scored && rhs.scored;
+    }
+};
+
+// Like suggest_any() above, but ranks the phrases by 'scoring' at
+// time 'now'. The RMQs must have been built by build_rmq() with
+// 'scoring'.
+template <typename RMQ_T>
+void
+suggest_any(PhraseMap &pm, rmq_source_t<RMQ_T> const *sources, size_t nsources,
+            size_t n, scoring_t const &scoring, time_t now, vsz_t &ret) {
+    typedef typename RMQ_T::value_type value_type;
+
+    if (scoring.is_static()) {
+        suggest_any(pm, sources, nsources, n, ret);
+        return;
+    }
+
+    const size_t start = ret.size();
+    n += ret.size();
+
+    std::priority_queue<ScoredRange> heap;
+    value_type best;
+    for (size_t s = 0; s < nsources; ++s) {
+        if (sources[s].first < sources[s].last) {
+            best = sources[s].st->query_max(sources[s].first, sources[s].last - 1);
+            heap.push(ScoredRange(sources[s].first, sources[s].last - 1, best.second, best.first, false, s));
+        }
+    }
+
+    while (ret.size() < n && !heap.empty()) {
+        ScoredRange sr = heap.top();
+        heap.pop();
+
+        if (sr.scored) {
+            if (nsources == 1 || !returned(ret, start, sr.index)) {
+                ret.push_back(sr.index);
+            }
+            continue;
+        }
+
+        // Score the phrase with the best upper bound in the range &
+        // split the range around it.
+        rmq_source_t<RMQ_T> const &src = sources[sr.source];
+        const size_t i = src.filter.at(sr.index);
+        if (src.filter.accepts(pm.repr[i])) {
+            heap.push(ScoredRange(i, i, i, scoring.score(pm.repr[i], now), true, sr.source));
+        }
+
+        if (sr.index > sr.first) {
+            best = src.st->query_max(sr.first, sr.index - 1);
+            heap.push(ScoredRange(sr.first, sr.index - 1, best.second, best.first, false, sr.source));
+        }
+        if (sr.index < sr.last) {
+            best = src.st->query_max(sr.index + 1, sr.last);
+            heap.push(ScoredRange(sr.index + 1, sr.last, best.second, best.first, false, sr.source));
+        }
+    }
+}
+
+// Like suggest() above, but ranks the phrases by 'scoring' at time
+// 'now'. 'st' must have been built by build_rmq() with 'scoring'.
+template <typename RMQ_T>
+void
+suggest(PhraseMap &pm, RMQ_T &st, size_t first, size_t last, size_t n,
+        scoring_t const &scoring, time_t now, phrase_filter_t const &filter,
+        vsz_t &ret) {
+    rmq_source_t<RMQ_T> source(&st, first, last, filter);
+    suggest_any(pm, &source, 1, n, scoring, now, ret);
+}
+
+template <typename RMQ_T>
+void
+suggest(PhraseMap &pm, RMQ_T &st, pvpi_t phrases, size_t n,
+        scoring_t const &scoring, time_t now, vsz_t &ret,
+        uint32_t categories = 0) {
+    suggest(pm, st, phrases.first - pm.repr.begin(), phrases.second - pm.repr.begin(),
+            n, scoring, now, phrase_filter_t(categories), ret);
+}
+
+// Return the (at most) 'n' best phrases in the range 'phrases'.
+template <typename RMQ_T>
+vp_t
+suggest(PhraseMap &pm, RMQ_T &st, pvpi_t phrases, size_t n = 16) {
+    vsz_t indexes;
+    suggest(pm, st, phrases, n, indexes);
+
+    vp_t ret;
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        ret.push_back(pm.repr[indexes[i]]);
+    }
     return ret;
 }
 
+template <typename RMQ_T>
+vp_t
+suggest(PhraseMap &pm, RMQ_T &st, std::string prefix, size_t n = 16) {
+    return suggest(pm, st, pm.query(prefix), n);
+}
+
+template <typename RMQ_T>
 vp_t
-naive_suggest(PhraseMap& pm, RMQ& st, std::string prefix, uint_t n = 16) {
+naive_suggest(PhraseMap& pm, RMQ_T& st, std::string prefix, size_t n = 16) {
     pvpi_t phrases = pm.query(prefix);
-    std::vector<uint_t> indexes;
+    vsz_t indexes;
     vp_t ret;
 
     while (phrases.first != phrases.second) {
@@ -105,7 +395,7 @@ naive_suggest(PhraseMap& pm, RMQ& st, std::string prefix, uint_t n = 16) {
     }
 
     while (ret.size() < n && !indexes.empty()) {
-        uint_t mi = 0;
+        size_t mi = 0;
         for (size_t i = 1; i < indexes.size(); ++i) {
             if (pm.repr[indexes[i]].weight > pm.repr[indexes[mi]].weight) {
                 mi = i;
@@ -117,6 +407,29 @@ naive_suggest(PhraseMap& pm, RMQ& st, std::string prefix, uint_t n = 16) {
     return ret;
 }
 
+// Like naive_suggest(), but ranks the phrases by 'scoring' at time
+// 'now', & only returns those in any of the 'categories' (if given).
+inline vp_t
+naive_suggest(PhraseMap& pm, std::string prefix, size_t n,
+              scoring_t const &scoring, time_t now, uint32_t categories = 0) {
+    pvpi_t phrases = pm.query(prefix);
+    vp_t ret(phrases.first, phrases.second);
+    std::vector<std::pair<double, size_t> > scores;
+    phrase_filter_t filter(categories);
+    for (size_t i = 0; i < ret.size(); ++i) {
+        if (filter.accepts(ret[i])) {
+            scores.push_back(std::make_pair(-scoring.score(ret[i], now), i));
+        }
+    }
+    std::stable_sort(scores.begin(), scores.end());
+
+    vp_t sorted;
+    for (size_t i = 0; i < scores.size() && i < n; ++i) {
+        sorted.push_back(ret[scores[i].second]);
+    }
+    return sorted;
+}
+
 namespace _suggest {
     int
     test() {
@@ -134,13 +447,9 @@ namespace _suggest {
 
         pm.finalize();
 
-        RMQ st;
-        vui_t weights;
-        for (size_t i = 0; i < pm.repr.size(); ++i) {
-            weights.push_back(pm.repr[i].weight);
-        }
-
-        st.initialize(weights);
+        assert(!needs_wide_rmq(pm));
+        SegmentTree<> st;
+        build_rmq(pm, st);
 
         cout<<"\n";
         cout<<"suggest(\"d\"):\n"<<suggest(pm, st, "d")<<endl;
@@ -170,6 +479,96 @@ namespace _suggest {
         cout<<"suggest(\"c\"):\n"<<suggest(pm, st, "c")<<endl;
         cout<<"naive_suggest(\"c\"):\n"<<naive_suggest(pm, st, "c")<<endl;
 
+        // Weights that need a 64-bit RMQ.
+        pm.insert(6000000000ULL, "duckling", "");
+        pm.finalize();
+        assert(needs_wide_rmq(pm));
+        SegmentTree<uint64_t, uint64_t> wst;
+        build_rmq(pm, wst);
+        vp_t wide = suggest(pm, wst, "duck", 2);
+        assert(wide.size() == 2);
+        assert(wide[0].phrase == "duckling" && wide[0].weight == 6000000000ULL);
+        assert(wide[1].phrase == "duckgo");
+
+        // Ranking by recency & click-through rate.
+        PhraseMap fpm;
+        const time_t now = 1700000000;
+        fpm.insert(100, "news", "");
+        fpm.insert(90, "newton", "", features_t(now - 3600, 0));
+        fpm.insert(80, "newark", "", features_t(now - 86400 * 30, 0));
+        fpm.insert(70, "newsletter", "", features_t(0, 0.5));
+        fpm.insert(10, "new york", "", features_t(now, 0.25));
+        fpm.finalize();
+
+        scoring_t scoring;
+        scoring.ctr_boost = 100;
+        scoring.freshness_boost = 50;
+        scoring.half_life = 3600;
+        SegmentTree<> sst;
+        build_rmq(fpm, sst, scoring);
+
+        vsz_t ranked;
+        suggest(fpm, sst, fpm.query("new"), 10, scoring, now, ranked);
+        vp_t expected = naive_suggest(fpm, "new", 10, scoring, now);
+        assert(ranked.size() == 5 && expected.size() == 5);
+        for (size_t j = 0; j < ranked.size(); ++j) {
+            cout<<fpm.repr[ranked[j]]<<" scores "<<scoring.score(fpm.repr[ranked[j]], now)<<endl;
+            assert(fpm.repr[ranked[j]].phrase == expected[j].phrase);
+        }
+        // newsletter: 120, newton: 115, news: 100, new york: 85, newark: 80
+        assert(fpm.repr[ranked[0]].phrase == "newsletter");
+        assert(fpm.repr[ranked[1]].phrase == "newton");
+
+        // Two hours later, "newton" is no longer as fresh.
+        ranked.clear();
+        suggest(fpm, sst, fpm.query("new"), 2, scoring, now + 7200, ranked);
+        assert(ranked.size() == 2);
+        assert(fpm.repr[ranked[0]].phrase == "newsletter");
+        assert(fpm.repr[ranked[1]].phrase == "news");
+
+        // A penalty for recently updated phrases. The bounds in the
+        // RMQ must not let it cancel out the ctr boost.
+        scoring_t penalty;
+        penalty.ctr_boost = 10;
+        penalty.freshness_boost = -5;
+        penalty.half_life = 3600;
+        PhraseMap npm;
+        npm.insert(100, "stale", "", features_t(now - 86400 * 30, 1.0));
+        npm.insert(105, "steady", "", features_t(0, 0.2));
+        npm.insert(103, "stock", "", features_t(now, 0.5));
+        npm.insert(104, "stone", "");
+        npm.finalize();
+        SegmentTree<> nst;
+        build_rmq(npm, nst, penalty);
+        ranked.clear();
+        suggest(npm, nst, npm.query("st"), 10, penalty, now, ranked);
+        expected = naive_suggest(npm, "st", 10, penalty, now);
+        assert(ranked.size() == 4 && expected.size() == 4);
+        for (size_t j = 0; j < ranked.size(); ++j) {
+            cout<<npm.repr[ranked[j]]<<" scores "<<penalty.score(npm.repr[ranked[j]], now)<<endl;
+            assert(penalty.score(npm.repr[ranked[j]], now) == penalty.score(expected[j], now));
+        }
+        // stale: ~110, steady: 107, stone: 104, stock: 103
+        assert(npm.repr[ranked[0]].phrase == "stale");
+
+        // Only the phrases in category 1 (e.g. places).
+        fpm.repr[0].features.categories = 2; // new york
+        fpm.repr[1].features.categories = 2; // newark
+        fpm.repr[2].features.categories = 3; // news
+        SegmentTree<> fst;
+        build_rmq(fpm, fst);
+        ranked.clear();
+        suggest(fpm, fst, fpm.query("new"), 2, ranked, 2);
+        assert(ranked.size() == 2);
+        assert(fpm.repr[ranked[0]].phrase == "news");
+        assert(fpm.repr[ranked[1]].phrase == "newark");
+        ranked.clear();
+        suggest(fpm, sst, fpm.query("new"), 10, scoring, now, ranked, 2);
+        assert(ranked.size() == 3);
+        assert(fpm.repr[ranked[0]].phrase == "news");
+        assert(fpm.repr[ranked[1]].phrase == "new york");
+        assert(fpm.repr[ranked[2]].phrase == "newark");
+
         return 0;
     }
 }
@@ -5,15 +5,18 @@
 #include <vector>
 #include <string>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
-#if !defined RMQ
-#define RMQ SegmentTree
-// #define RMQ SparseTable
-#endif
+#include <include/placement.hpp>
 
 typedef unsigned int uint_t;
 
+// Weights are always stored as 64-bit numbers (phrase_t is padded to
+// 8 bytes anyway). The RMQ over the weights is what is sized to fit
+// the data; see needs_wide_rmq().
+typedef uint64_t weight_t;
+
 struct StringProxy {
     const char *mem_base;
     int len;
@@ -33,6 +36,11 @@ struct StringProxy {
         return this->len;
     }
 
+    bool
+    equals(const char *str) const {
+        return strlen(str) == this->size() && !memcmp(this->mem_base, str, this->len);
+    }
+
     operator std::string() const {
         // Basic sanity checking. Make sure that this->len is in the
         // range [0..64k].
@@ -49,13 +57,34 @@ struct StringProxy {
 };
 
 
+// Signals other than the weight that a phrase may be ranked by (see
+// scoring_t) or filtered by. All are 0 if unknown.
+struct features_t {
+    uint32_t timestamp;     // When the phrase was last updated (UNIX time)
+    float ctr;              // Click-through rate, in [0, 1]
+    uint32_t categories;    // Bit i is set if the phrase is in category i
+
+    features_t(uint32_t _ts = 0, float _ctr = 0, uint32_t _cats = 0)
+        : timestamp(_ts), ctr(_ctr), categories(_cats)
+    { }
+
+    bool
+    empty() const {
+        return !this->timestamp && !this->ctr && !this->categories;
+    }
+};
+
+#define MAX_CATEGORIES 32
+
 struct phrase_t {
-    uint_t weight;
+    weight_t weight;
     std::string phrase;
     StringProxy snippet;
+    features_t features;
 
-    phrase_t(uint_t _w, std::string const& _p, StringProxy const& _s)
-        : weight(_w), phrase(_p), snippet(_s) {
+    phrase_t(weight_t _w, std::string const& _p, StringProxy const& _s,
+             features_t const& _f = features_t())
+        : weight(_w), phrase(_p), snippet(_s), features(_f) {
     }
 
     void
@@ -63,6 +92,7 @@ struct phrase_t {
         std::swap(this->weight, rhs.weight);
         this->phrase.swap(rhs.phrase);
         this->snippet.swap(rhs.snippet);
+        std::swap(this->features, rhs.features);
     }
 
     bool
@@ -79,7 +109,7 @@ namespace std {
     }
 }
 
-typedef std::vector<phrase_t> vp_t;
+typedef std::vector<phrase_t, IndexAllocator<phrase_t> > vp_t;
 typedef vp_t::iterator vpi_t;
 typedef std::pair<vpi_t, vpi_t> pvpi_t;
 
@@ -88,6 +118,7 @@ typedef std::vector<uint_t> vui_t;
 typedef std::vector<vui_t> vvui_t;
 typedef std::vector<pui_t> vpui_t;
 typedef std::vector<vpui_t> vvpui_t;
+typedef std::vector<size_t> vsz_t;
 
 typedef std::pair<std::string, uint_t> psui_t;
 typedef std::vector<psui_t> vpsui_t;
@@ -24,7 +24,7 @@
 #define assert_eq(X,Y) if (!((X)==(Y))) { fprintf(stderr, "%d == %d FAILED\n", (X), (Y)); assert((X)==(Y)); }
 #define assert_ne(X,Y) if (!((X)!=(Y))) { fprintf(stderr, "%d != %d FAILED\n", (X), (Y)); assert((X)!=(Y)); }
 
-inline uint_t log2(uint_t n) {
+inline uint_t log2(uint64_t n) {
     uint_t lg2 = 0;
     while (n > 1) {
         n /= 2;
@@ -33,11 +33,15 @@ inline uint_t log2(uint_t n) {
     return lg2;
 }
 
+inline uint_t log2(uint_t n) {
+    return log2((uint64_t)n);
+}
+
 const uint_t minus_one = (uint_t)0 - 1;
 
-template <typename T>
+template <typename T, typename A>
 std::ostream&
-operator<<(std::ostream& out, std::vector<T> const& vec) {
+operator<<(std::ostream& out, std::vector<T, A> const& vec) {
     for (size_t i = 0; i < vec.size(); ++i) {
         out<<vec[i]<<std::endl;
     }
@@ -1,28 +1,40 @@
 #include <include/httpserver.hpp>
 #include <include/utils.hpp>
+#include <include/mempool.hpp>
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <strings.h>
+#include <algorithm>
 
 #define CHECK(r, msg)                                           \
     if (r) {                                                    \
-        uv_err_t err = uv_last_error(uv_loop);                  \
-        fprintf(stderr, "%s: %s\n", msg, uv_strerror(err));     \
+        fprintf(stderr, "%s: %s\n", msg, uv_strerror(r));       \
         exit(1);                                                \
     }
 #define UVERR(err, msg) fprintf(stderr, "%s: %s\n", msg, uv_strerror(err))
 
 static const size_t MAX_URL_SIZE          = 2048;
+static const size_t MAX_HEADER_SIZE       = 1024; // Longer values of headers we keep are truncated
+static const size_t READ_BUFFER_SIZE      = 4096; // Autocomplete requests are a few hundred bytes
+static const size_t MAX_PENDING_RESPONSE_SIZE = 65536; // Stop parsing pipelined requests beyond this much unwritten response
+static const uint64_t SWEEP_INTERVAL      = 1000; // How often to look for timed out connections (msec)
 static size_t MAX_OPEN_FDS                = 0;
 static size_t MAX_CONNECTED_CLIENTS       = 0;    // Usually MAX_OPEN_FDS - 10
 
-static uv_loop_t* uv_loop;                          // UV-event-loop pointer
-static uv_tcp_t server;                             // Global TCP server
 static http_parser_settings parser_settings;        // Global parser settings
 static request_callback_t request_callback = NULL;  // The global request callback to invoke
-static std::list<client_t*> connected_clients;      // The LRU list of connected clients. Front of the list is the least recently active client connection
-static size_t nconnected_clients = 0;               // The # of currently connected clients
-static std::list<client_t*> empty_list;             // Used to move nodes around in O(1) time by move_to_back()
+static loop_start_callback_t loop_start_callback = NULL; // Called as each event loop starts (if set)
+static loop_sweep_callback_t loop_sweep_callback = NULL; // Called by on_sweep() (if set)
+static std::vector<server_loop_t*> server_loops;    // The event loops. The first one runs on the main thread
+static httpserver_limits_t limits;
+
+LatencyHistogram write_latency;
+unsigned long connections_timed_out = 0;
+unsigned long requests_rejected = 0;
 
 enum {
     HTTP_PARSER_CONTINUE_PARSING = 0,
@@ -32,10 +44,8 @@ enum {
 // Move element pointed to by 'iter' to the end of the list
 // 'l'. 'iter' MUST be a member of 'l'.
 void move_to_back(std::list<client_t*> &l, std::list<client_t*>::iterator iter) {
-    assert(empty_list.empty());
     assert(!l.empty());
-    empty_list.splice(empty_list.end(), l, iter);
-    l.splice(l.end(), empty_list, empty_list.begin());
+    l.splice(l.end(), l, iter);
 }
 
 void build_HTTP_response_header(std::string &response_header,
@@ -59,44 +69,113 @@ void build_HTTP_response_header(std::string &response_header,
     response_header = os.str();
 }
 
+header_template_t::header_template_t(int status_code, const char *status_str, headers_t headers) {
+    std::string body;
+    for (int http_minor = 0; http_minor < 2; ++http_minor) {
+        for (int keep_alive = 0; keep_alive < 2; ++keep_alive) {
+            headers["Connection"] = keep_alive ? "Keep-Alive" : "Close";
+            build_HTTP_response_header(this->repr[http_minor][keep_alive], 1, http_minor,
+                                       status_code, status_str, headers, body);
+            // Move the Content-Length header to the end & strip its
+            // value along with the blank line.
+            std::string &h = this->repr[http_minor][keep_alive];
+            const size_t cl = h.find("Content-Length: ");
+            const size_t cl_end = h.find("\r\n", cl) + 2;
+            h.erase(cl, cl_end - cl);
+            h.resize(h.size() - 2);
+            h += "Content-Length: ";
+        }
+    }
+}
+
+// Hand all the responses built so far to uv_write(), unless a write
+// is already in progress, in which case after_write() calls us again.
+// Nothing is written while a response is being built by
+// defer_response(), since the responses would then go out of order.
+static void flush_responses(client_t *client) {
+    if (client->in_flight.nmessages || client->response.fragments.empty() ||
+        client->deferred || uv_is_closing((uv_handle_t*)&client->handle)) {
+        return;
+    }
+
+    client->in_flight.swap(client->response);
+    response_t &response = client->in_flight;
+
+    client->resbufs.resize(response.fragments.size());
+    uv_buf_t *resbuf = &client->resbufs[0];
+    for (size_t i = 0; i < response.fragments.size(); ++i) {
+        response_t::fragment_t const &f = response.fragments[i];
+        resbuf[i].base = (char*)(f.base ? f.base : response.owned.data() + f.offset);
+        resbuf[i].len  = f.len;
+    }
+
+    client->write_started_at = read_ticks();
+    uv_write(&client->write_req, (uv_stream_t*)&client->handle,
+             resbuf, client->resbufs.size(), after_write);
+}
+
+// Complete the last response in client->response by prefixing its
+// body with 'header' & the Content-Length.
+static void finish_response(client_t *client, std::string const &header) {
+    response_t &response = client->response;
+    char content_length[32];
+    const int n = sprintf(content_length, "%u\r\n\r\n", (unsigned int)response.body_size());
+    response.set_message_header(header.data(), header.size(), content_length, n);
+
+    // Responses to pipelined requests are batched into one write once
+    // everything that has been read is parsed.
+    if (!client->parsing) {
+        flush_responses(client);
+    }
+}
+
 void write_response(client_t *client,
                     int status_code,
                     const char *status_str,
                     headers_t &headers,
                     std::string &body) {
-    assert(client->resstrs.empty());
-    std::string header_str;
-    const int http_major = client->parser.http_major;
     const int http_minor = client->parser.http_minor;
-    if (http_should_keep_alive(&client->parser)) {
-        headers["Connection"] = "Keep-Alive";
-    } else {
-        headers["Connection"] = "Close";
-    }
-
-    build_HTTP_response_header(header_str, http_major, http_minor,
-                               status_code, status_str, headers, body);
-
-    client->resstrs.resize(2);
-    client->resstrs[0].swap(header_str);
-    client->resstrs[1].swap(body);
+    const bool keep_alive = http_should_keep_alive(&client->parser);
 
-    uv_buf_t resbuf[2];
-    resbuf[0].base = (char*)client->resstrs[0].c_str();
-    resbuf[0].len  = client->resstrs[0].size();
+    // Responses built this way are rare (errors, imports, stats,
+    // etc...), so we render the headers from scratch each time.
+    header_template_t header_template(status_code, status_str, headers);
+    client->response.append(body);
+    finish_response(client, header_template.get(http_minor, keep_alive));
+}
 
-    resbuf[1].base = (char*)client->resstrs[1].c_str();
-    resbuf[1].len  = client->resstrs[1].size();
+void write_response(client_t *client,
+                    header_template_t const &header_template) {
+    const int http_minor = client->parser.http_minor;
+    const bool keep_alive = http_should_keep_alive(&client->parser);
+    finish_response(client, header_template.get(http_minor, keep_alive));
+}
 
-    uv_write(&client->write_req, (uv_stream_t*)&client->handle,
-             resbuf, 2, after_write);
+// Answer the request being parsed with an error, & stop reading from
+// the connection. It is closed once the responses to this & any
+// earlier requests have been written.
+static void reject_request(client_t *client, int status_code, const char *status_str) {
+    DPRINTF("Rejecting request: %d %s\n", status_code, status_str);
+    __sync_fetch_and_add(&requests_rejected, 1);
+    uv_read_stop((uv_stream_t*)&client->handle);
+    http_parser_pause(&client->parser, 1);
+    client->close_after_write = true;
+
+    headers_t headers;
+    headers["Content-Type"] = "text/plain";
+    header_template_t header_template(status_code, status_str, headers);
+    client->response.begin_message();
+    client->response.append(status_str);
+    client->response.append("\n");
+    finish_response(client, header_template.get(client->parser.http_minor, false));
 }
 
 void close_connection(client_t *client) {
-    assert(client->cciter != connected_clients.end());
-    connected_clients.erase(client->cciter);
-    client->cciter = connected_clients.end();
-    --nconnected_clients;
+    server_loop_t *sl = client->loop;
+    assert(client->cciter != sl->connected_clients.end());
+    sl->connected_clients.erase(client->cciter);
+    client->cciter = sl->connected_clients.end();
+    --sl->nconnected_clients;
     uv_close((uv_handle_t*) &client->handle, on_close);
 }
 
@@ -104,21 +183,25 @@ void on_close(uv_handle_t* handle) {
     DCERR("Connection Closed\n");
     client_t* client = (client_t*) handle->data;
     for (size_t i = 0; i < client->unparsed_data.size(); ++i) {
-        free(client->unparsed_data[i].base);
+        client->loop->read_buffer_pool.put(client->unparsed_data[i].base);
     }
+    client->unparsed_data.clear();
     // This is weird because handle is actually within 'client', so we
     // need to NULL out 'data' before we delete client.
     handle->data = NULL;
-    delete client;
+    if (client->deferred) {
+        // on_work_done() still needs the client, & frees it.
+        return;
+    }
+    client->loop->client_pool.destroy(client);
 }
 
-uv_buf_t on_alloc(uv_handle_t* client, size_t suggested_size) {
-    // fprintf(stderr, "suggested_size: %d\n", suggested_size);
-    uv_buf_t buf;
-    buf.base = (char*)malloc(suggested_size);
-    assert(buf.base);
-    buf.len = suggested_size;
-    return buf;
+void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t *buf) {
+    // libuv suggests 64KiB, but requests are small. Larger requests
+    // are just read (& parsed) in more than one go.
+    client_t *client = (client_t*)handle->data;
+    buf->base = (char*)client->loop->read_buffer_pool.get();
+    buf->len = READ_BUFFER_SIZE;
 }
 
 bool on_resume_read(client_t *client, partial_buf_t &pbuf) {
@@ -131,7 +214,9 @@ bool on_resume_read(client_t *client, partial_buf_t &pbuf) {
     DPRINTF("# of bytes remaining: %d\n", pending);
     assert(pending > 0);
 
+    client->parsing = true;
     parsed = http_parser_execute(&client->parser, &parser_settings, pbuf.base + pbuf.offset, pending);
+    client->parsing = false;
     if (parsed < pending) {
         DPRINTF("parsed incomplete data::%d/%d bytes parsed\n", parsed, pending);
         if (client->parser.http_errno == HPE_PAUSED) {
@@ -145,54 +230,61 @@ bool on_resume_read(client_t *client, partial_buf_t &pbuf) {
     }
 }
 
-void on_read(uv_stream_t* tcp, ssize_t nread, uv_buf_t buf) {
+void on_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t *buf) {
     client_t* client = (client_t*) tcp->data;
-    partial_buf_t pbuf(buf, nread, 0);
+    partial_buf_t pbuf(*buf, nread, 0);
+    char *base = buf->base;
     assert(client->unparsed_data.empty());
 
     if (nread > 0) {
         bool consumed_all = on_resume_read(client, pbuf);
         if (!consumed_all) {
-            buf.base = 0;
+            base = NULL;
             client->unparsed_data.push_back(pbuf);
         }
     } else if (nread < 0) {
         // Always close the connection on error.
         // https://groups.google.com/forum/?fromgroups=#!topic/libuv/IG7tTbf6Zmg
-        uv_err_t err = uv_last_error(uv_loop);
-        if (err.code != UV_EOF) {
-            UVERR(err, "read");
+        if (nread != UV_EOF) {
+            UVERR(nread, "read");
         }
         close_connection(client);
     }
-    free(buf.base);
+    if (base) {
+        client->loop->read_buffer_pool.put(base);
+    }
+
+    // Write the responses to all the requests in this read at once.
+    flush_responses(client);
 }
 
 void on_connect(uv_stream_t* server_handle, int status) {
+    server_loop_t *sl = (server_loop_t*)server_handle->data;
     if (status != 0) {
-        uv_err_t err = uv_last_error(uv_loop);
-        UVERR(err, "connect");
+        UVERR(status, "connect");
         return;
     }
-    assert((uv_tcp_t*)server_handle == &server);
+    assert((uv_tcp_t*)server_handle == &sl->server);
 
     int r;
-    client_t* client = new client_t;
+    client_t* client = sl->client_pool.create();
 
-    ++nconnected_clients;
-    DCERR("New Connection::nconnected_clients: " << nconnected_clients << "\n");
+    ++sl->nconnected_clients;
+    DCERR("New Connection::nconnected_clients: " << sl->nconnected_clients << "\n");
 
-    uv_tcp_init(uv_loop, &client->handle);
+    uv_tcp_init(sl->loop, &client->handle);
     http_parser_init(&client->parser, HTTP_REQUEST);
 
+    client->loop = sl;
     client->parser.data = client;
     client->handle.data = client;
-    client->cciter = connected_clients.insert(connected_clients.end(), client);
+    client->last_active_at = uv_now(sl->loop);
+    client->cciter = sl->connected_clients.insert(sl->connected_clients.end(), client);
 
-    if (nconnected_clients > MAX_CONNECTED_CLIENTS) {
+    if (sl->nconnected_clients > MAX_CONNECTED_CLIENTS) {
         // Close the oldest connected.
         DCERR("Calling close_connection() on first socket\n");
-        close_connection(connected_clients.front());
+        close_connection(sl->connected_clients.front());
     }
 
     r = uv_accept(server_handle, (uv_stream_t*)&client->handle);
@@ -202,30 +294,24 @@ void on_connect(uv_stream_t* server_handle, int status) {
     uv_read_start(pstrm, on_alloc, on_read);
 }
 
-void after_write(uv_write_t* req, int status) {
-    client_t *client = (client_t*)(req->handle->data);
+// Resume parsing (& reading) requests on a connection where it was
+// paused, unless the connection is waiting for a deferred response or
+// to be closed.
+static void resume_parsing(client_t *client) {
     uv_stream_t *pstrm = (uv_stream_t*)(&client->handle);
-
-    if (status != 0 || !http_should_keep_alive(&client->parser)) {
-        uv_err_t err = uv_last_error(uv_loop);
-        UVERR(err, "write");
-        close_connection(client);
+    if (client->parser.http_errno != HPE_PAUSED || client->deferred ||
+        client->close_after_write || uv_is_closing((uv_handle_t*)pstrm)) {
         return;
     }
-
-    // Free up all the buffers passed to uv_write().
-    client->resstrs.clear();
-    client->url.clear();
-
-    // Resume parsing.
     http_parser_pause(&client->parser, 0);
 
     while (client->parser.http_errno != HPE_PAUSED &&
-           !client->unparsed_data.empty()) {
+           !client->unparsed_data.empty() &&
+           !uv_is_closing((uv_handle_t*)pstrm)) {
         assert(client->unparsed_data.size() == 1);
         bool consumed_all = on_resume_read(client, client->unparsed_data.front());
         if (consumed_all) {
-            free(client->unparsed_data[0].base);
+            client->loop->read_buffer_pool.put(client->unparsed_data[0].base);
             client->unparsed_data[0].base = NULL;
             client->unparsed_data.erase(client->unparsed_data.begin());
         }
@@ -233,53 +319,168 @@ void after_write(uv_write_t* req, int status) {
 
     assert(client->unparsed_data.size() <= 1);
 
-    if (client->unparsed_data.empty()) {
+    if (client->parser.http_errno != HPE_PAUSED && !uv_is_closing((uv_handle_t*)pstrm)) {
         // Resume reading.
         uv_read_start(pstrm, on_alloc, on_read);
     }
 }
 
-void parse_query_string(std::string &qstr, query_strings_t &query) {
-    std::string key, value;
-    bool parsing_key = true;
-    for (size_t i = 0; i < qstr.size(); ++i) {
-        char ch = qstr[i];
-        if (ch == '&') {
-            query[key].swap(value);
-            key.clear();
-            value.clear();
-            parsing_key = true;
-        } else if (ch == '=') {
-            parsing_key = false;
+void after_write(uv_write_t* req, int status) {
+    client_t *client = (client_t*)(req->handle->data);
+    uv_stream_t *pstrm = (uv_stream_t*)(&client->handle);
+
+    write_latency.record(read_ticks() - client->write_started_at);
+
+    // Release the buffers passed to uv_write().
+    client->in_flight.clear();
+
+    if (uv_is_closing((uv_handle_t*)pstrm)) {
+        // The write was cancelled since the connection was closed.
+        return;
+    }
+
+    if (status != 0) {
+        UVERR(status, "write");
+        close_connection(client);
+        return;
+    }
+
+    if (client->close_after_write) {
+        // Nothing more is parsed once a request asks for the
+        // connection to be closed, so close it once the response to
+        // that request has been written.
+        if (client->response.fragments.empty()) {
+            close_connection(client);
         } else {
-            if (parsing_key) {
-                key += ch;
-            } else {
-                value += ch;
-            }
+            flush_responses(client);
+        }
+        return;
+    }
+
+    // Parsing may have been paused since too much of the response
+    // was pending.
+    resume_parsing(client);
+    flush_responses(client);
+}
+
+static void on_work(uv_work_t *req) {
+    client_t *client = (client_t*)req->data;
+    client->work_cb(client->work_data);
+}
+
+static void on_work_done(uv_work_t *req, int status) {
+    client_t *client = (client_t*)req->data;
+    client->deferred = false;
+
+    // If the connection was closed meanwhile, the response just goes
+    // nowhere.
+    client->work_done_cb(client, client->work_data);
+
+    if (uv_is_closing((uv_handle_t*)&client->handle)) {
+        if (!client->handle.data) {
+            // on_close() has been called & left the client to us.
+            client->loop->client_pool.destroy(client);
         }
+        return;
     }
-    if (!key.empty()) {
-        query[key].swap(value);
+    resume_parsing(client);
+    flush_responses(client);
+}
+
+void defer_response(client_t *client, work_cb_t work, work_done_cb_t work_done, void *data) {
+    assert(!client->deferred);
+    client->deferred = true;
+    client->work_cb = work;
+    client->work_done_cb = work_done;
+    client->work_data = data;
+    client->work_req.data = client;
+    int r = uv_queue_work(client->loop->loop, &client->work_req, on_work, on_work_done);
+    CHECK(r, "queue_work");
+}
+
+#define BOUNDED_RETURN(CH,LB,UB,OFFSET) if (ch >= LB && CH <= UB) { return CH - LB + OFFSET; }
+
+static inline int
+hex2dec(unsigned char ch) {
+    BOUNDED_RETURN(ch, '0', '9', 0);
+    BOUNDED_RETURN(ch, 'A', 'F', 10);
+    BOUNDED_RETURN(ch, 'a', 'f', 10);
+    return 0;
+}
+
+#undef BOUNDED_RETURN
+
+// Split 'qstr' into key=value parameters (appended to uout.params),
+// percent-decoding the keys & values to 'out' in the same pass. 'out'
+// must have room for 'len' bytes. Returns the end of the output.
+char* parse_query_string(const char *qstr, size_t len, parsed_url_t &uout, char *out) {
+    char *key = out;     // Where the current key starts
+    char *value = NULL;  // Where the current value starts (NULL while parsing the key)
+
+    for (size_t i = 0; i <= len; ++i) {
+        if (i == len || qstr[i] == '&') {
+            char *key_end = value ? value : out;
+            if (key_end != key) {
+                if (uout.nparams < parsed_url_t::MAX_QUERY_PARAMS) {
+                    query_param_t &param = uout.params[uout.nparams++];
+                    param.key.assign(key, key_end - key);
+                    param.value.assign(key_end, out - key_end);
+                } else {
+                    uout.truncated = true;
+                }
+            }
+            key = out;
+            value = NULL;
+        } else if (qstr[i] == '=' && !value) {
+            value = out;
+        } else if (qstr[i] == '%' && i + 2 < len) {
+            *out++ = hex2dec(qstr[i + 1]) * 16 + hex2dec(qstr[i + 2]);
+            i += 2;
+        } else {
+            *out++ = qstr[i];
+        }
     }
+    return out;
 }
 
-void parse_URL(std::string const &url_str, parsed_url_t &uout) {
+void parse_URL(std::string const &url_str, std::string const &body,
+               parsed_url_t &uout, std::string &scratch) {
     struct http_parser_url url;
     http_parser_parse_url(url_str.c_str(), url_str.size(), 0, &url);
 
+    uout.path.assign("", 0);
+    uout.nparams = 0;
+    uout.truncated = false;
+
     if (url.field_set & (1<<UF_PATH)) {
         int foff = url.field_data[UF_PATH].off;
         int flen = url.field_data[UF_PATH].len;
         uout.path.assign(url_str.c_str() + foff, flen);
     }
 
+    const char *qstr = "";
+    size_t qlen = 0;
     if (url.field_set & (1<<UF_QUERY)) {
-        int foff = url.field_data[UF_QUERY].off;
-        int flen = url.field_data[UF_QUERY].len;
-        std::string qstr(url_str.c_str() + foff, flen);
-        parse_query_string(qstr, uout.query);
+        qstr = url_str.c_str() + url.field_data[UF_QUERY].off;
+        qlen = url.field_data[UF_QUERY].len;
     }
+    if (!qlen && body.empty()) {
+        return;
+    }
+
+    // Decoding never makes anything longer, so this is the only time
+    // 'scratch' is resized (which would invalidate views into it).
+    scratch.resize(qlen + body.size());
+    char *out = &scratch[0];
+    out = parse_query_string(qstr, qlen, uout, out);
+    parse_query_string(body.data(), body.size(), uout, out);
+}
+
+int on_message_begin(http_parser *parser) {
+    client_t* client = (client_t*) parser->data;
+    client->request_started_at = uv_now(client->loop->loop);
+    client->headers_done_at = 0;
+    return HTTP_PARSER_CONTINUE_PARSING;
 }
 
 int on_url(http_parser *parser, const char *data, size_t len) {
@@ -296,29 +497,155 @@ int on_url(http_parser *parser, const char *data, size_t len) {
     return HTTP_PARSER_CONTINUE_PARSING;
 }
 
-int on_message_complete(http_parser* parser) {
+// The member of 'client' to store the value of the header 'name' in,
+// or NULL if the header isn't needed.
+static std::string* header_destination(client_t *client, std::string const &name) {
+    if (!strcasecmp(name.c_str(), "Accept")) {
+        return &client->accept;
+    }
+    if (!strcasecmp(name.c_str(), "Accept-Encoding")) {
+        return &client->accept_encoding;
+    }
+    return NULL;
+}
+
+int on_header_field(http_parser *parser, const char *data, size_t len) {
     client_t* client = (client_t*) parser->data;
+    if (client->header_value) {
+        // A new header.
+        client->header_field.clear();
+        client->header_value = NULL;
+    }
+    if (client->header_field.size() < MAX_HEADER_SIZE) {
+        client->header_field.append(data, len);
+    }
+    return HTTP_PARSER_CONTINUE_PARSING;
+}
 
-    DCERR("http message parsed\n");
+int on_header_value(http_parser *parser, const char *data, size_t len) {
+    client_t* client = (client_t*) parser->data;
+    if (!client->header_value) {
+        client->header_value = header_destination(client, client->header_field);
+        if (!client->header_value) {
+            // Not needed. Keep non-NULL to find the start of the next header.
+            client->header_value = &client->header_field;
+            return HTTP_PARSER_CONTINUE_PARSING;
+        }
+    }
+    if (client->header_value != &client->header_field &&
+        client->header_value->size() < MAX_HEADER_SIZE) {
+        client->header_value->append(data, len);
+    }
+    return HTTP_PARSER_CONTINUE_PARSING;
+}
 
-    uv_stream_t *pstrm = (uv_stream_t*)(&client->handle);
+int on_headers_complete(http_parser *parser) {
+    client_t* client = (client_t*) parser->data;
+    client->headers_done_at = uv_now(client->loop->loop);
+    // Don't wait for a body that is too large to be accepted anyway.
+    // (content_length is all ones if there is no Content-Length.)
+    if (parser->content_length != (uint64_t)-1 &&
+        parser->content_length > limits.max_body_size) {
+        reject_request(client, 413, "Request Entity Too Large");
+    }
+    return HTTP_PARSER_CONTINUE_PARSING;
+}
+
+int on_body(http_parser *parser, const char *data, size_t len) {
+    client_t* client = (client_t*) parser->data;
+    if (client->body.size() + len > limits.max_body_size) {
+        // A chunked body can't be checked up-front.
+        DPRINTF("Body too long (> %d bytes)\n", limits.max_body_size);
+        reject_request(client, 413, "Request Entity Too Large");
+        return HTTP_PARSER_CONTINUE_PARSING;
+    }
+    client->body.append(data, len);
+    return HTTP_PARSER_CONTINUE_PARSING;
+}
 
-    // Stop reading (to support request pipelining in HTTP/1.1).
-    uv_read_stop(pstrm);
+int on_message_complete(http_parser* parser) {
+    client_t* client = (client_t*) parser->data;
 
-    // Pause request parsing.
-    http_parser_pause(parser, 1);
+    DCERR("http message parsed\n");
 
     // Move this connection to the back of the LRU list (front being
     // the least recently accessed connection).
-    move_to_back(connected_clients, client->cciter);
+    move_to_back(client->loop->connected_clients, client->cciter);
+    client->last_active_at = uv_now(client->loop->loop);
+    client->request_started_at = 0;
 
-    // Invoke callback.
+    // Invoke callback. Its response is appended to those of any
+    // earlier pipelined requests from the same read.
+    client->response.begin_message();
     request_callback(client);
+    client->url.clear();
+    client->body.clear();
+    client->accept.clear();
+    client->accept_encoding.clear();
+    client->header_field.clear();
+    client->header_value = NULL;
+
+    const bool keep_alive = http_should_keep_alive(parser);
+    if (!keep_alive) {
+        client->close_after_write = true;
+    }
+    if (!keep_alive || client->deferred ||
+        (client->in_flight.nmessages && client->response.size > MAX_PENDING_RESPONSE_SIZE)) {
+        // Stop reading & parsing requests. Whatever has been read but
+        // not parsed is kept in client->unparsed_data.
+        uv_read_stop((uv_stream_t*)&client->handle);
+        http_parser_pause(parser, 1);
+    }
 
     return HTTP_PARSER_CONTINUE_PARSING;
 }
 
+// When 'client' times out, given what it is doing.
+static uint64_t timeout_at(client_t *client) {
+    const uint64_t never = (uint64_t)-1;
+    if (client->deferred) {
+        // It's the server that is slow.
+        return never;
+    }
+    if (!client->request_started_at) {
+        return limits.idle_timeout ? client->last_active_at + limits.idle_timeout : never;
+    }
+    if (!client->headers_done_at) {
+        return limits.header_timeout ? client->request_started_at + limits.header_timeout : never;
+    }
+    return limits.body_timeout ? client->headers_done_at + limits.body_timeout : never;
+}
+
+// Close the connections that have timed out. The LRU list is in order
+// of last_active_at, & every timeout starts at or after it, so only
+// the clients at the front that have been inactive for at least the
+// shortest timeout need to be looked at.
+static void on_sweep(uv_timer_t *timer) {
+    server_loop_t *sl = (server_loop_t*)timer->data;
+    const uint64_t now = uv_now(sl->loop);
+    uint64_t shortest = (uint64_t)-1;
+    const uint64_t timeouts[] = { limits.idle_timeout, limits.header_timeout, limits.body_timeout };
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); ++i) {
+        if (timeouts[i] && timeouts[i] < shortest) {
+            shortest = timeouts[i];
+        }
+    }
+
+    std::list<client_t*>::iterator i = sl->connected_clients.begin();
+    while (i != sl->connected_clients.end() && now - (*i)->last_active_at >= shortest) {
+        client_t *client = *i++;
+        if (now >= timeout_at(client)) {
+            DCERR("Connection timed out\n");
+            __sync_fetch_and_add(&connections_timed_out, 1);
+            close_connection(client);
+        }
+    }
+
+    if (loop_sweep_callback) {
+        loop_sweep_callback(sl->id);
+    }
+}
+
 size_t get_max_open_fds() {
     struct rlimit rlim;
     int r = getrlimit(RLIMIT_NOFILE, &rlim);
@@ -328,32 +655,127 @@ size_t get_max_open_fds() {
     return (size_t)rlim.rlim_cur;
 }
 
-int httpserver_start(request_callback_t rcb, const char *ip, int port) {
+// Start listening for connections on 'sl'. With 'reuseport', the
+// socket is bound with SO_REUSEPORT so that other loops can bind to
+// the same address.
+static int listen_on(server_loop_t *sl, const char *ip, int port,
+                     int backlog, bool reuseport) {
+    int r = uv_tcp_init(sl->loop, &sl->server);
+    if (r != 0) {
+        return r;
+    }
+    sl->server.data = sl;
+
+    struct sockaddr_in address;
+    r = uv_ip4_addr(ip, port, &address);
+    if (r != 0) {
+        return r;
+    }
+    if (reuseport) {
+        // libuv has no way to set socket options before bind(2), so
+        // create & bind the socket ourselves and hand it over.
+        const int on = 1;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+            bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            perror("bind");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        r = uv_tcp_open(&sl->server, fd);
+    }
+    else {
+        r = uv_tcp_bind(&sl->server, (const struct sockaddr*)&address, 0);
+    }
+    if (r != 0) {
+        return r;
+    }
+    return uv_listen((uv_stream_t*)&sl->server, backlog, on_connect);
+}
+
+static void run_loop(void *arg) {
+    server_loop_t *sl = (server_loop_t*)arg;
+    if (loop_start_callback) {
+        loop_start_callback(sl->id);
+    }
+    uv_run(sl->loop, UV_RUN_DEFAULT);
+}
+
+int httpserver_start(request_callback_t rcb, const char *ip, int port,
+                     int nloops, int backlog, httpserver_limits_t const &_limits,
+                     loop_start_callback_t lscb, loop_sweep_callback_t swcb) {
     int r;
     request_callback = rcb;
+    loop_start_callback = lscb;
+    loop_sweep_callback = swcb;
+    limits = _limits;
 
+    parser_settings.on_message_begin    = on_message_begin;
     parser_settings.on_message_complete = on_message_complete;
     parser_settings.on_url              = on_url;
+    parser_settings.on_header_field     = on_header_field;
+    parser_settings.on_header_value     = on_header_value;
+    parser_settings.on_headers_complete = on_headers_complete;
+    parser_settings.on_body             = on_body;
 
-    MAX_OPEN_FDS = get_max_open_fds();
-    MAX_CONNECTED_CLIENTS = (MAX_OPEN_FDS > 10 ? MAX_OPEN_FDS - 10 : MAX_OPEN_FDS);
+    if (nloops < 1) {
+        nloops = 1;
+    }
 
-    uv_loop = uv_default_loop();
-    r = uv_tcp_init(uv_loop, &server);
-    if (r != 0) {
-        return r;
+    // The limit on open fds is per process, so split it between the
+    // loops (rounding down, so that together they stay within it).
+    MAX_OPEN_FDS = get_max_open_fds();
+    MAX_CONNECTED_CLIENTS = MAX_OPEN_FDS > 10 ? MAX_OPEN_FDS - 10 : MAX_OPEN_FDS;
+    if (limits.max_connections && limits.max_connections < MAX_CONNECTED_CLIENTS) {
+        MAX_CONNECTED_CLIENTS = limits.max_connections;
     }
+    MAX_CONNECTED_CLIENTS = std::max((size_t)1, MAX_CONNECTED_CLIENTS / (size_t)nloops);
 
-    struct sockaddr_in address = uv_ip4_addr(ip, port);
-    r = uv_tcp_bind(&server, address);
-    if (r != 0) {
-        return r;
+    for (int i = 0; i < nloops; ++i) {
+        server_loop_t *sl = new server_loop_t(READ_BUFFER_SIZE);
+        sl->id = i;
+        if (i == 0) {
+            sl->loop = uv_default_loop();
+        }
+        else {
+            sl->loop = new uv_loop_t;
+            r = uv_loop_init(sl->loop);
+            if (r != 0) {
+                return r;
+            }
+        }
+        server_loops.push_back(sl);
+
+        r = listen_on(sl, ip, port, backlog, nloops > 1);
+        if (r != 0) {
+            return r;
+        }
+
+        if (limits.idle_timeout || limits.header_timeout || limits.body_timeout) {
+            uv_timer_init(sl->loop, &sl->sweep_timer);
+            sl->sweep_timer.data = sl;
+            uv_timer_start(&sl->sweep_timer, on_sweep, SWEEP_INTERVAL, SWEEP_INTERVAL);
+        }
     }
-    uv_listen((uv_stream_t*)&server, 128, on_connect);
 
     // Ignore the SIGPIPE signal since we will handle it in-band.
     (void) signal(SIGPIPE, SIG_IGN);
 
-    uv_run(uv_loop);
+    for (int i = 1; i < nloops; ++i) {
+        r = uv_thread_create(&server_loops[i]->thread, run_loop, server_loops[i]);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    run_loop(server_loops[0]);
+
+    for (int i = 1; i < nloops; ++i) {
+        uv_thread_join(&server_loops[i]->thread);
+    }
     return 0;
 }
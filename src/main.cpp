@@ -12,6 +12,9 @@
 #include <sys/mman.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
 
 
 // Custom-includes
@@ -21,8 +24,14 @@
 #include <include/benderrmq.hpp>
 #include <include/phrase_map.hpp>
 #include <include/suggest.hpp>
+#include <include/rmq.hpp>
+#include <include/snippet_dict.hpp>
+#include <include/json_escape.hpp>
+#include <include/gzip.hpp>
+#include <include/response_cache.hpp>
 #include <include/types.hpp>
 #include <include/utils.hpp>
+#include <include/metrics.hpp>
 
 // C++-headers
 #include <string>
@@ -48,19 +57,346 @@
 
 
 
-PhraseMap pm;                   // Phrase Map (usually a sorted array of strings)
-RMQ st;                         // An instance of the RMQ Data Structure
-char *if_mmap_addr = NULL;      // Pointer to the mmapped area of the file
-off_t if_length = 0;            // The length of the input file
-volatile bool building = false; // TRUE if the structure is being built
+// An input file, mmapped so that snippets can point into it.
+struct input_file_t {
+    char *addr;
+    off_t length;
+};
+
+/* Everything that is searched to answer a query. An index is never
+ * modified once it has been built; an import builds a new one and
+ * replaces the current index with it. Responses reference the
+ * phrases & snippets of an index directly (instead of copying them),
+ * so an index is reference counted and freed only after the last
+ * response that uses it has been written out.
+ */
+struct index_t {
+    PhraseMap pm;                   // Phrase Map (usually a sorted array of strings)
+    PhraseRMQ *rmq;                 // An instance of the RMQ Data Structure (over the weights)
+    EscapedPhrases escaped;         // The phrases & snippets pre-escaped for JSON
+    SnippetDictionary snippets;     // The snippets, if interned (see --snippet-dict)
+    std::vector<input_file_t> inputs; // The mmapped input files (none once unmapped)
+    uint64_t sort_usec;             // Time taken to sort the phrases
+    unsigned long generation;       // Unique to each import (0 for an empty index)
+    int refs;                       // # of references to this index
+
+    // The PhraseMap is sized by do_import(), instead of reserving
+    // room for millions of phrases in every (possibly empty) index.
+    index_t()
+        : pm(0), rmq(NULL), sort_usec(0), generation(0), refs(1)
+    { }
+
+    ~index_t() {
+        delete this->rmq;
+        this->unmap_inputs();
+    }
+
+    void
+    unmap_inputs() {
+        for (size_t i = 0; i < this->inputs.size(); ++i) {
+            munmap(this->inputs[i].addr, this->inputs[i].length);
+        }
+        this->inputs.clear();
+    }
+
+    off_t
+    input_bytes() const {
+        off_t bytes = 0;
+        for (size_t i = 0; i < this->inputs.size(); ++i) {
+            bytes += this->inputs[i].length;
+        }
+        return bytes;
+    }
+
+    void
+    suggest(pvpi_t phrases, size_t n, time_t now, uint32_t categories, vsz_t &ret) {
+        if (this->rmq) {
+            this->rmq->suggest(this->pm, phrases, n, now, categories, ret);
+        }
+    }
+
+    size_t
+    rmq_memory_usage() const {
+        return this->rmq ? this->rmq->memory_usage() : 0;
+    }
+
+    // Fault in every page that answering a query may read (but for
+    // the phrases themselves, which are on the heap), so that the
+    // first queries answered from this index don't wait for them.
+    size_t
+    touch() const {
+        size_t sum = touch_memory(this->pm.repr) + this->escaped.touch() + this->snippets.touch();
+        if (this->rmq) {
+            sum += this->rmq->touch();
+        }
+        for (size_t i = 0; i < this->inputs.size(); ++i) {
+            sum += touch_memory(this->inputs[i].addr, this->inputs[i].length);
+        }
+        return sum;
+    }
+};
+
+// Indexes are shared by all the event loops, so the reference counts
+// are updated atomically.
+index_t*
+index_acquire(index_t *idx) {
+    __sync_fetch_and_add(&idx->refs, 1);
+    return idx;
+}
+
+void
+index_release(void *data) {
+    index_t *idx = (index_t*)data;
+    if (__sync_sub_and_fetch(&idx->refs, 1) == 0) {
+        delete idx;
+    }
+}
+
+/* A named collection of phrases (e.g. one per locale or vertical)
+ * with an index of its own, imported & replaced independently of the
+ * others. Requests pick one with the 'index' parameter, & get the
+ * "default" collection without one. Collections are never removed, so
+ * a collection_t* stays valid once it has been looked up.
+ */
+struct collection_t {
+    int id;                         // Its slot in collections[]
+    std::string name;
+    index_t *volatile current;      // The index that queries are answered from
+    volatile int building;          // 1 while an import into this collection is in progress
+
+    collection_t(int _id, std::string const &_name)
+        : id(_id), name(_name), current(new index_t), building(0)
+    { }
+};
+
+#define MAX_COLLECTIONS 256
+#define MAX_COLLECTION_NAME 64
+
+// Filled in order & never shrunk, so that readers can look up a
+// collection without taking index_lock.
+collection_t *volatile collections[MAX_COLLECTIONS] = { new collection_t(0, "default") };
+volatile int index_lock = 0;          // Guards replacing an index, taking a reference to one & adding collections
+volatile int building = 0;            // # of imports in progress (into any collection)
+unsigned long index_generations = 0;  // # of indexes built till now
 unsigned long nreq = 0;         // The total number of requests served till now
 int line_limit = -1;            // The number of lines to import from the input file
 time_t started_at;              // When was the server started
 bool opt_show_help = false;     // Was --help requested?
-const char *ac_file = NULL;     // Path to the input file
+const char *ac_file = NULL;     // Path to the input file (of the default collection)
+std::vector<std::pair<std::string, std::string> > collection_files; // Other collections to load at startup
 int port = 6767;                // The port number on which to start the HTTP server
+int nloops = 1;                 // The # of event loops (threads) serving requests
+int backlog = 128;              // The listen(2) backlog of each event loop
+size_t cache_size = 16 << 20;   // Max. size of the response cache of each event loop (bytes)
+rmq_backend_t rmq_backend = RMQ_AUTO; // The RMQ Data Structure to build on import
+scoring_t scoring;              // How phrases are ranked
+bool intern_snippets = false;   // Copy snippets into a dictionary & unmap the input file after importing it?
+bool numa_pin_loops = false;    // Pin each event loop to the CPUs of a NUMA node?
+bool warmup = false;            // Fault in all of an index before answering queries from it?
+duplicate_policy_t duplicate_policy = DUPLICATES_KEEP; // What to do with copies of a phrase in the input
+httpserver_limits_t server_limits; // Timeouts, max. body size, etc...
 const char *project_homepage_url = "https://github.com/duckduckgo/cpp-libface/";
 
+// Returns the collection called 'name', or NULL. An empty name is
+// the default collection.
+collection_t*
+find_collection(const char *name, size_t len) {
+    if (!len) {
+        return collections[0];
+    }
+    for (int i = 0; i < MAX_COLLECTIONS && collections[i]; ++i) {
+        std::string const &cname = collections[i]->name;
+        if (cname.size() == len && !memcmp(cname.data(), name, len)) {
+            return collections[i];
+        }
+    }
+    return NULL;
+}
+
+inline bool
+valid_collection_name(std::string const &name) {
+    if (name.empty() || name.size() > MAX_COLLECTION_NAME) {
+        return false;
+    }
+    for (size_t i = 0; i < name.size(); ++i) {
+        const char ch = name[i];
+        if (!isalnum(ch) && ch != '-' && ch != '_' && ch != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the collection called 'name', adding it (empty) if there
+// isn't one. Returns NULL if there is no room for another collection.
+collection_t*
+find_or_add_collection(std::string const &name) {
+    collection_t *c = find_collection(name.data(), name.size());
+    if (c) {
+        return c;
+    }
+    while (__sync_lock_test_and_set(&index_lock, 1)) {
+    }
+    int i = 0;
+    while (i < MAX_COLLECTIONS && collections[i] && collections[i]->name != name) {
+        ++i;
+    }
+    if (i < MAX_COLLECTIONS) {
+        if (!collections[i]) {
+            collection_t *added = new collection_t(i, name);
+            // Make sure that it has been constructed before readers
+            // can see it.
+            __sync_synchronize();
+            collections[i] = added;
+        }
+        c = collections[i];
+    }
+    __sync_lock_release(&index_lock);
+    return c;
+}
+
+// Returns a new reference to the current index of 'c'.
+index_t*
+current_index_acquire(collection_t *c) {
+    while (__sync_lock_test_and_set(&index_lock, 1)) {
+        // Only ever held for a few instructions.
+    }
+    index_t *idx = index_acquire(c->current);
+    __sync_lock_release(&index_lock);
+    return idx;
+}
+
+// Make 'idx' the current index of 'c' & drop the reference to the
+// previous one.
+void
+current_index_replace(collection_t *c, index_t *idx) {
+    while (__sync_lock_test_and_set(&index_lock, 1)) {
+    }
+    index_t *prev = c->current;
+    c->current = idx;
+    __sync_lock_release(&index_lock);
+    index_release(prev);
+}
+
+/* A reference to an index taken by one event loop. Requests on a loop
+ * share the loop's reference (& count their uses of it with a plain
+ * int), so that serving a request does not write to memory shared
+ * with the other loops. A loop only takes a new reference (under
+ * index_lock) when it notices that the current index of a collection
+ * has changed, i.e. once per import.
+ */
+struct local_index_t {
+    index_t *idx;
+    int refs;
+};
+
+static __thread local_index_t *local_indexes[MAX_COLLECTIONS];
+
+// Every collection served by a loop shares the loop's cache of
+// responses. Cache keys include the generation of the index, so an
+// import never serves stale responses; they just age out.
+static __thread ResponseCache *local_cache = NULL;
+
+ResponseCache*
+local_cache_get() {
+    if (!local_cache && cache_size) {
+        local_cache = new ResponseCache(cache_size);
+    }
+    return local_cache;
+}
+
+void
+local_index_release(void *data) {
+    local_index_t *li = (local_index_t*)data;
+    if (--li->refs == 0) {
+        index_release(li->idx);
+        delete li;
+    }
+}
+
+// Returns the current index of 'c', which stays valid till
+// local_index_release() is called with the returned object.
+local_index_t*
+local_index_acquire(collection_t *c) {
+    local_index_t *&local_index = local_indexes[c->id];
+    if (!local_index || local_index->idx != c->current) {
+        local_index_t *prev = local_index;
+        local_index = new local_index_t;
+        local_index->idx = current_index_acquire(c);
+        local_index->refs = 1;  // The loop's own reference
+        if (prev) {
+            local_index_release(prev);
+        }
+    }
+    ++local_index->refs;
+    return local_index;
+}
+
+// Drop the references of this loop to indexes that have been replaced,
+// so that an old index doesn't stay in memory till the loop next
+// serves a query for its collection (which may be never). Responses
+// still being written hold references of their own.
+void
+release_replaced_indexes(int) {
+    for (int i = 0; i < MAX_COLLECTIONS && collections[i]; ++i) {
+        local_index_t *&local_index = local_indexes[i];
+        if (local_index && local_index->idx != collections[i]->current) {
+            local_index_t *prev = local_index;
+            local_index = NULL;
+            local_index_release(prev);
+        }
+    }
+}
+
+enum {
+    ENDPOINT_SUGGEST       = 0,
+    ENDPOINT_IMPORT        = 1,
+    ENDPOINT_EXPORT        = 2,
+    ENDPOINT_STATS         = 3,
+    ENDPOINT_METRICS       = 4,
+    ENDPOINT_SUGGEST_BATCH = 5,
+    ENDPOINT_INVALID       = 6,
+    NUM_ENDPOINTS          = 7
+};
+
+const char *endpoint_names[NUM_ENDPOINTS] = {
+    "suggest", "import", "export", "stats", "metrics", "suggest_batch", "invalid"
+};
+
+unsigned long nreq_by_endpoint[NUM_ENDPOINTS];  // # of requests served, by endpoint
+unsigned long ncache_hits = 0;                  // # of /face/suggest/ requests answered from a response cache
+unsigned long ncache_misses = 0;                // # of /face/suggest/ requests that had to be rendered
+unsigned long ngzipped = 0;                     // # of responses sent gzip'd
+LatencyHistogram suggest_latency;               // Time spent serving /face/suggest/ requests
+LatencyHistogram suggest_batch_latency;         // Time spent serving /face/suggest_batch/ requests
+
+// Time spent in each stage of serving a /face/suggest/ request.
+LatencyHistogram parse_latency;      // URL & query string parsing
+LatencyHistogram phrase_map_latency; // PhraseMap::query()
+LatencyHistogram rmq_latency;        // Top-k expansion using the RMQ in suggest()
+LatencyHistogram render_latency;     // Rendering the JSON & response headers
+
+struct suggest_stage_t {
+    const char *name;
+    LatencyHistogram *latency;
+};
+
+suggest_stage_t suggest_stages[] = {
+    { "parse",      &parse_latency },
+    { "phrase_map", &phrase_map_latency },
+    { "rmq",        &rmq_latency },
+    { "render",     &render_latency },
+    { "write",      &write_latency }    // Measured by the HTTP server
+};
+
+const int NUM_SUGGEST_STAGES = sizeof(suggest_stages) / sizeof(suggest_stages[0]);
+unsigned long nimports = 0;                     // # of successful imports
+// Imports into different collections run concurrently (on libuv's
+// thread pool), so these are only accessed with __sync builtins.
+uint64_t last_import_usec = 0;                  // Duration of the last successful import
+uint64_t last_warmup_usec = 0;                  // Duration of its warmup (see --warmup)
+size_t warmup_checksum = 0;                     // Keeps the reads of a warmup from being optimized away
+
 enum {
     // We are in a non-WS state
     ILP_BEFORE_NON_WS  = 0,
@@ -96,26 +432,30 @@ enum { IMPORT_FILE_NOT_FOUND = 1,
 struct InputLineParser {
     int state;            // Current parsing state
     const char *mem_base; // Base address of the mmapped file
+    size_t mem_length;    // Length of the mmapped file
     const char *buff;     // A pointer to the current line to be parsed
     size_t buff_offset;   // Offset of 'buff' [above] relative to the beginning of the file. Used to index into mem_base
-    int *pn;              // A pointer to any integral field being parsed
+    weight_t *pn;         // A pointer to any integral field being parsed
     std::string *pphrase; // A pointer to a string field being parsed
+    features_t *pfeatures; // A pointer to the features (if any) after the weight
 
     // The input file is mmap()ped in the process' address space.
 
     StringProxy *psnippet_proxy; // The psnippet_proxy is a pointer to a Proxy String object that points to memory in the mmapped region
 
-    InputLineParser(const char *_mem_base, size_t _bo, 
-                    const char *_buff, int *_pn, 
-                    std::string *_pphrase, StringProxy *_psp)
-        : state(ILP_BEFORE_NON_WS), mem_base(_mem_base), buff(_buff), 
-          buff_offset(_bo), pn(_pn), pphrase(_pphrase), psnippet_proxy(_psp)
+    InputLineParser(const char *_mem_base, size_t _ml, size_t _bo, 
+                    const char *_buff, weight_t *_pn, 
+                    std::string *_pphrase, StringProxy *_psp,
+                    features_t *_pf = NULL)
+        : state(ILP_BEFORE_NON_WS), mem_base(_mem_base), mem_length(_ml), buff(_buff), 
+          buff_offset(_bo), pn(_pn), pphrase(_pphrase), pfeatures(_pf),
+          psnippet_proxy(_psp)
     { }
 
     void
     start_parsing() {
         int i = 0;                  // The current record byte-offset.
-        int n = 0;                  // Temporary buffer for numeric (integer) fields.
+        weight_t n = 0;             // Temporary buffer for numeric (integer) fields.
         const char *p_start = NULL; // Beginning of the phrase.
         const char *s_start = NULL; // Beginning of the snippet.
         int p_len = 0;              // Phrase Length.
@@ -144,6 +484,9 @@ struct InputLineParser {
                 else {
                     this->state = ILP_BEFORE_PTAB;
                     on_weight(n);
+                    if (ch == ',') {
+                        i += on_features(this->buff + i);
+                    }
                 }
                 break;
 
@@ -193,10 +536,34 @@ struct InputLineParser {
     }
 
     void
-    on_weight(int n) {
+    on_weight(weight_t n) {
         *(this->pn) = n;
     }
 
+    // The weight may be followed by ",timestamp[,ctr[,categories]]",
+    // where categories is a bitmask (e.g. 0x5 for categories 0 & 2).
+    // Returns the # of bytes parsed at 'data' (which points at the
+    // first ',').
+    int
+    on_features(const char *data) {
+        char *end = NULL;
+        features_t f;
+        f.timestamp = strtoul(data + 1, &end, 10);
+        if (*end == ',') {
+            f.ctr = strtod(end + 1, &end);
+            if (!(f.ctr >= 0)) {
+                f.ctr = 0;
+            }
+            if (*end == ',') {
+                f.categories = strtoul(end + 1, &end, 0);
+            }
+        }
+        if (this->pfeatures) {
+            *(this->pfeatures) = f;
+        }
+        return end - data;
+    }
+
     void
     on_phrase(const char *data, int len) {
         if (len && this->pphrase) {
@@ -210,11 +577,12 @@ struct InputLineParser {
         if (len && this->psnippet_proxy) {
             const char *base = this->mem_base + this->buff_offset + 
                 (data - this->buff);
-            if (base < if_mmap_addr || base + len > if_mmap_addr + if_length) {
-                fprintf(stderr, "base: %p, if_mmap_addr: %p, if_mmap_addr+if_length: %p\n", base, if_mmap_addr, if_mmap_addr + if_length);
-                assert(base >= if_mmap_addr);
-                assert(base <= if_mmap_addr + if_length);
-                assert(base + len <= if_mmap_addr + if_length);
+            const char *mem_end = this->mem_base + this->mem_length;
+            if (base < this->mem_base || base + len > mem_end) {
+                fprintf(stderr, "base: %p, mem_base: %p, mem_base+mem_length: %p\n", base, this->mem_base, mem_end);
+                assert(base >= this->mem_base);
+                assert(base <= mem_end);
+                assert(base + len <= mem_end);
             }
             DCERR("on_snippet::base: "<<(void*)base<<", len: "<<len<<"\n");
             this->psnippet_proxy->assign(base, len);
@@ -224,37 +592,14 @@ struct InputLineParser {
 };
 
 
+// The size of the open file 'fd', or -1 (with errno set) on error.
 off_t
-file_size(const char *path) {
+file_size(int fd) {
     struct stat sbuf;
-    int r = stat(path, &sbuf);
-
-    assert(r == 0);
-    if (r < 0) {
-        return 0;
-    }
-
-    return sbuf.st_size;
-}
-
-// TODO: Fix for > 2GiB memory usage by using uint64_t
-int
-get_memory_usage(pid_t pid) {
-    char cbuff[4096];
-    sprintf(cbuff, "pmap -x %d | tail -n +3 | awk 'BEGIN { S=0;T=0 } { if (match($3, /\\-/)) {S=1} if (S==0) {T+=$3} } END { print T }'", pid);
-    FILE *pf = popen(cbuff, "r");
-    if (!pf) {
+    if (fstat(fd, &sbuf) < 0) {
         return -1;
     }
-    int r = fread(cbuff, 1, 100, pf);
-    if (r < 0) {
-        fclose(pf);
-        return -1;
-    }
-    cbuff[r-1] = '\0';
-    r = atoi(cbuff);
-    fclose(pf);
-    return r;
+    return sbuf.st_size;
 }
 
 char
@@ -269,49 +614,9 @@ str_lowercase(std::string &str) {
 
 }
 
-#define BOUNDED_RETURN(CH,LB,UB,OFFSET) if (ch >= LB && CH <= UB) { return CH - LB + OFFSET; }
-
-inline int
-hex2dec(unsigned char ch) {
-    BOUNDED_RETURN(ch, '0', '9', 0);
-    BOUNDED_RETURN(ch, 'A', 'F', 10);
-    BOUNDED_RETURN(ch, 'a', 'f', 10);
-    return 0;
-}
-
-#undef BOUNDED_RETURN
-
-std::string
-unescape_query(std::string const &query) {
-    enum {
-        QP_DEFAULT = 0,
-        QP_ESCAPED1 = 1,
-        QP_ESCAPED2 = 2
-    };
-    std::string ret;
-    unsigned char echar = 0;
-    int state = QP_DEFAULT;
-    for (size_t i = 0; i < query.size(); ++i) {
-        switch (state) {
-        case QP_DEFAULT:
-            if (query[i] != '%') {
-                ret += query[i];
-            } else {
-                state = QP_ESCAPED1;
-                echar = 0;
-            }
-            break;
-        case QP_ESCAPED1:
-        case QP_ESCAPED2:
-            echar *= 16;
-            echar += hex2dec(query[i]);
-            if (state == QP_ESCAPED2) {
-                ret += echar;
-            }
-            state = (state + 1) % 3;
-        }
-    }
-    return ret;
+inline void
+str_lowercase(char *str, size_t len) {
+    std::transform(str, str + len, str, to_lowercase);
 }
 
 inline std::string
@@ -333,74 +638,131 @@ uint_to_string(uint_t n, uint_t pad = 0) {
     return ret;
 }
 
-void
-escape_special_chars(std::string& str) {
-    std::string ret;
-    ret.reserve(str.size() + 10);
-    for (size_t j = 0; j < str.size(); ++j) {
-        switch (str[j]) {
-        case '"':
-            ret += "\\\"";
-            break;
-
-        case '\\':
-            ret += "\\\\";
-            break;
-
-        case '\n':
-            ret += "\\n";
-            break;
-
-        case '\t':
-            ret += "\\t";
-            break;
-
-        default:
-            ret += str[j];
+// The number at the start of 'str' (like atoi(3), but saturating
+// instead of overflowing).
+inline uint_t
+parse_uint(StringProxy str) {
+    uint_t n = 0;
+    for (size_t i = 0; i < str.size() && isdigit(str.mem_base[i]); ++i) {
+        const uint_t next = n * 10 + (str.mem_base[i] - '0');
+        if (next / 10 != n) {
+            return minus_one;
         }
+        n = next;
     }
-    ret.swap(str);
+    return n;
 }
 
-std::string
-rich_suggestions_json_array(vp_t& suggestions) {
-    std::string ret = "[";
-    ret.reserve(OUTPUT_SIZE_RESERVE);
-    for (vp_t::iterator i = suggestions.begin(); i != suggestions.end(); ++i) {
-        escape_special_chars(i->phrase);
-        std::string snippet = i->snippet;
-        escape_special_chars(snippet);
-
-        std::string trailer = i + 1 == suggestions.end() ? "\n" : ",\n";
-        ret += " { \"phrase\": \"" + i->phrase + "\", \"score\": " + uint_to_string(i->weight) + 
-            (snippet.empty() ? "" : ", \"snippet\": \"" + snippet + "\"") + " }" + trailer;
-    }
-    ret += "]";
-    return ret;
+// Parse a bitmask of categories in decimal, hex ("0x5", as written by
+// /export) or octal, as in the input file (see on_features()). An
+// empty 'str' is no categories, i.e. any phrase. Returns false if
+// 'str' isn't a (32-bit) number.
+inline bool
+parse_categories(StringProxy str, uint32_t &categories) {
+    char buff[32];
+    categories = 0;
+    if (!str.size()) {
+        return true;
+    }
+    if (str.size() >= sizeof(buff) || !isdigit(str.mem_base[0])) {
+        return false;
+    }
+    memcpy(buff, str.mem_base, str.size());
+    buff[str.size()] = '\0';
+    char *end = NULL;
+    errno = 0;
+    const unsigned long long mask = strtoull(buff, &end, 0);
+    if (errno || *end || mask > 0xffffffffULL) {
+        return false;
+    }
+    categories = mask;
+    return true;
 }
 
-std::string
-suggestions_json_array(vp_t& suggestions) {
-    std::string ret = "[";
-    ret.reserve(OUTPUT_SIZE_RESERVE);
-    for (vp_t::iterator i = suggestions.begin(); i != suggestions.end(); ++i) {
-        escape_special_chars(i->phrase);
+// The phrases & snippets are referenced in the index's pre-escaped
+// arena, so the index must outlive the response.
+void
+rich_suggestions_json_array(index_t const &idx, vsz_t const& suggestions, response_t &response) {
+    char score[32];
+    response.append("[");
+    for (size_t i = 0; i < suggestions.size(); ++i) {
+        const size_t pi = suggestions[i];
+        StringProxy phrase = idx.escaped.phrase(pi);
+        StringProxy snippet = idx.escaped.snippet(pi);
+        response.append(" { \"phrase\": \"");
+        response.append_ref(phrase.mem_base, phrase.size());
+        response.append_copy(score, sprintf(score, "\", \"score\": %llu",
+                                                     (unsigned long long)idx.pm.repr[pi].weight));
+        if (snippet.size()) {
+            response.append(", \"snippet\": \"");
+            response.append_ref(snippet.mem_base, snippet.size());
+            response.append("\"");
+        }
+        response.append(i + 1 == suggestions.size() ? " }\n" : " },\n");
+    }
+    response.append("]");
+}
 
-        std::string trailer = i + 1 == suggestions.end() ? "\n" : ",\n";
-        ret += "\"" + i->phrase + "\"" + trailer;
+void
+suggestions_json_array(index_t const &idx, vsz_t const& suggestions, response_t &response) {
+    response.append("[");
+    for (size_t i = 0; i < suggestions.size(); ++i) {
+        StringProxy phrase = idx.escaped.phrase(suggestions[i]);
+        response.append("\"");
+        response.append_ref(phrase.mem_base, phrase.size());
+        response.append(i + 1 == suggestions.size() ? "\"\n" : "\",\n");
     }
-    ret += "]";
-    return ret;
+    response.append("]");
 }
 
-std::string
-results_json(std::string q, vp_t& suggestions, std::string const& type) {
-    if (type == "list") {
-        escape_special_chars(q);
-        return "[ \"" + q + "\", " + suggestions_json_array(suggestions) + " ]";
+void
+results_json(StringProxy q, index_t const &idx, vsz_t const& suggestions,
+             StringProxy type, response_t &response) {
+    if (type.equals("list")) {
+        response.append("[ \"");
+        const size_t qlen = json_escaped_size(q.mem_base, q.size());
+        if (qlen) {
+            escape_json(q.mem_base, q.size(), response.extend(qlen));
+        }
+        response.append("\", ");
+        suggestions_json_array(idx, suggestions, response);
+        response.append(" ]");
     }
     else {
-        return rich_suggestions_json_array(suggestions);
+        rich_suggestions_json_array(idx, suggestions, response);
+    }
+}
+
+// Append 'n' to 'response' as 4 little-endian bytes.
+inline void
+append_uint32(response_t &response, uint32_t n) {
+    char buff[4] = { (char)(n & 0xff), (char)((n >> 8) & 0xff),
+                     (char)((n >> 16) & 0xff), (char)((n >> 24) & 0xff) };
+    response.append_copy(buff, sizeof(buff));
+}
+
+/* The binary response format (type=bin, or an Accept header asking
+ * for BINARY_CONTENT_TYPE) for clients that would rather not parse
+ * JSON. All integers are 32-bit little-endian (weights that do not
+ * fit are sent as 0xffffffff):
+ *
+ *   count, followed by 'count' records of
+ *   weight, phrase length, phrase bytes, snippet length, snippet bytes
+ *
+ * Phrases & snippets are sent as stored in the index: unescaped &
+ * not NUL-terminated. /face/suggest_batch/ prefixes one such list
+ * per 'q' with the # of lists.
+ */
+void
+results_binary(index_t const &idx, vsz_t const& suggestions, response_t &response) {
+    append_uint32(response, suggestions.size());
+    for (size_t i = 0; i < suggestions.size(); ++i) {
+        phrase_t const &p = idx.pm.repr[suggestions[i]];
+        append_uint32(response, std::min(p.weight, (weight_t)minus_one));
+        append_uint32(response, p.phrase.size());
+        response.append_ref(p.phrase.data(), p.phrase.size());
+        append_uint32(response, p.snippet.size());
+        response.append_ref(p.snippet.mem_base, p.snippet.size());
     }
 }
 
@@ -475,140 +837,306 @@ void get_line(std::ifstream fin, char *buff, int buff_len, int &read_len) {
 }
 
 
+// Split a list of input files, as "PATH,PATH,...".
+void
+split_file_list(std::string const &list, vs_t &files) {
+    size_t first = 0;
+    while (first <= list.size()) {
+        size_t comma = list.find(',', first);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        if (comma > first) {
+            files.push_back(list.substr(first, comma - first));
+        }
+        first = comma + 1;
+    }
+}
+
+// mmap() the input file 'file' into 'idx' (see --prefault). Returns 0
+// or an IMPORT_* error.
+int
+mmap_input(index_t *idx, std::string const &file) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return IMPORT_FILE_NOT_FOUND;
+    }
+
+    // Size the file we opened, not whatever is at its path by now.
+    const off_t size = file_size(fd);
+    if (size < 0) {
+        perror("fstat");
+        close(fd);
+        return IMPORT_MMAP_FAILED;
+    }
+
+    input_file_t input;
+    input.length = size;
+    input.addr = (char*)map_input_file(fd, input.length);
+    close(fd);
+    if (input.addr == MAP_FAILED) {
+        const int err = errno;
+        fprintf(stderr, "file: %s, length: %llu\n", file.c_str(), (unsigned long long)input.length);
+        errno = err;
+        perror("mmap");
+        return IMPORT_MMAP_FAILED;
+    }
+    idx->inputs.push_back(input);
+    return 0;
+}
+
+// Add (up to 'limit' of) the phrases in 'file', mmapped as 'input',
+// to 'pm'. Returns 0 or an IMPORT_* error.
 int
-do_import(std::string file, uint_t limit, 
-          int &rnadded, int &rnlines) {
-    bool is_input_sorted = true;
+read_input(PhraseMap &pm, std::string const &file, input_file_t const &input,
+           size_t &limit, size_t &nlines) {
 #if defined USE_CXX_IO
     std::ifstream fin(file.c_str());
 #else
     FILE *fin = fopen(file.c_str(), "r");
 #endif
 
-    int fd = open(file.c_str(), O_RDONLY);
-
-    DCERR("handle_import::file:" << file << "[fin: " << (!!fin) << ", fd: " << fd << "]" << endl);
+    DCERR("handle_import::file:" << file << "[fin: " << (!!fin) << "]" << endl);
 
-    if (!fin || fd == -1) {
+    if (!fin) {
         perror("fopen");
-        return -IMPORT_FILE_NOT_FOUND;
+        return IMPORT_FILE_NOT_FOUND;
     }
-    else {
-        building = true;
-        int nlines = 0;
-        int foffset = 0;
-
-        if (if_mmap_addr) {
-            int r = munmap(if_mmap_addr, if_length);
-            if (r < 0) {
-                perror("munmap");
-                building = false;
-                return -IMPORT_MUNMAP_FAILED;
-            }
+
+    char buff[INPUT_LINE_SIZE];
+    off_t foffset = 0;
+
+    while (limit && !is_EOF(fin)) {
+        buff[0] = '\0';
+
+        int llen = -1;
+        get_line(fin, buff, INPUT_LINE_SIZE, llen);
+        if (llen == -1) {
+            break;
         }
 
-        // Potential race condition + not checking for return value
-        if_length = file_size(file.c_str());
+        --limit;
+        ++nlines;
+
+        weight_t weight = 0;
+        std::string phrase;
+        StringProxy snippet;
+        features_t features;
+        InputLineParser(input.addr, input.length, foffset, buff,
+                        &weight, &phrase, &snippet, &features).start_parsing();
 
-        // mmap() the input file in
-        if_mmap_addr = (char*)mmap(NULL, if_length, PROT_READ, MAP_SHARED, fd, 0);
-        if (if_mmap_addr == MAP_FAILED) {
-            fprintf(stderr, "length: %llu, fd: %d\n", if_length, fd);
-            perror("mmap");
-            if (fin) { fclose(fin); }
-            if (fd != -1) { close(fd); }
-            building = false;
-            return -IMPORT_MMAP_FAILED;
+        foffset += llen;
+
+        if (!phrase.empty()) {
+            str_lowercase(phrase);
+            DCERR("Adding: " << weight << ", " << phrase << ", " << std::string(snippet) << endl);
+            pm.insert(weight, phrase, snippet, features);
         }
+    }
 
-        pm.repr.clear();
-        char buff[INPUT_LINE_SIZE];
-        std::string prev_phrase;
+    fclose(fin);
+    return 0;
+}
 
-        while (!is_EOF(fin) && limit--) {
-            buff[0] = '\0';
+// Claim 'coll' for an import. Imports into a collection are
+// serialized, so that two of them never hold two new indexes in
+// memory at once, & the last one to be requested is the one that
+// ends up being served. Returns false if an import into 'coll' is
+// already in progress.
+inline bool
+claim_collection(collection_t *coll) {
+    return __sync_bool_compare_and_swap(&coll->building, 0, 1);
+}
 
-            int llen = -1;
-            get_line(fin, buff, INPUT_LINE_SIZE, llen);
-            if (llen == -1) {
-                break;
-            }
+inline void
+release_collection(collection_t *coll) {
+    __sync_lock_release(&coll->building);
+}
+
+// 'file' may be a list of files (see split_file_list()), imported
+// into one index. Sorted files, e.g. the shards of a sorted input,
+// are merged instead of being sorted again (see PhraseMap::finalize()).
+// The caller must have claimed 'coll' (see claim_collection()).
+int
+do_import(collection_t *coll, std::string file, size_t limit,
+          size_t &rnadded, size_t &rnlines) {
+    vs_t files;
+    split_file_list(file, files);
+    if (files.empty()) {
+        return -IMPORT_FILE_NOT_FOUND;
+    }
 
-            ++nlines;
+    __sync_fetch_and_add(&building, 1);
+    const uint64_t start_usec = monotonic_usec();
+    size_t nlines = 0;
 
-            int weight = 0;
-            std::string phrase;
-            StringProxy snippet;
-            InputLineParser(if_mmap_addr, foffset, buff, &weight, &phrase, &snippet).start_parsing();
+    // Build a new index. The current one keeps answering queries
+    // (and backing responses being written) till we are done.
+    index_t *idx = new index_t;
+    PhraseMap &pm = idx->pm;
 
-            foffset += llen;
+    int ret = 0;
+    for (size_t i = 0; i < files.size() && !ret; ++i) {
+        ret = mmap_input(idx, files[i]);
+    }
 
-            if (!phrase.empty()) {
-                str_lowercase(phrase);
-                DCERR("Adding: " << weight << ", " << phrase << ", " << std::string(snippet) << endl);
-                pm.insert(weight, phrase, snippet);
-            }
-            if (is_input_sorted && prev_phrase <= phrase) {
-                prev_phrase.swap(phrase);
-            } else if (is_input_sorted) {
-                is_input_sorted = false;
+    if (!ret) {
+        // Reserve room for a phrase per line.
+        size_t nreserve = 0;
+        for (size_t i = 0; i < idx->inputs.size(); ++i) {
+            const char *end = idx->inputs[i].addr + idx->inputs[i].length;
+            for (const char *p = idx->inputs[i].addr; p < end && nreserve < limit; ++nreserve) {
+                const char *nl = (const char*)memchr(p, '\n', end - p);
+                p = nl ? nl + 1 : end;
             }
         }
+        pm.repr.reserve(nreserve);
+    }
 
-        DCERR("Creating PhraseMap::Input is " << (!is_input_sorted ? "NOT " : "") << "sorted\n");
+    for (size_t i = 0; i < files.size() && !ret; ++i) {
+        ret = read_input(pm, files[i], idx->inputs[i], limit, nlines);
+    }
 
-        fclose(fin);
-        pm.finalize(is_input_sorted);
-        vui_t weights;
-        for (size_t i = 0; i < pm.repr.size(); ++i) {
-            weights.push_back(pm.repr[i].weight);
-        }
-        st.initialize(weights);
+    if (ret) {
+        delete idx;
+        __sync_fetch_and_sub(&building, 1);
+        return -ret;
+    }
 
-        rnadded = weights.size();
-        rnlines = nlines;
+    const uint64_t sort_start_usec = monotonic_usec();
+    pm.finalize(0, duplicate_policy);
+    idx->sort_usec = monotonic_usec() - sort_start_usec;
+    DCERR("Creating PhraseMap::Input is in " << pm.sorted_runs << " sorted run(s)\n");
 
-        building = false;
+    if (intern_snippets) {
+        // Nothing references the input files after this.
+        idx->snippets.intern(pm);
+        idx->unmap_inputs();
+    }
+    idx->rmq = make_phrase_rmq(pm, rmq_backend, scoring);
+    idx->escaped.initialize(pm, intern_snippets ? &idx->snippets : NULL);
+    idx->generation = __sync_add_and_fetch(&index_generations, 1);
+    if (warmup) {
+        const uint64_t warmup_start_usec = monotonic_usec();
+        __sync_fetch_and_add(&warmup_checksum, idx->touch());
+        __sync_lock_test_and_set(&last_warmup_usec, monotonic_usec() - warmup_start_usec);
     }
 
+    rnadded = pm.repr.size();
+    rnlines = nlines;
+
+    current_index_replace(coll, idx);
+
+    __sync_fetch_and_add(&nimports, 1);
+    __sync_lock_test_and_set(&last_import_usec, monotonic_usec() - start_usec);
+
+    __sync_fetch_and_sub(&building, 1);
+
     return 0;
 }
 
-static void handle_import(client_t *client, parsed_url_t &url) {
+/* Requests that may block (on disk I/O, or for long) are answered
+ * from libuv's thread pool with defer_response(), so that an import
+ * doesn't hold up the queries served by the same event loop. A job
+ * gets copies of the request parameters it needs, since the parsed
+ * URL doesn't outlive serve_request().
+ */
+struct job_t {
+    void (*handler)(job_t*);    // Runs on the thread pool
+    std::string index;          // The collection to use (empty for the default one)
+    std::string file;
+    uint_t limit;
+
+    // The response, written once the handler returns.
+    int status_code;
+    const char *status_str;
+    headers_t headers;
+    std::string body;
+
+    job_t()
+        : handler(NULL), limit(0), status_code(500), status_str("Internal Server Error")
+    { }
+
+    void
+    respond(int code, const char *str, headers_t &h, std::string &b) {
+        this->status_code = code;
+        this->status_str = str;
+        this->headers.swap(h);
+        this->body.swap(b);
+    }
+};
+
+static void run_job(void *data) {
+    job_t *job = (job_t*)data;
+    job->handler(job);
+}
+
+static void finish_job(client_t *client, void *data) {
+    job_t *job = (job_t*)data;
+    write_response(client, job->status_code, job->status_str, job->headers, job->body);
+    delete job;
+}
+
+static void defer_job(client_t *client, parsed_url_t &url, void (*handler)(job_t*)) {
+    job_t *job = new job_t;
+    job->handler = handler;
+    job->index = url.query("index");
+    job->file = url.query("file");
+    job->limit = parse_uint(url.query("limit"));
+    defer_response(client, run_job, finish_job, job);
+}
+
+static void handle_import(job_t *job) {
     std::string body;
     headers_t headers;
     headers["Cache-Control"] = "no-cache";
 
-    std::string file = unescape_query(url.query["file"]);
-    uint_t limit     = atoi(url.query["limit"].c_str());
-    int nadded, nlines;
+    std::string const &file = job->file;
+    const size_t limit = job->limit ? job->limit : (size_t)-1;
+    size_t nadded, nlines;
     const time_t start_time = time(NULL);
 
-    if (!limit) {
-        limit = minus_one;
+    // Importing into a collection that doesn't exist yet adds it.
+    if (!job->index.empty() && !valid_collection_name(job->index)) {
+        body = "Invalid index name '" + job->index + "'\n";
+        job->respond(400, "Bad Request", headers, body);
+        return;
+    }
+    collection_t *coll = job->index.empty() ? collections[0] : find_or_add_collection(job->index);
+    if (!coll) {
+        body = "Too many indexes\n";
+        job->respond(507, "Insufficient Storage", headers, body);
+        return;
+    }
+    if (!claim_collection(coll)) {
+        body = "Busy\n";
+        job->respond(412, "Busy", headers, body);
+        return;
     }
 
-    int ret = do_import(file, limit, nadded, nlines);
+    int ret = do_import(coll, file, limit, nadded, nlines);
+    release_collection(coll);
     if (ret < 0) {
         switch (-ret) {
         case IMPORT_FILE_NOT_FOUND:
             body = "The file '" + file + "' was not found";
-            write_response(client, 404, "Not Found", headers, body);
+            job->respond(404, "Not Found", headers, body);
             break;
 
         case IMPORT_MUNMAP_FAILED:
             body = "munmap(2) failed";
-            write_response(client, 500, "Internal Server Error", headers, body);
+            job->respond(500, "Internal Server Error", headers, body);
             break;
 
         case IMPORT_MMAP_FAILED:
             body = "mmap(2) failed";
-            write_response(client, 500, "Internal Server Error", headers, body);
+            job->respond(500, "Internal Server Error", headers, body);
             break;
 
         default:
             body = "Unknown Error";
-            write_response(client, 500, "Internal Server Error", headers, body);
+            job->respond(500, "Internal Server Error", headers, body);
             cerr<<"ERROR::Unknown error: "<<ret<<endl;
         }
     }
@@ -618,87 +1146,345 @@ static void handle_import(client_t *client, parsed_url_t &url) {
            << "records from '" << file << "' in " << (time(NULL) - start_time)
            << "second(s)\n";
         body = os.str();
-        write_response(client, 200, "OK", headers, body);
+        job->respond(200, "OK", headers, body);
     }
 }
 
-static void handle_export(client_t *client, parsed_url_t &url) {
+static void handle_export(job_t *job) {
     std::string body;
     headers_t headers;
     headers["Cache-Control"] = "no-cache";
 
-    std::string file = url.query["file"];
-    if (building) {
+    std::string const &file = job->file;
+    collection_t *coll = find_collection(job->index.data(), job->index.size());
+    if (!coll) {
+        body = "Unknown index '" + job->index + "'\n";
+        job->respond(404, "Not Found", headers, body);
+        return;
+    }
+    if (coll->building) {
         body = "Busy\n";
-        write_response(client, 412, "Busy", headers, body);
+        job->respond(412, "Busy", headers, body);
         return;
     }
 
-    // Prevent modifications to 'pm' while we export
-    building = true;
+    // Imports replace the current index instead of modifying it, so
+    // holding a reference is enough to get a consistent snapshot.
+    index_t *idx = current_index_acquire(coll);
     ofstream fout(file.c_str());
     const time_t start_time = time(NULL);
+    PhraseMap &pm = idx->pm;
 
     for (size_t i = 0; i < pm.repr.size(); ++i) {
-        fout<<pm.repr[i].weight<<'\t'<<pm.repr[i].phrase<<'\t'<<std::string(pm.repr[i].snippet)<<'\n';
+        phrase_t const &p = pm.repr[i];
+        fout<<p.weight;
+        if (!p.features.empty()) {
+            fout<<','<<p.features.timestamp<<','<<p.features.ctr;
+            if (p.features.categories) {
+                fout<<",0x"<<std::hex<<p.features.categories<<std::dec;
+            }
+        }
+        fout<<'\t'<<p.phrase<<'\t'<<std::string(p.snippet)<<'\n';
     }
 
-    building = false;
     std::ostringstream os;
     os << "Successfully wrote " << pm.repr.size()
        << " records to output file '" << file
        << "' in " << (time(NULL) - start_time) << "second(s)\n";
+    index_release(idx);
     body = os.str();
-    write_response(client, 200, "OK", headers, body);
+    job->respond(200, "OK", headers, body);
 }
 
-static void handle_suggest(client_t *client, parsed_url_t &url) {
-    ++nreq;
-    std::string body;
+const char *BINARY_CONTENT_TYPE = "application/vnd.libface.suggestions";
+
+// Bodies smaller than this are not worth compressing.
+const size_t MIN_GZIP_SIZE = 512;
+
+headers_t
+suggest_headers(bool binary, bool gzipped) {
     headers_t headers;
     headers["Cache-Control"] = "no-cache";
+    headers["Content-Type"] = binary ? BINARY_CONTENT_TYPE : "text/plain; charset=UTF-8";
+    headers["Vary"] = "Accept, Accept-Encoding";
+    if (gzipped) {
+        headers["Content-Encoding"] = "gzip";
+    }
+    return headers;
+}
 
-    if (building) {
-        write_response(client, 412, "Busy", headers, body);
-        return;
+// Indexed by [binary][gzipped].
+const header_template_t suggest_header_templates[2][2] = {
+    { header_template_t(200, "OK", suggest_headers(false, false)),
+      header_template_t(200, "OK", suggest_headers(false, true)) },
+    { header_template_t(200, "OK", suggest_headers(true, false)),
+      header_template_t(200, "OK", suggest_headers(true, true)) }
+};
+
+// Compress the body of the response being built if the client
+// accepts gzip & the body is large enough, & add the result to
+// 'cache' (if not NULL) under 'key'. Returns whether the body is now
+// gzip'd.
+static bool
+compress_and_cache(client_t *client, ResponseCache *cache, std::string const &key) {
+    response_t &response = client->response;
+    const bool gzip = response.body_size() >= MIN_GZIP_SIZE &&
+        accepts_gzip(client->accept_encoding.data(), client->accept_encoding.size());
+    if (!gzip && !cache) {
+        return false;
     }
 
-    std::string q    = unescape_query(url.query["q"]);
-    std::string sn   = url.query["n"];
-    std::string cb   = unescape_query(url.query["callback"]);
-    std::string type = unescape_query(url.query["type"]);
+    std::string body;
+    body.reserve(response.body_size());
+    response.copy_body(body);
+    bool gzipped = false;
+    if (gzip) {
+        std::string compressed;
+        if (gzip_compress(body.data(), body.size(), compressed) &&
+            compressed.size() < body.size()) {
+            body.swap(compressed);
+            gzipped = true;
+            response.discard_body();
+            __sync_fetch_and_add(&ngzipped, 1);
+        }
+    }
+
+    ResponseCache::entry_t *e = cache ? cache->put(key, body, gzipped) : NULL;
+    if (gzipped && e) {
+        response.hold(ResponseCache::release, e);
+        response.append_ref(e->body.data(), e->body.size());
+    }
+    else if (gzipped) {
+        response.append(body);
+    }
+    else if (e) {
+        // The uncompressed body is still in the response.
+        ResponseCache::release(e);
+    }
+    return gzipped;
+}
 
-    DCERR("handle_suggest::q:"<<q<<", sn:"<<sn<<", callback: "<<cb<<endl);
+// Whether to respond using results_binary() rather than JSON.
+inline bool
+wants_binary(client_t *client, StringProxy type) {
+    return type.equals("bin") ||
+        client->accept.find(BINARY_CONTENT_TYPE) != std::string::npos;
+}
 
-    unsigned int n = sn.empty() ? NMAX : atoi(sn.c_str());
+// The # of suggestions requested by the 'n' parameter.
+inline unsigned int
+suggestion_count(StringProxy sn) {
+    unsigned int n = sn.size() == 0 ? NMAX : parse_uint(sn);
     if (n > NMAX) {
         n = NMAX;
     }
     if (n < 1) {
         n = 1;
     }
+    return n;
+}
+
+// The time to rank phrases at. Rankings that depend on the time at
+// all only change once a minute, so that they can still be cached.
+inline time_t
+ranking_time() {
+    return scoring.freshness_boost ? time(NULL) / 60 * 60 : 0;
+}
+
+static void handle_unknown_index(client_t *client, StringProxy index) {
+    headers_t headers;
+    headers["Cache-Control"] = "no-cache";
+
+    std::string body = "Unknown index '" + std::string(index) + "'\n";
+    write_response(client, 404, "Not Found", headers, body);
+}
+
+static void handle_invalid_categories(client_t *client, StringProxy categories) {
+    headers_t headers;
+    headers["Cache-Control"] = "no-cache";
+
+    std::string body = "Invalid categories '" + std::string(categories) + "'\n";
+    write_response(client, 400, "Bad Request", headers, body);
+}
+
+static void handle_too_many_prefixes(client_t *client) {
+    headers_t headers;
+    headers["Cache-Control"] = "no-cache";
+
+    std::string body = "Too many prefixes\n";
+    write_response(client, 400, "Bad Request", headers, body);
+}
+
+static void handle_suggest(client_t *client, parsed_url_t &url, StageTimer &timer) {
+    __sync_fetch_and_add(&nreq, 1);
+
+    // These are views into the connection's scratch buffer, so 'q'
+    // can be lowercased in place.
+    StringProxy q    = url.query("q");
+    StringProxy sn   = url.query("n");
+    StringProxy cb   = url.query("callback");
+    StringProxy type = url.query("type");
+    StringProxy index = url.query("index");
+    uint32_t categories;
+    if (!parse_categories(url.query("categories"), categories)) {
+        handle_invalid_categories(client, url.query("categories"));
+        return;
+    }
+
+    DCERR("handle_suggest::q:"<<std::string(q)<<", sn:"<<std::string(sn)<<", callback: "<<std::string(cb)<<endl);
+
+    collection_t *coll = find_collection(index.mem_base, index.size());
+    if (!coll) {
+        handle_unknown_index(client, index);
+        return;
+    }
 
-    const bool has_cb = !cb.empty();
-    str_lowercase(q);
-    vp_t results = suggest(pm, st, q, n);
+    const unsigned int n = suggestion_count(sn);
+    const bool has_cb = cb.size() != 0;
+    const bool binary = wants_binary(client, type);
+    const time_t now = ranking_time();
+    str_lowercase((char*)q.mem_base, q.size());
+    timer.lap(parse_latency);
+
+    // The response references phrases & snippets in the index, so
+    // keep it alive till the response has been written out.
+    local_index_t *li = local_index_acquire(coll);
+    response_t &response = client->response;
+    response.hold(local_index_release, li);
+    index_t *idx = li->idx;
+    ResponseCache *cache = local_cache_get();
+
+    // Everything that the body depends on. The generation of the
+    // index tells apart collections, & an index from its replacement.
+    std::string key;
+    if (cache) {
+        char head[64];
+        const bool gzip = accepts_gzip(client->accept_encoding.data(),
+                                       client->accept_encoding.size());
+        key.reserve(sizeof(head) + cb.size() + q.size());
+        key.append(head, sprintf(head, "%c%c%u:%u:%lu:%lu:", binary ? 'b' : type.equals("list") ? 'l' : 'j',
+                                 gzip ? 'z' : '-', n, categories, idx->generation, (unsigned long)now));
+        key.append(cb.mem_base, cb.size());
+        key += ':';
+        key.append(q.mem_base, q.size());
+
+        ResponseCache::entry_t *e = cache->get(key);
+        if (e) {
+            __sync_fetch_and_add(&ncache_hits, 1);
+            response.hold(ResponseCache::release, e);
+            response.append_ref(e->body.data(), e->body.size());
+            write_response(client, suggest_header_templates[binary][e->tag]);
+            timer.lap(render_latency);
+            timer.total(suggest_latency);
+            return;
+        }
+        __sync_fetch_and_add(&ncache_misses, 1);
+    }
+
+    pvpi_t range = idx->pm.query(q.mem_base, q.size());
+    timer.lap(phrase_map_latency);
+
+    vsz_t results;
+    results.reserve(n);
+    idx->suggest(range, n, now, categories, results);
+    timer.lap(rmq_latency);
 
-    /*
-      for (size_t i = 0; i < results.size(); ++i) {
-      mg_printf(conn, "%s:%d\n", results[i].first.c_str(), results[i].second);
-      }
-    */
-    headers["Content-Type"] = "text/plain; charset=UTF-8";
-    if (has_cb) {
-        body = cb + "(" + results_json(q, results, type) + ");\n";
+    if (binary) {
+        results_binary(*idx, results, response);
     }
     else {
-        body = results_json(q, results, type) + "\n";
+        if (has_cb) {
+            response.append_copy(cb.mem_base, cb.size());
+            response.append("(");
+        }
+        results_json(q, *idx, results, type, response);
+        response.append(has_cb ? ");\n" : "\n");
     }
 
-    write_response(client, 200, "OK", headers, body);
+    const bool gzipped = compress_and_cache(client, cache, key);
+    write_response(client, suggest_header_templates[binary][gzipped]);
+    timer.lap(render_latency);
+    timer.total(suggest_latency);
 }
 
-static void handle_stats(client_t *client, parsed_url_t &url) {
+// Suggestions for several prefixes at once: each 'q' parameter (in
+// the query string, or in a form-encoded POST body) gets what
+// /face/suggest/ would return for it, in a single JSON array.
+static void handle_suggest_batch(client_t *client, parsed_url_t &url, StageTimer &timer) {
+    StringProxy index = url.query("index");
+    collection_t *coll = find_collection(index.mem_base, index.size());
+    if (!coll) {
+        handle_unknown_index(client, index);
+        return;
+    }
+
+    StringProxy prefixes[parsed_url_t::MAX_QUERY_PARAMS];
+    size_t nprefixes = 0;
+    for (int i = 0; i < url.nparams; ++i) {
+        if (url.params[i].key.equals("q")) {
+            StringProxy q = url.params[i].value;
+            str_lowercase((char*)q.mem_base, q.size());
+            prefixes[nprefixes++] = q;
+        }
+    }
+    if (url.truncated) {
+        handle_too_many_prefixes(client);
+        return;
+    }
+
+    const unsigned int n = suggestion_count(url.query("n"));
+    uint32_t categories;
+    if (!parse_categories(url.query("categories"), categories)) {
+        handle_invalid_categories(client, url.query("categories"));
+        return;
+    }
+    __sync_fetch_and_add(&nreq, nprefixes);
+    const time_t now = ranking_time();
+    StringProxy cb   = url.query("callback");
+    StringProxy type = url.query("type");
+    const bool has_cb = cb.size() != 0;
+
+    local_index_t *li = local_index_acquire(coll);
+    client->response.hold(local_index_release, li);
+    index_t *idx = li->idx;
+
+    pvpi_t ranges[parsed_url_t::MAX_QUERY_PARAMS];
+    idx->pm.query_batch(prefixes, nprefixes, ranges);
+
+    response_t &response = client->response;
+    vsz_t results;
+    results.reserve(n);
+    const bool binary = wants_binary(client, type);
+    if (binary) {
+        append_uint32(response, nprefixes);
+        for (size_t i = 0; i < nprefixes; ++i) {
+            results.clear();
+            idx->suggest(ranges[i], n, now, categories, results);
+            results_binary(*idx, results, response);
+        }
+    }
+    else {
+        if (has_cb) {
+            response.append_copy(cb.mem_base, cb.size());
+            response.append("(");
+        }
+        response.append("[");
+        for (size_t i = 0; i < nprefixes; ++i) {
+            results.clear();
+            idx->suggest(ranges[i], n, now, categories, results);
+            results_json(prefixes[i], *idx, results, type, response);
+            response.append(i + 1 == nprefixes ? "\n" : ",\n");
+        }
+        response.append(has_cb ? "]);\n" : "]\n");
+    }
+
+    // Batches are unlikely to repeat, so they are not cached.
+    const bool gzipped = compress_and_cache(client, NULL, std::string());
+    write_response(client, suggest_header_templates[binary][gzipped]);
+    timer.total(suggest_batch_latency);
+}
+
+static void handle_stats(job_t *job) {
     headers_t headers;
     headers["Cache-Control"] = "no-cache";
 
@@ -708,15 +1494,188 @@ static void handle_stats(client_t *client, parsed_url_t &url) {
     b += sprintf(b, "Answered %lu queries\n", nreq);
     b += sprintf(b, "Uptime: %s\n", get_uptime().c_str());
 
-    if (building) {
-        b += sprintf(b, "Data Store is busy\n");
+    // All the collections, or just the one asked for.
+    collection_t *only = NULL;
+    if (!job->index.empty()) {
+        only = find_collection(job->index.data(), job->index.size());
+        if (!only) {
+            body = "Unknown index '" + job->index + "'\n";
+            job->respond(404, "Not Found", headers, body);
+            return;
+        }
     }
-    else {
-        b += sprintf(b, "Data store size: %d entries\n", pm.repr.size());
+    for (int i = 0; i < MAX_COLLECTIONS && collections[i]; ++i) {
+        collection_t *coll = collections[i];
+        if (only && coll != only) {
+            continue;
+        }
+        b += sprintf(b, "\nIndex: %s\n", coll->name.c_str());
+        if (coll->building) {
+            b += sprintf(b, "Data Store is busy\n");
+        }
+        else {
+            index_t *idx = current_index_acquire(coll);
+            b += sprintf(b, "Data store size: %llu entries\n", (unsigned long long)idx->pm.repr.size());
+            // Sorting is all that a sorted input would save.
+            b += sprintf(b, "Input: %llu sorted run(s), sorted in %.3f sec (%.0f%% of the comparisons of a full sort saved)\n",
+                         (unsigned long long)idx->pm.sorted_runs, idx->sort_usec / 1e6,
+                         idx->pm.sort_work_saved() * 100);
+            if (idx->pm.duplicates_merged) {
+                b += sprintf(b, "Duplicates: %llu copies of phrases merged (%s)\n",
+                             (unsigned long long)idx->pm.duplicates_merged,
+                             duplicate_policy_names[duplicate_policy]);
+            }
+            if (idx->rmq) {
+                b += sprintf(b, "RMQ: %s (%s), %d category RMQ(s)\n", rmq_backend_names[idx->rmq->backend()],
+                             idx->rmq->wide() ? "64-bit" : "32-bit", idx->rmq->category_rmqs());
+            }
+            b += sprintf(b, "Index size: %llu MiB (phrases), %llu MiB (RMQ), %llu MiB (JSON)\n",
+                         (unsigned long long)idx->pm.memory_usage() >> 20,
+                         (unsigned long long)idx->rmq_memory_usage() >> 20,
+                         (unsigned long long)idx->escaped.memory_usage() >> 20);
+            if (idx->snippets.size()) {
+                b += sprintf(b, "Snippet dictionary: %llu distinct snippets, %llu MiB\n",
+                             (unsigned long long)idx->snippets.size(),
+                             (unsigned long long)idx->snippets.memory_usage() >> 20);
+            }
+            index_release(idx);
+        }
+        // There may be up to MAX_COLLECTIONS of these.
+        body.append(buff, b - buff);
+        b = buff;
+    }
+    b += sprintf(b, "\n");
+
+    memory_stats_t ms;
+    if (read_memory_stats(ms)) {
+        b += sprintf(b, "Memory usage: %llu MiB\n", (unsigned long long)ms.rss >> 20);
+    }
+
+    b += sprintf(b, "\nLatency (usec)  %10s %10s %10s %10s %10s\n",
+                 "mean", "p50", "p90", "p99", "p99.9");
+    for (int i = 0; i < NUM_SUGGEST_STAGES + 1; ++i) {
+        const char *name = i < NUM_SUGGEST_STAGES ? suggest_stages[i].name : "total";
+        LatencyHistogram const &h = i < NUM_SUGGEST_STAGES ? *suggest_stages[i].latency : suggest_latency;
+        b += sprintf(b, "%-15s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+                     h.mean_ns() / 1000, h.percentile_ns(0.5) / 1000,
+                     h.percentile_ns(0.9) / 1000, h.percentile_ns(0.99) / 1000,
+                     h.percentile_ns(0.999) / 1000);
     }
-    b += sprintf(b, "Memory usage: %d MiB\n", get_memory_usage(getpid())/1024);
-    body = buff;
-    write_response(client, 200, "OK", headers, body);
+    body.append(buff, b - buff);
+    job->respond(200, "OK", headers, body);
+}
+
+static void handle_metrics(job_t *job) {
+    headers_t headers;
+    headers["Cache-Control"] = "no-cache";
+    headers["Content-Type"] = "text/plain; version=0.0.4";
+
+    std::ostringstream os;
+    os << "# HELP libface_requests_total Number of HTTP requests served, by endpoint.\n";
+    os << "# TYPE libface_requests_total counter\n";
+    for (int i = 0; i < NUM_ENDPOINTS; ++i) {
+        os << "libface_requests_total{endpoint=\"" << endpoint_names[i] << "\"} "
+           << nreq_by_endpoint[i] << "\n";
+    }
+    write_prometheus_header(os, "libface_suggest_latency_seconds", "histogram",
+                            "Time taken to serve a /face/suggest/ request.");
+    suggest_latency.write_prometheus(os, "libface_suggest_latency_seconds", "");
+
+    write_prometheus_header(os, "libface_suggest_batch_latency_seconds", "histogram",
+                            "Time taken to serve a /face/suggest_batch/ request.");
+    suggest_batch_latency.write_prometheus(os, "libface_suggest_batch_latency_seconds", "");
+
+    write_prometheus_header(os, "libface_suggest_stage_latency_seconds", "histogram",
+                            "Time spent in each stage of serving a /face/suggest/ request.");
+    for (int i = 0; i < NUM_SUGGEST_STAGES; ++i) {
+        suggest_stages[i].latency->write_prometheus(os, "libface_suggest_stage_latency_seconds",
+                                                    std::string("stage=\"") + suggest_stages[i].name + "\"");
+    }
+
+    write_prometheus_metric(os, "libface_response_cache_hits_total", "counter",
+                            "Number of /face/suggest/ requests answered from the response cache.",
+                            ncache_hits);
+    write_prometheus_metric(os, "libface_response_cache_misses_total", "counter",
+                            "Number of /face/suggest/ requests not found in the response cache.",
+                            ncache_misses);
+    write_prometheus_metric(os, "libface_gzipped_responses_total", "counter",
+                            "Number of responses sent with Content-Encoding: gzip.", ngzipped);
+    write_prometheus_metric(os, "libface_connections_timed_out_total", "counter",
+                            "Number of connections closed for being idle or too slow to send a request.",
+                            connections_timed_out);
+    write_prometheus_metric(os, "libface_requests_rejected_total", "counter",
+                            "Number of requests refused for exceeding a limit (e.g. --max-body-size).",
+                            requests_rejected);
+    write_prometheus_metric(os, "libface_uptime_seconds", "gauge",
+                            "Time since the server was started.",
+                            time(NULL) - started_at);
+    write_prometheus_metric(os, "libface_imports_total", "counter",
+                            "Number of successful imports.", nimports);
+    write_prometheus_metric(os, "libface_last_import_duration_seconds", "gauge",
+                            "Time taken by the last successful import.",
+                            __sync_fetch_and_add(&last_import_usec, 0) / 1e6);
+    write_prometheus_metric(os, "libface_last_warmup_duration_seconds", "gauge",
+                            "Time taken to warm up the index built by the last successful import.",
+                            __sync_fetch_and_add(&last_warmup_usec, 0) / 1e6);
+    write_prometheus_metric(os, "libface_building", "gauge",
+                            "1 if an import is in progress.", building ? 1 : 0);
+
+    memory_stats_t ms;
+    read_memory_stats(ms);
+    ms.pss = read_pss_bytes();
+    write_prometheus_metric(os, "libface_memory_vsize_bytes", "gauge",
+                            "Virtual memory size of the process.", ms.vsize);
+    write_prometheus_metric(os, "libface_memory_rss_bytes", "gauge",
+                            "Resident set size of the process.", ms.rss);
+    write_prometheus_metric(os, "libface_memory_shared_bytes", "gauge",
+                            "Resident memory backed by files (incl. the input file).", ms.shared);
+    write_prometheus_metric(os, "libface_memory_pss_bytes", "gauge",
+                            "Proportional set size of the process (0 if unavailable).", ms.pss);
+
+    // The collections that are not being imported into.
+    std::vector<index_t*> idxs;
+    std::vector<std::string> labels;
+    for (int i = 0; i < MAX_COLLECTIONS && collections[i]; ++i) {
+        if (!collections[i]->building) {
+            idxs.push_back(current_index_acquire(collections[i]));
+            labels.push_back("index=\"" + collections[i]->name + "\"");
+        }
+    }
+    os << "# HELP libface_phrases Number of phrases in the data store.\n";
+    os << "# TYPE libface_phrases gauge\n";
+    for (size_t i = 0; i < idxs.size(); ++i) {
+        os << "libface_phrases{" << labels[i] << "} " << idxs[i]->pm.repr.size() << "\n";
+    }
+    os << "# HELP libface_sorted_runs Number of sorted runs that the phrases were imported in.\n";
+    os << "# TYPE libface_sorted_runs gauge\n";
+    for (size_t i = 0; i < idxs.size(); ++i) {
+        os << "libface_sorted_runs{" << labels[i] << "} " << idxs[i]->pm.sorted_runs << "\n";
+    }
+    os << "# HELP libface_sort_seconds Time taken to sort the phrases on import.\n";
+    os << "# TYPE libface_sort_seconds gauge\n";
+    for (size_t i = 0; i < idxs.size(); ++i) {
+        os << "libface_sort_seconds{" << labels[i] << "} " << idxs[i]->sort_usec / 1e6 << "\n";
+    }
+    os << "# HELP libface_duplicates_merged Number of copies of phrases merged on import (see --duplicates).\n";
+    os << "# TYPE libface_duplicates_merged gauge\n";
+    for (size_t i = 0; i < idxs.size(); ++i) {
+        os << "libface_duplicates_merged{" << labels[i] << "} " << idxs[i]->pm.duplicates_merged << "\n";
+    }
+    os << "# HELP libface_index_bytes Memory used by each part of the index.\n";
+    os << "# TYPE libface_index_bytes gauge\n";
+    for (size_t i = 0; i < idxs.size(); ++i) {
+        index_t *idx = idxs[i];
+        os << "libface_index_bytes{" << labels[i] << ",structure=\"phrase_map\"} " << idx->pm.memory_usage() << "\n";
+        os << "libface_index_bytes{" << labels[i] << ",structure=\"rmq\"} " << idx->rmq_memory_usage() << "\n";
+        os << "libface_index_bytes{" << labels[i] << ",structure=\"escaped_json\"} " << idx->escaped.memory_usage() << "\n";
+        os << "libface_index_bytes{" << labels[i] << ",structure=\"snippets\"} " << idx->snippets.memory_usage() << "\n";
+        os << "libface_index_bytes{" << labels[i] << ",structure=\"input_mmap\"} "
+           << idx->input_bytes() << "\n";
+        index_release(idx);
+    }
+
+    std::string body = os.str();
+    job->respond(200, "OK", headers, body);
 }
 
 static void handle_invalid_request(client_t *client, parsed_url_t &url) {
@@ -728,25 +1687,92 @@ static void handle_invalid_request(client_t *client, parsed_url_t &url) {
 }
 
 
-void serve_request(client_t *client) {
-    parsed_url_t url;
-    parse_URL(client->url, url);
-    std::string &request_uri = url.path;
-    DCERR("request_uri: " << request_uri << endl);
+inline bool
+path_is(const char *path, size_t len, const char *expected) {
+    return len == strlen(expected) && !memcmp(path, expected, len);
+}
 
-    if (request_uri == "/face/suggest/") {
-        handle_suggest(client, url);
-    }
-    else if (request_uri == "/face/import/") {
-        handle_import(client, url);
-    }
-    else if (request_uri == "/face/export/") {
-        handle_export(client, url);
+// Map a request path to an endpoint. Every path is checked against at
+// most 3 candidates, picked by its first character after "/face/".
+int
+route(StringProxy path) {
+    static const char prefix[] = "/face/";
+    const size_t plen = sizeof(prefix) - 1;
+    if (path.size() <= plen || memcmp(path.mem_base, prefix, plen)) {
+        return ENDPOINT_INVALID;
     }
-    else if (request_uri == "/face/stats/") {
-        handle_stats(client, url);
+    const char *p = path.mem_base + plen;
+    const size_t len = path.size() - plen;
+
+    switch (p[0]) {
+    case 's':
+        if (path_is(p, len, "suggest/")) {
+            return ENDPOINT_SUGGEST;
+        }
+        if (path_is(p, len, "stats/")) {
+            return ENDPOINT_STATS;
+        }
+        if (path_is(p, len, "suggest_batch/")) {
+            return ENDPOINT_SUGGEST_BATCH;
+        }
+        break;
+
+    case 'i':
+        if (path_is(p, len, "import/")) {
+            return ENDPOINT_IMPORT;
+        }
+        break;
+
+    case 'e':
+        if (path_is(p, len, "export/")) {
+            return ENDPOINT_EXPORT;
+        }
+        break;
+
+    case 'm':
+        if (path_is(p, len, "metrics/")) {
+            return ENDPOINT_METRICS;
+        }
+        break;
     }
-    else {
+    return ENDPOINT_INVALID;
+}
+
+void serve_request(client_t *client) {
+    StageTimer timer;
+    parsed_url_t url;
+    parse_URL(client->url, client->body, url, client->scratch);
+    DCERR("request_uri: " << std::string(url.path) << endl);
+
+    const int endpoint = route(url.path);
+    __sync_fetch_and_add(&nreq_by_endpoint[endpoint], 1);
+
+    switch (endpoint) {
+    case ENDPOINT_SUGGEST:
+        handle_suggest(client, url, timer);
+        break;
+
+    case ENDPOINT_IMPORT:
+        defer_job(client, url, handle_import);
+        break;
+
+    case ENDPOINT_EXPORT:
+        defer_job(client, url, handle_export);
+        break;
+
+    case ENDPOINT_STATS:
+        defer_job(client, url, handle_stats);
+        break;
+
+    case ENDPOINT_SUGGEST_BATCH:
+        handle_suggest_batch(client, url, timer);
+        break;
+
+    case ENDPOINT_METRICS:
+        defer_job(client, url, handle_metrics);
+        break;
+
+    default:
         handle_invalid_request(client, url);
     }
 }
@@ -758,9 +1784,60 @@ show_usage(char *argv[]) {
     printf("Start lib-face.\n\n");
     printf("Optional arguments:\n\n");
     printf("-h, --help           This screen\n");
-    printf("-f, --file=PATH      Path of the file containing the phrases\n");
+    printf("-f, --file=PATH      Path of the file containing the phrases. May be a comma separated list\n");
+    printf("                     of files (e.g. the shards of a sorted input), imported into one index.\n");
+    printf("                     Sorted files are merged rather than sorted again\n");
+    printf("-I, --index=NAME=PATH\n");
+    printf("                     Also serve the phrases in PATH as the index NAME, i.e. to requests\n");
+    printf("                     with index=NAME. May be repeated\n");
     printf("-p, --port=PORT      TCP port on which to start lib-face (default: 6767)\n");
     printf("-l, --limit=LIMIT    Load only the first LIMIT lines from PATH (default: -1 [unlimited])\n");
+    printf("-n, --loops=N        Serve requests from N event loops (threads), each with its own\n");
+    printf("                     SO_REUSEPORT listening socket (default: 1)\n");
+    printf("-b, --backlog=N      Backlog of pending connections per listening socket (default: 128)\n");
+    printf("-c, --cache=MB       Size of the response cache of each event loop; 0 disables it (default: 16)\n");
+    printf("-r, --rmq=NAME       The RMQ Data Structure to rank phrases with: sparsetable, segtree,\n");
+    printf("                     bender or auto (sparsetable for small inputs, else bender) (default: auto)\n");
+    printf("-P, --huge-pages     Back the index with 2 MiB pages: from hugetlbfs if any are reserved\n");
+    printf("                     (vm.nr_hugepages), else transparent huge pages\n");
+    printf("-N, --numa           Interleave the index over all the NUMA nodes, & pin event loop i to\n");
+    printf("                     the CPUs of node (i mod # of nodes)\n");
+    printf("-u, --duplicates=POLICY\n");
+    printf("                     What to do with copies of a phrase in the input: keep them all, or\n");
+    printf("                     merge them into the latest one (by timestamp, then input order) with\n");
+    printf("                     the sum or max of their weights, or its own: keep, sum, max or latest.\n");
+    printf("                     A merged phrase is in all the categories of its copies (default: keep)\n");
+    printf("-M, --prefault=POLICY\n");
+    printf("                     How to bring the input file into memory: none (as pages are first\n");
+    printf("                     read), random (... without readahead), willneed (start reading all of\n");
+    printf("                     it in), populate (read all of it in before building the index) or lock\n");
+    printf("                     (... & lock it & the index in memory; see ulimit -l) (default: none)\n");
+    printf("-W, --warmup         Touch every page of a new index before answering queries from it\n");
+    printf("-D, --snippet-dict   Copy the snippets into a dictionary (storing each distinct snippet\n");
+    printf("                     once) & unmap the input file after importing it\n");
+    printf("-C, --ctr-boost=N    Rank phrases by weight + N * click-through rate (default: 0)\n");
+    printf("-F, --freshness-boost=N\n");
+    printf("                     ... + N for phrases updated just now, halving every half-life (default: 0)\n");
+    printf("-L, --half-life=HOURS\n");
+    printf("                     Half-life of the freshness boost (default: 24)\n");
+    printf("                     The click-through rate & update time of a phrase follow its weight in the\n");
+    printf("                     input file, as in \"weight,timestamp,ctr<TAB>phrase<TAB>snippet\"\n");
+    printf("                     A bitmask of the categories of the phrase may follow the ctr, as in\n");
+    printf("                     \"weight,timestamp,ctr,0x5\". Requests with categories=MASK only get\n");
+    printf("                     phrases in any of the categories in MASK (in decimal or hex)\n");
+    printf("-m, --max-connections=N\n");
+    printf("                     Max. # of open connections. The least recently active one is closed\n");
+    printf("                     to make room for a new one (default: as many as RLIMIT_NOFILE allows)\n");
+    printf("-s, --max-body-size=BYTES\n");
+    printf("                     Requests with larger bodies are refused (default: 65536)\n");
+    printf("-i, --idle-timeout=SEC\n");
+    printf("                     Close connections idle between requests this long (default: 60)\n");
+    printf("-H, --header-timeout=SEC\n");
+    printf("                     Close connections that take this long to send the headers of a\n");
+    printf("                     request (default: 10)\n");
+    printf("-B, --body-timeout=SEC\n");
+    printf("                     Close connections that take this long to send the body of a\n");
+    printf("                     request (default: 30). A timeout of 0 disables it\n");
     printf("\n");
     printf("Please visit %s for more information.\n", project_homepage_url);
 }
@@ -773,13 +1850,32 @@ parse_options(int argc, char *argv[]) {
         int option_index = 0;
         static struct option long_options[] = {
             {"file", 1, 0, 'f'},
+            {"index", 1, 0, 'I'},
             {"port", 1, 0, 'p'},
             {"limit", 1, 0, 'l'},
+            {"loops", 1, 0, 'n'},
+            {"backlog", 1, 0, 'b'},
+            {"cache", 1, 0, 'c'},
+            {"rmq", 1, 0, 'r'},
+            {"snippet-dict", 0, 0, 'D'},
+            {"huge-pages", 0, 0, 'P'},
+            {"numa", 0, 0, 'N'},
+            {"duplicates", 1, 0, 'u'},
+            {"prefault", 1, 0, 'M'},
+            {"warmup", 0, 0, 'W'},
+            {"ctr-boost", 1, 0, 'C'},
+            {"freshness-boost", 1, 0, 'F'},
+            {"half-life", 1, 0, 'L'},
+            {"max-connections", 1, 0, 'm'},
+            {"max-body-size", 1, 0, 's'},
+            {"idle-timeout", 1, 0, 'i'},
+            {"header-timeout", 1, 0, 'H'},
+            {"body-timeout", 1, 0, 'B'},
             {"help", 0, 0, 'h'},
             {0, 0, 0, 0}
         };
 
-        c = getopt_long(argc, argv, "f:p:l:h",
+        c = getopt_long(argc, argv, "f:I:p:l:n:b:c:r:u:DPNM:WC:F:L:m:s:i:H:B:h",
                         long_options, &option_index);
 
         if (c == -1)
@@ -792,6 +1888,18 @@ parse_options(int argc, char *argv[]) {
             ac_file = optarg;
             break;
 
+        case 'I': {
+            const char *eq = strchr(optarg, '=');
+            std::string name(optarg, eq ? eq - optarg : 0);
+            if (!eq || !valid_collection_name(name)) {
+                cerr<<"ERROR::Invalid index: "<<optarg<<endl;
+                break;
+            }
+            DCERR("Index: "<<name<<", File: "<<eq + 1<<endl);
+            collection_files.push_back(std::make_pair(name, std::string(eq + 1)));
+            break;
+        }
+
         case 'p':
             DCERR("Port: "<<optarg<<" ("<<atoi(optarg)<<")\n");
             port = atoi(optarg);
@@ -806,6 +1914,113 @@ parse_options(int argc, char *argv[]) {
             DCERR("Limit # of lines to: " << line_limit << endl);
             break;
 
+        case 'n':
+            nloops = atoi(optarg);
+            DCERR("# of event loops: " << nloops << endl);
+            break;
+
+        case 'b':
+            backlog = atoi(optarg);
+            DCERR("Backlog: " << backlog << endl);
+            break;
+
+        case 'c':
+            cache_size = (size_t)atoi(optarg) << 20;
+            DCERR("Response cache size: " << cache_size << endl);
+            break;
+
+        case 'r':
+            rmq_backend = rmq_backend_from_name(optarg);
+            if (rmq_backend == NUM_RMQ_BACKENDS) {
+                cerr<<"ERROR::Invalid RMQ: "<<optarg<<endl;
+                rmq_backend = RMQ_AUTO;
+            }
+            DCERR("RMQ: " << rmq_backend_names[rmq_backend] << endl);
+            break;
+
+        case 'u':
+            duplicate_policy = duplicate_policy_from_name(optarg);
+            if (duplicate_policy == NUM_DUPLICATE_POLICIES) {
+                cerr<<"ERROR::Invalid duplicate policy: "<<optarg<<endl;
+                duplicate_policy = DUPLICATES_KEEP;
+            }
+            DCERR("Duplicates: " << duplicate_policy_names[duplicate_policy] << endl);
+            break;
+
+        case 'D':
+            intern_snippets = true;
+            DCERR("Snippet dictionary: on" << endl);
+            break;
+
+        case 'P':
+            memory_placement().huge_pages = true;
+            DCERR("Huge pages: on" << endl);
+            break;
+
+        case 'N':
+            memory_placement().interleave = true;
+            numa_pin_loops = true;
+            DCERR("NUMA: interleave & pin" << endl);
+            break;
+
+        case 'M':
+            memory_placement().prefault = prefault_policy_from_name(optarg);
+            if (memory_placement().prefault == NUM_PREFAULT_POLICIES) {
+                cerr<<"ERROR::Invalid prefault policy: "<<optarg<<endl;
+                memory_placement().prefault = PREFAULT_NONE;
+            }
+            DCERR("Prefault: " << prefault_policy_names[memory_placement().prefault] << endl);
+            break;
+
+        case 'W':
+            warmup = true;
+            DCERR("Warmup: on" << endl);
+            break;
+
+        case 'C':
+            scoring.ctr_boost = atof(optarg);
+            DCERR("CTR boost: " << scoring.ctr_boost << endl);
+            break;
+
+        case 'F':
+            scoring.freshness_boost = atof(optarg);
+            DCERR("Freshness boost: " << scoring.freshness_boost << endl);
+            break;
+
+        case 'L':
+            scoring.half_life = atof(optarg) * 3600;
+            if (scoring.half_life <= 0) {
+                cerr<<"ERROR::Invalid half-life: "<<optarg<<endl;
+                scoring.half_life = 86400;
+            }
+            DCERR("Half-life: " << scoring.half_life << "sec\n");
+            break;
+
+        case 'm':
+            server_limits.max_connections = atoi(optarg);
+            DCERR("Max. connections: " << server_limits.max_connections << endl);
+            break;
+
+        case 's':
+            server_limits.max_body_size = atoi(optarg);
+            DCERR("Max. body size: " << server_limits.max_body_size << endl);
+            break;
+
+        case 'i':
+            server_limits.idle_timeout = (uint64_t)atoi(optarg) * 1000;
+            DCERR("Idle timeout: " << server_limits.idle_timeout << "ms\n");
+            break;
+
+        case 'H':
+            server_limits.header_timeout = (uint64_t)atoi(optarg) * 1000;
+            DCERR("Header timeout: " << server_limits.header_timeout << "ms\n");
+            break;
+
+        case 'B':
+            server_limits.body_timeout = (uint64_t)atoi(optarg) * 1000;
+            DCERR("Body timeout: " << server_limits.body_timeout << "ms\n");
+            break;
+
         case '?':
             cerr<<"ERROR::Invalid option: "<<optopt<<endl;
             break;
@@ -816,6 +2031,51 @@ parse_options(int argc, char *argv[]) {
 }
 
 
+// Spread the event loops evenly over the NUMA nodes.
+void
+pin_loop(int id) {
+    static const std::vector<int> nodes = numa_nodes();
+    const int node = nodes[id % nodes.size()];
+    if (!pin_to_numa_node(node)) {
+        fprintf(stderr, "WARN::Could not pin event loop %d to NUMA node %d\n", id, node);
+    }
+}
+
+// Returns false if the import failed.
+bool
+import_at_startup(collection_t *coll, const char *file) {
+    size_t nadded, nlines;
+    const time_t start_time = time(NULL);
+    // Nothing else imports at startup.
+    claim_collection(coll);
+    int ret = do_import(coll, file, line_limit, nadded, nlines);
+    release_collection(coll);
+    if (ret < 0) {
+        switch (-ret) {
+        case IMPORT_FILE_NOT_FOUND:
+            fprintf(stderr, "The file '%s' was not found\n", file);
+            break;
+
+        case IMPORT_MUNMAP_FAILED:
+            fprintf(stderr, "munmap(2) on file '%s' failed\n", file);
+            break;
+
+        case IMPORT_MMAP_FAILED:
+            fprintf(stderr, "mmap(2) on file '%s' failed\n", file);
+            break;
+
+        default:
+            cerr<<"ERROR::Unknown error: "<<ret<<endl;
+        }
+        return false;
+    }
+    fprintf(stderr, "INFO::Successfully added %llu/%llu records from \"%s\" into index '%s' in %d second(s)\n",
+            (unsigned long long)nadded, (unsigned long long)nlines, file, coll->name.c_str(),
+            (int)(time(NULL) - start_time));
+    return true;
+}
+
+
 int
 main(int argc, char* argv[]) {
     parse_options(argc, argv);
@@ -828,36 +2088,18 @@ main(int argc, char* argv[]) {
 
     cerr<<"INFO::Starting lib-face on port '"<<port<<"'\n";
 
-    if (ac_file) {
-        int nadded, nlines;
-        const time_t start_time = time(NULL);
-        int ret = do_import(ac_file, line_limit, nadded, nlines);
-        if (ret < 0) {
-            switch (-ret) {
-            case IMPORT_FILE_NOT_FOUND:
-                fprintf(stderr, "The file '%s' was not found\n", ac_file);
-                break;
-
-            case IMPORT_MUNMAP_FAILED:
-                fprintf(stderr, "munmap(2) on file '%s' failed\n", ac_file);
-                break;
-
-            case IMPORT_MMAP_FAILED:
-                fprintf(stderr, "mmap(2) on file '%s' failed\n", ac_file);
-                break;
-
-            default:
-                cerr<<"ERROR::Unknown error: "<<ret<<endl;
-            }
+    if (ac_file && !import_at_startup(collections[0], ac_file)) {
+        return 1;
+    }
+    for (size_t i = 0; i < collection_files.size(); ++i) {
+        collection_t *coll = find_or_add_collection(collection_files[i].first);
+        if (!coll || !import_at_startup(coll, collection_files[i].second.c_str())) {
             return 1;
         }
-        else {
-            fprintf(stderr, "INFO::Successfully added %d/%d records from \"%s\" in %d second(s)\n", 
-                    nadded, nlines, ac_file, (int)(time(NULL) - start_time));
-        }
     }
 
-    int r = httpserver_start(&serve_request, "0.0.0.0", port);
+    int r = httpserver_start(&serve_request, "0.0.0.0", port, nloops, backlog, server_limits,
+                             numa_pin_loops ? pin_loop : NULL, release_replaced_indexes);
     if (r != 0) {
         fprintf(stderr, "ERROR::Could not start the web server\n");
         return 1;
@@ -1,20 +1,37 @@
+#include <include/placement.hpp>
 #include <include/sparsetable.hpp>
 #include <include/segtree.hpp>
 #include <include/benderrmq.hpp>
 #include <include/phrase_map.hpp>
 #include <include/suggest.hpp>
+#include <include/rmq.hpp>
 #include <include/soundex.hpp>
 #include <include/editdistance.hpp>
+#include <include/metrics.hpp>
+#include <include/snippet_dict.hpp>
+#include <include/json_escape.hpp>
+#include <include/mempool.hpp>
+#include <include/gzip.hpp>
+#include <include/response_cache.hpp>
 
 int
 main() {
+    placement::test();
     segtree::test();
     sparsetable::test();
     benderrmq::test();
 
     phrase_map::test();
+    _suggest::test();
+    rmq::test();
     _soundex::test();
     editdistance::test();
+    metrics::test();
+    snippet_dict::test();
+    json_escape::test();
+    mempool::test();
+    gzip::test();
+    response_cache::test();
 
     return 0;
 }
@@ -0,0 +1,362 @@
+/* An HTTP load generator for lib-face.
+ *
+ * Opens many keep-alive connections to a running lib-face, and on
+ * each one "types" queries taken from a query log one keystroke at a
+ * time (i.e. it requests suggestions for every prefix of the query),
+ * optionally pipelining several requests on a connection. Reports
+ * the throughput and the latency distribution of the requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+
+#include "libuv/include/uv.h"
+#include "http-parser/http_parser.h"
+
+#include <include/metrics.hpp>
+
+using namespace std;
+
+const char *host = "127.0.0.1";
+int port = 6767;
+int nconnections = 64;           // # of concurrent connections
+int pipeline_depth = 1;          // Max. # of outstanding requests per connection
+int duration_sec = 10;           // How long to run the benchmark for
+int warmup_sec = 1;              // Requests completing in this period are not counted
+int nresults = 10;               // The 'n' parameter of each request
+const char *queries_file = NULL; // The query log
+bool opt_show_help = false;
+
+static uv_loop_t *uv_loop;
+static http_parser_settings parser_settings;
+static uv_timer_t warmup_timer, stop_timer;
+
+static std::vector<std::string> queries; // The query log
+static bool measuring = false;           // Past the warm-up period?
+static bool stopping = false;            // Past the end of the run?
+static LatencyHistogram latency;         // Latency of all measured requests
+static uint64_t nrequests = 0;           // # of requests completed while measuring
+static uint64_t nerrors = 0;             // # of non-200 responses & connection errors
+static uint64_t measure_start_ticks = 0;
+static uint64_t measure_end_ticks = 0;
+
+struct connection_t {
+    int                 id;              // Index into 'connections'
+    uv_tcp_t            handle;
+    uv_connect_t        connect_req;
+    http_parser         parser;
+    std::deque<uint64_t> sent_at;        // Ticks at which the outstanding requests were written
+    std::string         query;           // The query being typed
+    size_t              typed;           // # of bytes of 'query' already requested
+    unsigned int        rng;             // Per-connection random number state
+};
+
+static std::vector<connection_t*> connections; // Open connections (NULL once closed)
+
+struct write_req_t {
+    uv_write_t  req;
+    std::string data;
+};
+
+static std::string
+url_encode(const char *s, size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string ret;
+    for (size_t i = 0; i < len; ++i) {
+        const unsigned char ch = s[i];
+        if (isalnum(ch) || ch == '-' || ch == '_' || ch == '.') {
+            ret += ch;
+        } else {
+            ret += '%';
+            ret += hex[ch >> 4];
+            ret += hex[ch & 15];
+        }
+    }
+    return ret;
+}
+
+static void
+load_queries(const char *path) {
+    std::ifstream fin(path);
+    std::string line;
+    while (std::getline(fin, line)) {
+        // Accept either a plain list of queries or a lib-face input
+        // file (weight TAB phrase [TAB snippet]).
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos) {
+            line = line.substr(tab + 1);
+            tab = line.find('\t');
+            if (tab != std::string::npos) {
+                line.resize(tab);
+            }
+        }
+        if (!line.empty()) {
+            queries.push_back(line);
+        }
+    }
+}
+
+static void close_connection(connection_t *conn);
+static void on_write(uv_write_t *req, int status);
+
+/* Send the next keystroke on this connection. Once a query has been
+ * typed out completely, pick another one from the log.
+ */
+static void
+send_request(connection_t *conn) {
+    if (conn->typed >= conn->query.size()) {
+        conn->rng = conn->rng * 1103515245 + 12345;
+        conn->query = queries[(conn->rng >> 8) % queries.size()];
+        conn->typed = 0;
+    }
+    ++conn->typed;
+
+    write_req_t *wr = new write_req_t;
+    wr->data.reserve(256);
+    wr->data = "GET /face/suggest/?q=";
+    wr->data += url_encode(conn->query.c_str(), conn->typed);
+    char buff[64];
+    sprintf(buff, "&n=%d HTTP/1.1\r\n", nresults);
+    wr->data += buff;
+    wr->data += "Host: localhost\r\nConnection: Keep-Alive\r\n\r\n";
+
+    uv_buf_t buf;
+    buf.base = (char*)wr->data.c_str();
+    buf.len  = wr->data.size();
+
+    conn->sent_at.push_back(read_ticks());
+    uv_write(&wr->req, (uv_stream_t*)&conn->handle, &buf, 1, on_write);
+}
+
+static void
+fill_pipeline(connection_t *conn) {
+    while (!stopping && (int)conn->sent_at.size() < pipeline_depth) {
+        send_request(conn);
+    }
+}
+
+static void
+on_write(uv_write_t *req, int status) {
+    write_req_t *wr = (write_req_t*)req;
+    delete wr;
+}
+
+static int
+on_message_complete(http_parser *parser) {
+    connection_t *conn = (connection_t*)parser->data;
+    if (conn->sent_at.empty()) {
+        ++nerrors;
+        return 0;
+    }
+
+    const uint64_t now = read_ticks();
+    if (measuring && !stopping) {
+        latency.record(now - conn->sent_at.front());
+        ++nrequests;
+        if (parser->status_code != 200) {
+            ++nerrors;
+        }
+    }
+    conn->sent_at.pop_front();
+    fill_pipeline(conn);
+    return 0;
+}
+
+static void
+on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = (char*)malloc(suggested_size);
+    buf->len  = suggested_size;
+}
+
+static void
+on_close(uv_handle_t *handle) {
+    connection_t *conn = (connection_t*)handle->data;
+    connections[conn->id] = NULL;
+    delete conn;
+}
+
+static void
+close_connection(connection_t *conn) {
+    if (!uv_is_closing((uv_handle_t*)&conn->handle)) {
+        uv_close((uv_handle_t*)&conn->handle, on_close);
+    }
+}
+
+static void
+on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    connection_t *conn = (connection_t*)stream->data;
+    if (nread > 0) {
+        size_t parsed = http_parser_execute(&conn->parser, &parser_settings, buf->base, nread);
+        if (parsed != (size_t)nread) {
+            fprintf(stderr, "Invalid HTTP response: %s\n",
+                    http_errno_name(HTTP_PARSER_ERRNO(&conn->parser)));
+            ++nerrors;
+            close_connection(conn);
+        }
+    } else if (nread < 0) {
+        if (!stopping) {
+            fprintf(stderr, "read: %s\n", uv_strerror(nread));
+            ++nerrors;
+        }
+        close_connection(conn);
+    }
+    free(buf->base);
+}
+
+static void
+on_connect(uv_connect_t *req, int status) {
+    connection_t *conn = (connection_t*)req->data;
+    if (status != 0) {
+        fprintf(stderr, "connect: %s\n", uv_strerror(status));
+        ++nerrors;
+        close_connection(conn);
+        return;
+    }
+    uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read);
+    fill_pipeline(conn);
+}
+
+static void
+on_warmup_done(uv_timer_t *timer) {
+    measuring = true;
+    measure_start_ticks = read_ticks();
+}
+
+static void
+on_stop(uv_timer_t *timer) {
+    stopping = true;
+    measure_end_ticks = read_ticks();
+    uv_close((uv_handle_t*)&warmup_timer, NULL);
+    uv_close((uv_handle_t*)&stop_timer, NULL);
+
+    // Closing all the connections lets uv_run() return.
+    for (size_t i = 0; i < connections.size(); ++i) {
+        if (connections[i]) {
+            close_connection(connections[i]);
+        }
+    }
+}
+
+static void
+show_usage(char *argv[]) {
+    printf("Usage: %s [OPTION]... -q QUERIES\n", basename(argv[0]));
+    printf("Benchmark a running lib-face over HTTP.\n\n");
+    printf("-h, --help            This screen\n");
+    printf("-q, --queries=PATH    Query log: one query per line, or a lib-face input file\n");
+    printf("-H, --host=IP         IP address of lib-face (default: 127.0.0.1)\n");
+    printf("-p, --port=PORT       TCP port of lib-face (default: 6767)\n");
+    printf("-c, --connections=N   # of concurrent keep-alive connections (default: 64)\n");
+    printf("-P, --pipeline=N      Max. # of pipelined requests per connection (default: 1)\n");
+    printf("-d, --duration=SEC    Measure for SEC seconds (default: 10)\n");
+    printf("-w, --warmup=SEC      Warm up for SEC seconds before measuring (default: 1)\n");
+    printf("-n, --results=N       # of suggestions to ask for (default: 10)\n");
+}
+
+static void
+parse_options(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"queries", 1, 0, 'q'},
+        {"host", 1, 0, 'H'},
+        {"port", 1, 0, 'p'},
+        {"connections", 1, 0, 'c'},
+        {"pipeline", 1, 0, 'P'},
+        {"duration", 1, 0, 'd'},
+        {"warmup", 1, 0, 'w'},
+        {"results", 1, 0, 'n'},
+        {"help", 0, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "q:H:p:c:P:d:w:n:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'q': queries_file = optarg; break;
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nconnections = atoi(optarg); break;
+        case 'P': pipeline_depth = atoi(optarg); break;
+        case 'd': duration_sec = atoi(optarg); break;
+        case 'w': warmup_sec = atoi(optarg); break;
+        case 'n': nresults = atoi(optarg); break;
+        case 'h': opt_show_help = true; break;
+        default: opt_show_help = true; break;
+        }
+    }
+}
+
+int
+main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    if (opt_show_help || !queries_file) {
+        show_usage(argv);
+        return opt_show_help ? 0 : 1;
+    }
+
+    load_queries(queries_file);
+    if (queries.empty()) {
+        fprintf(stderr, "ERROR::No queries found in '%s'\n", queries_file);
+        return 1;
+    }
+    if (pipeline_depth < 1) {
+        pipeline_depth = 1;
+    }
+
+    (void) signal(SIGPIPE, SIG_IGN);
+    parser_settings.on_message_complete = on_message_complete;
+    uv_loop = uv_default_loop();
+
+    struct sockaddr_in address;
+    if (uv_ip4_addr(host, port, &address) != 0) {
+        fprintf(stderr, "Invalid address: %s\n", host);
+        return 1;
+    }
+
+    printf("Benchmarking %s:%d with %d connection(s), pipeline depth %d, %d queries\n",
+           host, port, nconnections, pipeline_depth, (int)queries.size());
+
+    for (int i = 0; i < nconnections; ++i) {
+        connection_t *conn = new connection_t;
+        conn->id = i;
+        conn->typed = 0;
+        conn->rng = i * 7919 + 1;
+        uv_tcp_init(uv_loop, &conn->handle);
+        uv_tcp_nodelay(&conn->handle, 1);
+        http_parser_init(&conn->parser, HTTP_RESPONSE);
+        conn->handle.data = conn;
+        conn->parser.data = conn;
+        conn->connect_req.data = conn;
+        connections.push_back(conn);
+        uv_tcp_connect(&conn->connect_req, &conn->handle,
+                       (const struct sockaddr*)&address, on_connect);
+    }
+
+    uv_timer_init(uv_loop, &warmup_timer);
+    uv_timer_init(uv_loop, &stop_timer);
+    uv_timer_start(&warmup_timer, on_warmup_done, warmup_sec * 1000, 0);
+    uv_timer_start(&stop_timer, on_stop, (warmup_sec + duration_sec) * 1000, 0);
+
+    uv_run(uv_loop, UV_RUN_DEFAULT);
+
+    const double elapsed_sec = measuring ?
+        (measure_end_ticks - measure_start_ticks) * ns_per_tick() / 1e9 : 0;
+    printf("\n");
+    printf("Requests:   %llu (%llu errors)\n",
+           (unsigned long long)nrequests, (unsigned long long)nerrors);
+    printf("Throughput: %.1f req/sec\n", elapsed_sec > 0 ? nrequests / elapsed_sec : 0.0);
+    printf("Latency:    mean %.1f usec, p50 %.1f usec, p90 %.1f usec, p99 %.1f usec, p99.9 %.1f usec\n",
+           latency.mean_ns() / 1000, latency.percentile_ns(0.5) / 1000,
+           latency.percentile_ns(0.9) / 1000, latency.percentile_ns(0.99) / 1000,
+           latency.percentile_ns(0.999) / 1000);
+
+    return nerrors ? 2 : 0;
+}
@@ -30,7 +30,7 @@ test_segtree(vui_t &input, vpui_t &queries, vui_t &expected) {
     clock_t start, end;
     start = clock();
 
-    SegmentTree st;
+    SegmentTree<> st;
     st.initialize(input);
 
     end = clock();
@@ -55,7 +55,7 @@ test_sparsetable(vui_t &input, vpui_t &queries, vui_t &expected) {
     clock_t start, end;
     start = clock();
 
-    SparseTable st;
+    SparseTable<> st;
     st.initialize(input);
 
     end = clock();
@@ -79,7 +79,7 @@ test_benderrmq(vui_t &input, vpui_t &queries, vui_t &expected) {
     clock_t start, end;
     start = clock();
 
-    BenderRMQ brmq;
+    BenderRMQ<> brmq;
     brmq.initialize(input);
 
     end = clock();
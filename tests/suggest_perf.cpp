@@ -0,0 +1,389 @@
+/* Benchmark for suggest() over a realistic corpus.
+ *
+ * The corpus is either loaded from a lib-face input file (-f) or
+ * generated: phrases of 1-4 words where both the words and the phrase
+ * weights follow a Zipfian distribution, so that popular words start
+ * many phrases (realistic prefix sharing) and a few phrases carry
+ * most of the weight.
+ *
+ * Queries are prefixes of phrases picked in proportion to their
+ * weight (popular queries are typed more often), truncated to
+ * various lengths and asked for various # of results.
+ *
+ * The RMQ implementation is chosen with --rmq (as for lib-face).
+ * 'make bench-suggest' runs this once per implementation.
+ *
+ * With --huge-pages the index is backed by 2 MiB pages (as for
+ * lib-face). The dTLB misses per query are reported where the kernel
+ * lets us count them (see perf_event_paranoid), and as "n/a" where it
+ * doesn't.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <include/segtree.hpp>
+#include <include/sparsetable.hpp>
+#include <include/benderrmq.hpp>
+#include <include/phrase_map.hpp>
+#include <include/suggest.hpp>
+#include <include/rmq.hpp>
+#include <include/types.hpp>
+#include <include/utils.hpp>
+#include <include/metrics.hpp>
+#include <include/placement.hpp>
+
+using namespace std;
+
+int nphrases = 1000000;        // # of phrases to generate
+int nwords = 50000;            // Size of the vocabulary to generate phrases from
+int nqueries = 200000;         // # of queries per workload
+double zipf_s = 1.0;           // Exponent of the Zipfian distributions
+unsigned int seed = 1;
+const char *input_file = NULL; // Load the corpus from this file instead
+rmq_backend_t rmq_backend = RMQ_AUTO;
+bool opt_show_help = false;
+
+// Counts the dTLB load misses of this thread (in user space), if the
+// kernel allows it.
+class TLBMissCounter {
+    int fd;
+
+public:
+    TLBMissCounter() {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        this->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~TLBMissCounter() {
+        if (this->fd != -1) {
+            close(this->fd);
+        }
+    }
+
+    bool
+    available() const {
+        return this->fd != -1;
+    }
+
+    void
+    start() {
+        if (this->fd != -1) {
+            ioctl(this->fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(this->fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    uint64_t
+    stop() {
+        uint64_t count = 0;
+        if (this->fd != -1) {
+            ioctl(this->fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(this->fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+        return count;
+    }
+};
+
+// The # of bytes of anonymous memory backed by transparent huge pages.
+uint64_t
+anon_huge_page_bytes() {
+    FILE *pf = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    unsigned long long kb = 0;
+    while (pf && fgets(line, sizeof(line), pf)) {
+        if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (pf) {
+        fclose(pf);
+    }
+    return kb << 10;
+}
+
+// A small, fast & deterministic PRNG (xorshift64*).
+struct Random {
+    uint64_t state;
+
+    Random(uint64_t s)
+        : state(s * 2685821657736338717ULL + 1) { }
+
+    uint64_t
+    next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    // Uniform in [0, 1)
+    double
+    uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+// Samples ranks in [0, n) with P(rank = r) proportional to 1/(r+1)^s.
+class ZipfSampler {
+    std::vector<double> cdf;
+
+public:
+    ZipfSampler(uint_t n, double s) {
+        cdf.resize(n);
+        double sum = 0;
+        for (uint_t i = 0; i < n; ++i) {
+            sum += 1.0 / pow(i + 1, s);
+            cdf[i] = sum;
+        }
+        for (uint_t i = 0; i < n; ++i) {
+            cdf[i] /= sum;
+        }
+    }
+
+    uint_t
+    sample(Random &rng) const {
+        return std::lower_bound(cdf.begin(), cdf.end(), rng.uniform()) - cdf.begin();
+    }
+};
+
+std::string
+random_word(Random &rng) {
+    // Word lengths between 2 & 10, skewed towards shorter words. The
+    // letters are skewed too, to get a realistic branching factor.
+    static const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+    const int len = 2 + (rng.next() % 5) + (rng.next() % 5);
+    std::string w;
+    for (int i = 0; i < len; ++i) {
+        w += letters[(rng.next() % 26) * (rng.next() % 26) / 26];
+    }
+    return w;
+}
+
+void
+generate_corpus(PhraseMap &pm) {
+    Random rng(seed);
+    std::vector<std::string> vocab(nwords);
+    for (int i = 0; i < nwords; ++i) {
+        vocab[i] = random_word(rng);
+    }
+
+    ZipfSampler words(nwords, zipf_s);
+    for (int i = 0; i < nphrases; ++i) {
+        const int nw = 1 + rng.next() % 4;
+        std::string phrase = vocab[words.sample(rng)];
+        for (int j = 1; j < nw; ++j) {
+            phrase += " " + vocab[words.sample(rng)];
+        }
+        // The i'th phrase has the i'th highest weight.
+        const uint_t weight = (uint_t)(1e9 / pow(i + 1, zipf_s)) + 1;
+        pm.insert(weight, phrase, StringProxy());
+    }
+}
+
+void
+load_corpus(PhraseMap &pm, const char *path) {
+    std::ifstream fin(path);
+    std::string line;
+    while (std::getline(fin, line)) {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        const size_t tab2 = line.find('\t', tab + 1);
+        std::string phrase = line.substr(tab + 1, tab2 == std::string::npos ? tab2 : tab2 - tab - 1);
+        std::transform(phrase.begin(), phrase.end(), phrase.begin(), ::tolower);
+        pm.insert(strtoul(line.c_str(), NULL, 10), phrase, StringProxy());
+    }
+}
+
+void
+run_workload(PhraseMap &pm, PhraseRMQ &st, std::vector<std::string> const &prefixes, uint_t n) {
+    LatencyHistogram query_latency, expand_latency, total_latency;
+    uint64_t nresults = 0;
+    TLBMissCounter tlb;
+
+    tlb.start();
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        StageTimer timer;
+        pvpi_t range = pm.query(prefixes[i]);
+        timer.lap(query_latency);
+        vsz_t results;
+        st.suggest(pm, range, n, 0, 0, results);
+        timer.lap(expand_latency);
+        timer.total(total_latency);
+        nresults += results.size();
+    }
+    const uint64_t tlb_misses = tlb.stop();
+
+    LatencyHistogram *stages[] = { &query_latency, &expand_latency, &total_latency };
+    const char *names[] = { "query", "suggest", "total" };
+    for (int i = 0; i < 3; ++i) {
+        LatencyHistogram const &h = *stages[i];
+        printf("  %-8s %8.2f %8.2f %8.2f %8.2f %8.2f", names[i],
+               h.mean_ns() / 1000, h.percentile_ns(0.5) / 1000,
+               h.percentile_ns(0.9) / 1000, h.percentile_ns(0.99) / 1000,
+               h.percentile_ns(0.999) / 1000);
+        if (i == 2) {
+            printf("   avg. %.1f results", (double)nresults / prefixes.size());
+            if (tlb.available()) {
+                printf(", %.1f dTLB misses", (double)tlb_misses / prefixes.size());
+            } else {
+                printf(", dTLB misses n/a");
+            }
+        }
+        printf("\n");
+    }
+}
+
+void
+show_usage(char *argv[]) {
+    printf("Usage: %s [OPTION]...\n", basename(argv[0]));
+    printf("Benchmark suggest().\n\n");
+    printf("-h, --help          This screen\n");
+    printf("-r, --rmq=NAME      sparsetable, segtree, bender or auto (default: auto)\n");
+    printf("-f, --file=PATH     Load the corpus from a lib-face input file\n");
+    printf("-p, --phrases=N     # of phrases to generate (default: 1000000)\n");
+    printf("-w, --words=N       Size of the generated vocabulary (default: 50000)\n");
+    printf("-q, --queries=N     # of queries per workload (default: 200000)\n");
+    printf("-z, --zipf=S        Exponent of the Zipfian distributions (default: 1.0)\n");
+    printf("-s, --seed=N        Random seed (default: 1)\n");
+    printf("-H, --huge-pages    Back the index with 2 MiB pages\n");
+}
+
+void
+parse_options(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"file", 1, 0, 'f'},
+        {"phrases", 1, 0, 'p'},
+        {"words", 1, 0, 'w'},
+        {"queries", 1, 0, 'q'},
+        {"zipf", 1, 0, 'z'},
+        {"seed", 1, 0, 's'},
+        {"rmq", 1, 0, 'r'},
+        {"huge-pages", 0, 0, 'H'},
+        {"help", 0, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "f:p:w:q:z:s:r:Hh", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'f': input_file = optarg; break;
+        case 'p': nphrases = atoi(optarg); break;
+        case 'w': nwords = atoi(optarg); break;
+        case 'q': nqueries = atoi(optarg); break;
+        case 'z': zipf_s = atof(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        case 'H': memory_placement().huge_pages = true; break;
+        case 'r':
+            rmq_backend = rmq_backend_from_name(optarg);
+            opt_show_help = rmq_backend == NUM_RMQ_BACKENDS;
+            break;
+        default: opt_show_help = true; break;
+        }
+    }
+}
+
+int
+main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    if (opt_show_help) {
+        show_usage(argv);
+        return 0;
+    }
+
+    PhraseMap pm(0);
+    uint64_t start = monotonic_usec();
+    if (input_file) {
+        load_corpus(pm, input_file);
+    } else {
+        generate_corpus(pm);
+    }
+    const uint64_t load_usec = monotonic_usec() - start;
+    if (pm.repr.empty()) {
+        fprintf(stderr, "No phrases to benchmark%s%s\n",
+                input_file ? " in " : "", input_file ? input_file : "");
+        return 1;
+    }
+
+    start = monotonic_usec();
+    pm.finalize();
+    const uint64_t sort_usec = monotonic_usec() - start;
+
+    start = monotonic_usec();
+    PhraseRMQ *st = make_phrase_rmq(pm, rmq_backend);
+    const uint64_t rmq_usec = monotonic_usec() - start;
+
+    printf("RMQ: %s (%s)\n", rmq_backend_names[st->backend()], st->wide() ? "64-bit" : "32-bit");
+    const size_t np = pm.repr.size();
+    printf("Phrases: %u (%s in %.3f sec)\n", (uint_t)np,
+           input_file ? "loaded" : "generated", load_usec / 1e6);
+    printf("Build time: PhraseMap %.3f sec, RMQ %.3f sec\n", sort_usec / 1e6, rmq_usec / 1e6);
+    printf("Memory per phrase: PhraseMap %.1f bytes, RMQ %.1f bytes\n",
+           (double)pm.memory_usage() / np, (double)st->memory_usage() / np);
+    printf("Huge pages: %s (%llu MiB of transparent huge pages)\n",
+           memory_placement().huge_pages ? "on" : "off",
+           (unsigned long long)anon_huge_page_bytes() >> 20);
+
+    // Pick the phrases to type in proportion to their weight.
+    std::vector<double> cdf(np);
+    double sum = 0;
+    for (size_t i = 0; i < np; ++i) {
+        sum += pm.repr[i].weight;
+        cdf[i] = sum;
+    }
+    Random rng(seed + 1);
+    std::vector<std::string> typed(nqueries);
+    for (int i = 0; i < nqueries; ++i) {
+        const size_t pi = std::lower_bound(cdf.begin(), cdf.end(), rng.uniform() * sum) - cdf.begin();
+        typed[i] = pm.repr[pi < np ? pi : np - 1].phrase;
+    }
+
+    const size_t prefix_lengths[] = { 1, 2, 3, 5, 8, 1000 };
+    const uint_t ns[] = { 1, 10, 32 };
+
+    for (size_t li = 0; li < sizeof(prefix_lengths) / sizeof(prefix_lengths[0]); ++li) {
+        std::vector<std::string> prefixes(nqueries);
+        for (int i = 0; i < nqueries; ++i) {
+            prefixes[i] = typed[i].substr(0, prefix_lengths[li]);
+        }
+        char len_str[32] = "full";
+        if (prefix_lengths[li] < 1000) {
+            sprintf(len_str, "%u", (uint_t)prefix_lengths[li]);
+        }
+        for (size_t ni = 0; ni < sizeof(ns) / sizeof(ns[0]); ++ni) {
+            printf("\nPrefix length: %s, n: %u\n", len_str, ns[ni]);
+            printf("  %-8s %8s %8s %8s %8s %8s  (usec)\n", "", "mean", "p50", "p90", "p99", "p99.9");
+            run_workload(pm, *st, prefixes, ns[ni]);
+        }
+    }
+
+    delete st;
+    return 0;
+}